@@ -1,4 +1,5 @@
 #include "ARMInstruction.h"
+#include "ARMInterpreter.h"
 
 #include <vector>
 #include <cassert>
@@ -42,345 +43,498 @@ struct ARMControlBits
 struct ARMField
 {
 	u8 h, l;
-	const char* name;
+	u8 DecodedInstruction::* field8 = nullptr;
+	u16 DecodedInstruction::* field16 = nullptr;
+	u32 DecodedInstruction::* field32 = nullptr;
+
+	ARMField(u8 h, u8 l, u8 DecodedInstruction::* field) : h(h), l(l), field8(field) { }
+	ARMField(u8 h, u8 l, u16 DecodedInstruction::* field) : h(h), l(l), field16(field) { }
+	ARMField(u8 h, u8 l, u32 DecodedInstruction::* field) : h(h), l(l), field32(field) { }
+
+	inline void extract(u32 opcode, DecodedInstruction& data) const
+	{
+		u32 value = __get_bits__(opcode, h, l);
+		if (field8) data.*field8 = (u8)value;
+		else if (field16) data.*field16 = (u16)value;
+		else data.*field32 = value;
+	}
 };
 
+#define __field__(name) &DecodedInstruction::name
+
 struct ARMFilterData
 {
 	ARMInstruction::Type type = ARMInstruction::Type::Unknown;
 	vector<ARMControlBits> control_bits;
 	vector<ARMField> fields;		
 
-	inline bool test_control_bits(u32 opcode, map<string, u32>& data, ARMInstruction::Type& type) const
-	{		
+	/// <summary>
+	/// Folds the control bits into a single mask/value test
+	/// </summary>	
+	inline void control_mask(u32& mask, u32& bits) const
+	{
+		mask = bits = 0;
 		for (const auto& cb : control_bits)
 		{
-			if (!__has_bits__(opcode, cb.h, cb.l, cb.val))
-			{								
-				return false;
-			}
-		}		
-		type = this->type;
-		data.clear();
+			u32 cb_mask = (u32)(((1ULL << (cb.h - cb.l + 1)) - 1) << cb.l);
+			mask |= cb_mask;
+			bits |= (cb.val << cb.l) & cb_mask;
+		}
+	}
+
+	inline void extract_fields(DecodedInstruction& data) const
+	{		
 		for (const auto& field : fields)
 		{
 			assert(field.h >= field.l);
-			data[field.name] = __get_bits__(opcode, field.h, field.l);
+			field.extract(data.opcode, data);
 		}
-		
-		return true;
 	}
 
 };
 
+// Entries are listed by decode priority: when several valid interpretations exist, the first one wins
 static const ARMFilterData ARM_INSTR_TYPES[] =
 {
 	{
 		ARMInstruction::Type::DataProc_Reg_ShImm, 
 		{ {27,25,0b000}, {4,4,0b0} },
 		{ 
-			{31,28,"Cond"}, 
-			{24,21,"Op"}, 
-			{20,20,"S"},
-			{19,16,"Rn"},
-			{15,12,"Rd"},
-			{11,7,"Shift"},
-			{6,5,"Typ"},
-			{3,0,"Rm"},
+			{31,28,__field__(Cond)}, 
+			{24,21,__field__(Op)}, 
+			{20,20,__field__(S)},
+			{19,16,__field__(Rn)},
+			{15,12,__field__(Rd)},
+			{11,7,__field__(Shift)},
+			{6,5,__field__(Typ)},
+			{3,0,__field__(Rm)},
 		}		
 	},
 	{
 		ARMInstruction::Type::DataProc_Reg_ShReg,
 		{ {27,25,0b000}, {7,7,0b0}, {4,4,0b1} },
 		{
-			{31,28,"Cond"},
-			{24,21,"Op"},
-			{20,20,"S"},
-			{19,16,"Rn"},
-			{15,12,"Rd"},
-			{11,8,"Rs"},
-			{6,5,"Typ"},
-			{3,0,"Rm"},
+			{31,28,__field__(Cond)},
+			{24,21,__field__(Op)},
+			{20,20,__field__(S)},
+			{19,16,__field__(Rn)},
+			{15,12,__field__(Rd)},
+			{11,8,__field__(Rs)},
+			{6,5,__field__(Typ)},
+			{3,0,__field__(Rm)},
 		}
 	},
 	{
 		ARMInstruction::Type::DataProc_Imm,
 		{ {27,25,0b001}},
 		{
-			{31,28,"Cond"},
-			{24,21,"Op"},
-			{20,20,"S"},
-			{19,16,"Rn"},
-			{15,12,"Rd"},
-			{11,8,"Shift"},
-			{7,0,"Immediate"},			
+			{31,28,__field__(Cond)},
+			{24,21,__field__(Op)},
+			{20,20,__field__(S)},
+			{19,16,__field__(Rn)},
+			{15,12,__field__(Rd)},
+			{11,8,__field__(Shift)},
+			{7,0,__field__(Immediate)},			
 		}
 	},
 	{
 		ARMInstruction::Type::PSR_Imm,
 		{ {27,23,0b00110}, {21,20,0b10}},
 		{
-			{31,28,"Cond"},
-			{22,22,"P"},
-			{19,16,"Field"},
-			{15,12,"Rd"},
-			{11,8,"Shift"},
-			{7,0,"Immediate"},
+			{31,28,__field__(Cond)},
+			{22,22,__field__(P)},
+			{19,16,__field__(Field)},
+			{15,12,__field__(Rd)},
+			{11,8,__field__(Shift)},
+			{7,0,__field__(Immediate)},
 		}
 	},
 	{
 		ARMInstruction::Type::PSR_Reg,
 		{ {27,23,0b00010}, {20,20,0b0}, {11,4,0b00000000} },
 		{
-			{31,28,"Cond"},
-			{22,22,"P"},
-			{21,21,"L"},
-			{19,16,"Field"},
-			{15,12,"Rd"},			
-			{3,0,"Rm"},
+			{31,28,__field__(Cond)},
+			{22,22,__field__(P)},
+			{21,21,__field__(L)},
+			{19,16,__field__(Field)},
+			{15,12,__field__(Rd)},			
+			{3,0,__field__(Rm)},
 		}
 	},
 	{
 		ARMInstruction::Type::BX_BLX,
 		{ {27,6,0b0001001011111111111100}, {4,4,0b1} },
 		{
-			{31,28,"Cond"},			
-			{5,5,"L"},			
-			{3,0,"Rn"},
+			{31,28,__field__(Cond)},			
+			{5,5,__field__(L)},			
+			{3,0,__field__(Rn)},
 		}
 	},
 	{
 		ARMInstruction::Type::Multiply,
 		{ {27,22,0b000000}, {7,4,0b1001} },
 		{
-			{31,28,"Cond"},
-			{21,21,"A"},
-			{20,20,"S"},			
-			{19,16,"Rn"},
-			{15,12,"Rd"},
-			{11,8,"Rs"},
-			{3,0,"Rm"},
+			{31,28,__field__(Cond)},
+			{24,21,__field__(Op)},
+			{21,21,__field__(A)},
+			{20,20,__field__(S)},			
+			{19,16,__field__(Rn)},
+			{15,12,__field__(Rd)},
+			{11,8,__field__(Rs)},
+			{3,0,__field__(Rm)},
 		}
 	},
 	{
 		ARMInstruction::Type::MulLong,
 		{ {27,23,0b00001}, {7,4,0b1001} },
 		{
-			{31,28,"Cond"},
-			{22,22,"U"},
-			{21,21,"A"},
-			{20,20,"S"},
-			{19,16,"RdHi"},
-			{15,12,"RdLo"},
-			{11,8,"Rs"},
-			{3,0,"Rm"},
+			{31,28,__field__(Cond)},
+			{24,21,__field__(Op)},
+			{22,22,__field__(U)},
+			{21,21,__field__(A)},
+			{20,20,__field__(S)},
+			{19,16,__field__(RdHi)},
+			{15,12,__field__(RdLo)},
+			{11,8,__field__(Rs)},
+			{3,0,__field__(Rm)},
 		}
 	},
 	{
 		ARMInstruction::Type::TransSwp12,
 		{ {27,23,0b00010}, {21,20,0b00}, {11,4,0b00001001} },
 		{
-			{31,28,"Cond"},
-			{22,22,"B"},
-			{19,16,"Rn"},
-			{15,12,"Rd"},
-			{3,0,"Rm"},			
+			{31,28,__field__(Cond)},
+			{22,22,__field__(B)},
+			{19,16,__field__(Rn)},
+			{15,12,__field__(Rd)},
+			{3,0,__field__(Rm)},			
 		}
 	},
 	{
 		ARMInstruction::Type::TransReg10,
 		{ {27,25,0b000}, {22,22,0b0}, {11,7,0b00001}, {4,4,0b1} },
 		{
-			{31,28,"Cond"},
-			{24,24,"P"},
-			{23,23,"U"},			
-			{21,21,"W"},
-			{20,20,"L"},
-			{19,16,"Rn"},
-			{15,12,"Rd"},
-			{6,6,"S"},
-			{5,5,"H"},
-			{3,0,"Rm"},
+			{31,28,__field__(Cond)},
+			{24,24,__field__(P)},
+			{23,23,__field__(U)},			
+			{21,21,__field__(W)},
+			{20,20,__field__(L)},
+			{19,16,__field__(Rn)},
+			{15,12,__field__(Rd)},
+			{6,6,__field__(S)},
+			{5,5,__field__(H)},
+			{3,0,__field__(Rm)},
 		}
 	},
 	{
 		ARMInstruction::Type::TransImm10,
 		{ {27,25,0b000}, {22,22,0b1}, {7,7,0b1}, {4,4,0b1} },
 		{
-			{31,28,"Cond"},
-			{24,24,"P"},
-			{23,23,"U"},
-			{21,21,"W"},
-			{20,20,"L"},
-			{19,16,"Rn"},
-			{15,12,"Rd"},
-			{11,8,"OffsetH"},
-			{6,6,"S"},
-			{5,5,"H"},
-			{3,0,"OffsetL"},
+			{31,28,__field__(Cond)},
+			{24,24,__field__(P)},
+			{23,23,__field__(U)},
+			{21,21,__field__(W)},
+			{20,20,__field__(L)},
+			{19,16,__field__(Rn)},
+			{15,12,__field__(Rd)},
+			{11,8,__field__(OffsetH)},
+			{6,6,__field__(S)},
+			{5,5,__field__(H)},
+			{3,0,__field__(OffsetL)},
 		}
 	},
 	{
 		ARMInstruction::Type::TransImm9,
 		{ {27,25,0b010} },
 		{
-			{31,28,"Cond"},
-			{24,24,"P"},
-			{23,23,"U"},
-			{22,22,"B"},
-			{21,21,"W"},
-			{20,20,"L"},
-			{19,16,"Rn"},
-			{15,12,"Rd"},
-			{11,0,"Offset"},			
+			{31,28,__field__(Cond)},
+			{24,24,__field__(P)},
+			{23,23,__field__(U)},
+			{22,22,__field__(B)},
+			{21,21,__field__(W)},
+			{20,20,__field__(L)},
+			{19,16,__field__(Rn)},
+			{15,12,__field__(Rd)},
+			{11,0,__field__(Offset)},			
 		}
 	},
 	{
 		ARMInstruction::Type::TransReg9,
 		{ {27,25,0b011}, {4,4,0b0} },
 		{
-			{31,28,"Cond"},
-			{24,24,"P"},
-			{23,23,"U"},
-			{22,22,"B"},
-			{21,21,"W"},
-			{20,20,"L"},
-			{19,16,"Rn"},
-			{15,12,"Rd"},
-			{11,7,"Shift"},
-			{6,5,"Typ"},
-			{3,0,"Rm"},
+			{31,28,__field__(Cond)},
+			{24,24,__field__(P)},
+			{23,23,__field__(U)},
+			{22,22,__field__(B)},
+			{21,21,__field__(W)},
+			{20,20,__field__(L)},
+			{19,16,__field__(Rn)},
+			{15,12,__field__(Rd)},
+			{11,7,__field__(Shift)},
+			{6,5,__field__(Typ)},
+			{3,0,__field__(Rm)},
 		}
 	},
 	{
 		ARMInstruction::Type::Undefined,
 		{ {27,25,0b011}, {4,4,0b1} },
 		{
-			{31,28,"Cond"},
+			{31,28,__field__(Cond)},
 		}
 	},
 	{
 		ARMInstruction::Type::BlockTrans,
 		{ {27,25,0b100}},
 		{
-			{31,28,"Cond"},
-			{24,24,"P"},
-			{23,23,"U"},
-			{22,22,"S"},
-			{21,21,"W"},
-			{20,20,"L"},
-			{19,16,"Rn"},
-			{15,0,"RegList"},
+			{31,28,__field__(Cond)},
+			{24,24,__field__(P)},
+			{23,23,__field__(U)},
+			{22,22,__field__(S)},
+			{21,21,__field__(W)},
+			{20,20,__field__(L)},
+			{19,16,__field__(Rn)},
+			{15,0,__field__(RegList)},
 		}
 	},
 	{
 		ARMInstruction::Type::B_BL_BLX_Offset,
 		{ {27,25,0b101}},
 		{
-			{31,28,"Cond"},
-			{24,24,"L"},
-			{23,0,"Offset"},
+			{31,28,__field__(Cond)},
+			{24,24,__field__(L)},
+			{23,0,__field__(Offset)},
 		}
 	},
 	{
 		ARMInstruction::Type::CoDataTrans,
 		{ {27,25,0b110}},
 		{
-			{31,28,"Cond"},
-			{24,24,"P"},
-			{23,23,"U"},
-			{22,22,"N"},
-			{21,21,"W"},
-			{20,20,"L"},
-			{19,16,"Rn"},
-			{15,12,"CRd"},
-			{11,8,"CP#"},
-			{7,0,"Offset"},
+			{31,28,__field__(Cond)},
+			{24,24,__field__(P)},
+			{23,23,__field__(U)},
+			{22,22,__field__(N)},
+			{21,21,__field__(W)},
+			{20,20,__field__(L)},
+			{19,16,__field__(Rn)},
+			{15,12,__field__(CRd)},
+			{11,8,__field__(CPn)},
+			{7,0,__field__(Offset)},
 		}
 	},
 	{
 		ARMInstruction::Type::CoDataOp,
 		{ {27,24,0b1110}, {4,4,0b0}},
 		{
-			{31,28,"Cond"},
-			{23,20,"CPopc"},
-			{19,16,"CRn"},
-			{15,12,"CRd"},
-			{11,8,"CP#"},
-			{7,5,"CP"},
-			{3,0,"CRm"},
+			{31,28,__field__(Cond)},
+			{23,20,__field__(CPopc)},
+			{19,16,__field__(CRn)},
+			{15,12,__field__(CRd)},
+			{11,8,__field__(CPn)},
+			{7,5,__field__(CP)},
+			{3,0,__field__(CRm)},
 		}
 	},
 	{
 		ARMInstruction::Type::CoRegTrans,
 		{ {27,24,0b1110}, {4,4,0b1}},
 		{
-			{31,28,"Cond"},
-			{23,21,"CPopc"},
-			{20,20,"L"},
-			{19,16,"CRn"},
-			{15,12,"Rd"},
-			{11,8,"CP#"},
-			{7,5,"CP"},
-			{3,0,"CRm"},
+			{31,28,__field__(Cond)},
+			{23,21,__field__(CPopc)},
+			{20,20,__field__(L)},
+			{19,16,__field__(CRn)},
+			{15,12,__field__(Rd)},
+			{11,8,__field__(CPn)},
+			{7,5,__field__(CP)},
+			{3,0,__field__(CRm)},
 		}
 	},
 	{
 		ARMInstruction::Type::SWI,
-		{ {27,24,0b1111}, {4,4,0b1}},
+		{ {27,24,0b1111}},
 		{
-			{31,28,"Cond"},
-			{23,0, "Ignored"}
+			{31,28,__field__(Cond)},
+			{23,0,__field__(Immediate)}
 		}
 	},
 };
 
 static const int ARM_INSTR_TYPES_SIZE = sizeof(ARM_INSTR_TYPES) / sizeof(ARMFilterData);
 
-ARMInstruction::ARMInstruction(u32 address, u32 opcode) : opcode(opcode) 
+// The decode table is indexed by opcode bits [27:20] and [7:4]
+static const u32 ARM_DECODE_INDEX_MASK = 0x0FF000F0;
+
+static inline u32 arm_decode_index(u32 opcode)
+{
+	return ((opcode >> 16) & 0xFF0) | ((opcode >> 4) & 0xF);
+}
+
+struct ARMDecodeCandidate
+{
+	/// <summary>
+	/// Control bits not covered by the table index
+	/// </summary>
+	u32 mask, bits;
+	u8 filter_index;
+	bool validate;
+};
+
+struct ARMDecodeEntry
+{
+	u16 first = 0;
+	u8 count = 0;
+};
+
+/// <summary>
+/// 4096-entry decode table generated from ARM_INSTR_TYPES. Each entry lists, in ARM_INSTR_TYPES order,
+/// the filters whose control bits agree with the index bits; the first one that matches the remaining
+/// bits and passes validation wins.
+/// </summary>
+class ARMDecodeTable
+{
+private:
+	ARMDecodeEntry entries[4096];
+	vector<ARMDecodeCandidate> candidates;
+public:
+	ARMDecodeTable()
+	{
+		u32 masks[ARM_INSTR_TYPES_SIZE], bits[ARM_INSTR_TYPES_SIZE];
+		for (int i = 0; i < ARM_INSTR_TYPES_SIZE; i++)
+		{
+			ARM_INSTR_TYPES[i].control_mask(masks[i], bits[i]);
+		}
+
+		for (u32 index = 0; index < 4096; index++)
+		{
+			u32 opcode = ((index & 0xFF0) << 16) | ((index & 0xF) << 4);
+			entries[index].first = (u16)candidates.size();
+			for (int i = 0; i < ARM_INSTR_TYPES_SIZE; i++)
+			{
+				if ((opcode ^ bits[i]) & masks[i] & ARM_DECODE_INDEX_MASK)
+					continue;
+
+				ARMDecodeCandidate candidate;
+				candidate.mask = masks[i] & ~ARM_DECODE_INDEX_MASK;
+				candidate.bits = bits[i] & ~ARM_DECODE_INDEX_MASK;
+				candidate.filter_index = (u8)i;
+				candidate.validate = ARMInstruction::requires_validation(ARM_INSTR_TYPES[i].type);
+				candidates.push_back(candidate);
+				entries[index].count++;
+
+				// an unconditional match shadows every filter after it
+				if (candidate.mask == 0 && !candidate.validate)
+					break;
+			}
+		}
+	}
+
+	inline const ARMDecodeCandidate* begin(u32 opcode, int& count) const
+	{
+		const ARMDecodeEntry& entry = entries[arm_decode_index(opcode)];
+		count = entry.count;
+		return candidates.data() + entry.first;
+	}
+};
+
+static const ARMDecodeTable& arm_decode_table()
+{
+	static const ARMDecodeTable table;
+	return table;
+}
+
+ARMInstruction::ARMInstruction(u32 address, u32 opcode) : data{}
 {
 	this->address = address;
+	data.address = address;
+	data.opcode = opcode;
 }
 
 void ARMInstruction::decode()
 {
-	type = ARMInstruction::Type::Unknown;
-	int interpretation_cnt = 0;	
-	for (const auto& filter : ARM_INSTR_TYPES)
-	{
-		if (filter.test_control_bits(opcode, data, type))
-		{						
-			interpretation_cnt += is_valid();
-		}
-	}		
-	if (interpretation_cnt > 1)
+	decode(data);
+}
+
+void ARMInstruction::decode(DecodedInstruction& data)
+{
+	u32 address = data.address, opcode = data.opcode;
+	int count;
+	const ARMDecodeCandidate* candidate = arm_decode_table().begin(opcode, count);
+	for (; count--; candidate++)
+	{
+		if ((opcode & candidate->mask) != candidate->bits)
+			continue;
+
+		const ARMFilterData& filter = ARM_INSTR_TYPES[candidate->filter_index];
+		data = DecodedInstruction{};
+		data.address = address;
+		data.opcode = opcode;
+		data.type = (u8)filter.type;
+		filter.extract_fields(data);
+		if (!candidate->validate || is_valid(data))
+			return;
+	}
+	data = DecodedInstruction{};
+	data.address = address;
+	data.opcode = opcode;
+	data.type = (u8)ARMInstruction::Type::Unknown;
+	data.Cond = __get_bits__(opcode, 31, 28);
+}
+
+bool ARMInstruction::ends_block(const DecodedInstruction& data)
+{
+	switch ((ARMInstruction::Type)data.type)
 	{
-		throw std::exception("Same opcode decodes to multiple valid instructions.");
+	case ARMInstruction::Type::DataProc_Reg_ShImm:
+	case ARMInstruction::Type::DataProc_Reg_ShReg:
+	case ARMInstruction::Type::DataProc_Imm:
+		// TST, TEQ, CMP, CMN never write Rd
+		return data.Rd == 0xF && (data.Op < OPCODE_TST || data.Op > OPCODE_CMN);
+	case ARMInstruction::Type::TransReg10:
+	case ARMInstruction::Type::TransImm10:
+	case ARMInstruction::Type::TransImm9:
+	case ARMInstruction::Type::TransReg9:
+		return (data.L == 1 && data.Rd == 0xF) || (data.Rn == 0xF && (data.W == 1 || data.P == 0));
+	case ARMInstruction::Type::BlockTrans:
+		return data.L == 1 && (data.RegList & 0x8000);
+	case ARMInstruction::Type::Unknown:
+	case ARMInstruction::Type::BX_BLX:
+	case ARMInstruction::Type::Undefined:
+	case ARMInstruction::Type::B_BL_BLX_Offset:
+	case ARMInstruction::Type::CoDataTrans:
+	case ARMInstruction::Type::CoDataOp:
+	case ARMInstruction::Type::CoRegTrans:
+	case ARMInstruction::Type::SWI:
+		return true;
+	default:
+		return false;
 	}
 }
 
+bool ARMInstruction::requires_validation(Type type)
+{
+	return type == Type::DataProc_Reg_ShImm || type == Type::DataProc_Reg_ShReg || type == Type::DataProc_Imm;
+}
 
-bool ARMInstruction::is_valid() const
+bool ARMInstruction::is_valid(const DecodedInstruction& data)
 {
-	switch (type)
+	switch ((ARMInstruction::Type)data.type)
 	{
 	case ARMInstruction::Type::Unknown:
 		break;
 	case ARMInstruction::Type::DataProc_Reg_ShImm: // Bit 25 = 0, Bit 4 = 0
 	{
-		if (!valid_alu()) return false;		
+		if (!valid_alu(data)) return false;		
 
 		break;
 	}
 	case ARMInstruction::Type::DataProc_Reg_ShReg: // Bit 25 = 0, Bit 4 = 1
 	{
-		if (!valid_alu()) return false;
+		if (!valid_alu(data)) return false;
 
 		break;
 	}
 	case ARMInstruction::Type::DataProc_Imm: // Bit25 = 1
 	{
-		if (!valid_alu()) return false;
+		if (!valid_alu(data)) return false;
 
 		break;
 	}
@@ -426,12 +580,22 @@ bool ARMInstruction::is_valid() const
 
 void ARMInstruction::execute(Cpu* cpu)
 {
+	execute(cpu, data);
+}
 
+void ARMInstruction::execute(Cpu* cpu, const DecodedInstruction& data)
+{
+	ARMInterpreter::execute(cpu, data);
 }
 
 #include <sstream>
 
 std::string ARMInstruction::to_string(const InstructionFormat& format) const
+{
+	return to_string(data, format);
+}
+
+std::string ARMInstruction::to_string(const DecodedInstruction& data, const InstructionFormat& format)
 {
 	string result = "";
 
@@ -441,38 +605,38 @@ std::string ARMInstruction::to_string(const InstructionFormat& format) const
 
 	if (format.show_address)
 	{		
-		result += string_format("%08X : ", address);
+		result += string_format("%08X : ", data.address);
 	}
 
 	if (format.show_opcode)
 	{
-		result += string_format("%08X | ", opcode);
+		result += string_format("%08X | ", data.opcode);
 	}	
 
-	switch (type)
+	switch ((ARMInstruction::Type)data.type)
 	{
 	case ARMInstruction::Type::Unknown:
 		instr_name = "???";
 		break;
 	case ARMInstruction::Type::DataProc_Reg_ShImm:
 	{
-		u8 opc = data.at("Op");
+		u8 opc = data.Op;
 		instr_name = alu_name(opc);
-		if (data.at("S") == 1 && (opc < 0x8 || opc>0xB)) instr_name += "S";
+		if (data.S == 1 && (opc < 0x8 || opc>0xB)) instr_name += "S";
 		break;
 	}
 	case ARMInstruction::Type::DataProc_Reg_ShReg:
 	{
-		u8 opc = data.at("Op");
+		u8 opc = data.Op;
 		instr_name = alu_name(opc);
-		if (data.at("S") == 1 && (opc < 0x8 || opc>0xB)) instr_name += "S";
+		if (data.S == 1 && (opc < 0x8 || opc>0xB)) instr_name += "S";
 		break;
 	}
 	case ARMInstruction::Type::DataProc_Imm:
 	{
-		u8 opc = data.at("Op");
+		u8 opc = data.Op;
 		instr_name = alu_name(opc);
-		if (data.at("S") == 1 && (opc < 0x8 || opc>0xB)) instr_name += "S";
+		if (data.S == 1 && (opc < 0x8 || opc>0xB)) instr_name += "S";
 		break;
 	}
 	case ARMInstruction::Type::PSR_Imm:
@@ -482,49 +646,49 @@ std::string ARMInstruction::to_string(const InstructionFormat& format) const
 	{
 		// 0: MRS{ cond } Rd,Psr          ;Rd = Psr
 		// 1: MSR{ cond } Psr{ _field }, Op; Psr[field] = Op
-		u8 opcode = data.at("L");
+		u8 opcode = data.L;
 
 		//(0=CPSR, 1=SPSR_<current mode>)
-		u8 psr = data.at("P");
+		u8 psr = data.P;
 
 		if (opcode == 0) // MRS
 		{
 			instr_name = "MRS";
-			op_1 = string_format("R%i", data.at("Rd"));
+			op_1 = string_format("R%i", data.Rd);
 			op_2 = psr == 0 ? "CPSR" : "SPSR";
 		}
 		else // MSR
 		{
 			instr_name = "MSR";
 			op_1 = psr == 0 ? "CPSR" : "SPSR";			
-			u8 field = data.at("Field");
+			u8 field = data.Field;
 			if (field != 0) op_1 += "_";
 			if (field & 0b1000) op_1 += "f";
 			if (field & 0b0100) op_1 += "s";
 			if (field & 0b0010) op_1 += "x";
 			if (field & 0b0001) op_1 += "c";
 
-			op_2 = string_format("R%i", data.at("Rm"));
+			op_2 = string_format("R%i", data.Rm);
 		}
 
 		break;
 	}
 	case ARMInstruction::Type::BX_BLX:
 	{		
-		instr_name = data.at("L") == 0 ? "BX" : "BLX";						
-		op_1 = string_format("R%i",data.at("Rn"));
+		instr_name = data.L == 0 ? "BX" : "BLX";						
+		op_1 = string_format("R%i",data.Rn);
 
 		break;
 	}
 	case ARMInstruction::Type::Multiply:		
 	{
-		instr_name = mul_name(data.at("Op"));
+		instr_name = mul_name(data.Op);
 
 		break;
 	}
 	case ARMInstruction::Type::MulLong:
 	{
-		instr_name = mul_name(data.at("Op"));
+		instr_name = mul_name(data.Op);
 
 		break;
 	}
@@ -552,13 +716,13 @@ std::string ARMInstruction::to_string(const InstructionFormat& format) const
 
 	case ARMInstruction::Type::B_BL_BLX_Offset:
 	{
-		if (data.at("L") == 1)
+		if (data.L == 1)
 			instr_name = "BL";
 		else
 			instr_name = "B";		
 
-		s32 n24 = data.at("Offset") & 0x000F0000 ? (0xFFF00000 | data.at("Offset")) : data.at("Offset");
-		u32 offset = address + 8 + 4 * n24;
+		s32 n24 = data.Offset & 0x000F0000 ? (0xFFF00000 | data.Offset) : data.Offset;
+		u32 offset = data.address + 8 + 4 * n24;
 
 		op_1 = "Lxx_0x" + string_format("%X",offset);
 		break;
@@ -580,7 +744,7 @@ std::string ARMInstruction::to_string(const InstructionFormat& format) const
 		break;
 	}
 
-	instr_name += condition_suffix(data.at("Cond"));
+	instr_name += condition_suffix(data.Cond);
 
 	result += instr_name;
 	if (op_1 != "") result += " " + op_1;
@@ -629,14 +793,14 @@ std::string ARMInstruction::mul_name(u8 opcode)
 }
 
 
-bool ARMInstruction::valid_alu() const
+bool ARMInstruction::valid_alu(const DecodedInstruction& data)
 {
-	u32 alu_opcode = data.at("Op");	
+	u32 alu_opcode = data.Op;	
 
 	if (0x8 <= alu_opcode && alu_opcode <= 0xB)	
 	{
 		// S - Set Condition Codes (0=No, 1=Yes) (Must be 1 for opcode 8-B)
-		u32 S = data.at("S");
+		u32 S = data.S;
 		if (S == 0)
 		{
 			return false;
@@ -644,7 +808,7 @@ bool ARMInstruction::valid_alu() const
 
 		// Rd - Destination Register (R0..R15) (including PC=R15)
 		// Must be 0000b(or 1111b) for CMP / CMN / TST / TEQ{ P }.
-		u32 Rd = data.at("Rd");
+		u32 Rd = data.Rd;
 		if (Rd != 0x0 && Rd != 0xF)
 		{
 			return false;
@@ -653,12 +817,12 @@ bool ARMInstruction::valid_alu() const
 	return true;
 }
 
-bool ARMInstruction::valid_mul() const
+bool ARMInstruction::valid_mul(const DecodedInstruction& data)
 {	
-	u8 Rm = data.at("Rm");
-	u8 Rd = data.at("Rd");
-	u8 Rn = data.at("Rn");
-	u8 Rs = data.at("Rs");
+	u8 Rm = data.Rm;
+	u8 Rd = data.Rd;
+	u8 Rn = data.Rn;
+	u8 Rs = data.Rs;
 
 	// Rd may not be same as Rm.
 	if (Rd == Rm) return false;
@@ -671,7 +835,7 @@ bool ARMInstruction::valid_mul() const
 	return true;
 }
 
-bool ARMInstruction::valid_mull() const
+bool ARMInstruction::valid_mull(const DecodedInstruction&)
 {
 	return true;
 }
\ No newline at end of file
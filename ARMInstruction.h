@@ -1,8 +1,7 @@
 #pragma once
 
 #include "Instruction.h"
-
-#include <map>
+#include "DecodedInstruction.h"
 
 class ARMInstruction : public Instruction
 {
@@ -48,33 +47,49 @@ public:
 		SWI,
 	};
 private:
-	u32 opcode;
-
-	Type type = Type::Unknown;	
-	std::map<std::string, u32> data;
+	DecodedInstruction data;
 
 	static std::string alu_name(u8 opcode);
 	static std::string mul_name(u8 opcode);
 
-	bool is_valid() const;
+	static bool is_valid(const DecodedInstruction& data);
 public:
 	ARMInstruction(u32 address, u32 opcode);
 	virtual void decode() override;
 	virtual void execute(Cpu* cpu) override;
 	virtual std::string to_string(const InstructionFormat& format = DefaultInstructionFormat) const override;
 
+	const DecodedInstruction& decoded() const { return data; }
+
+	/// <summary>
+	/// Decodes data.opcode in place
+	/// </summary>	
+	static void decode(DecodedInstruction& data);
+	static void execute(Cpu* cpu, const DecodedInstruction& data);
+
+	/// <summary>
+	/// Tells whether the instruction may change the program flow, thus closing a decoded block
+	/// </summary>	
+	static bool ends_block(const DecodedInstruction& data);
+	static std::string to_string(const DecodedInstruction& data, const InstructionFormat& format = DefaultInstructionFormat);
+
+	/// <summary>
+	/// Tells whether a match of this type must also pass is_valid()
+	/// </summary>	
+	static bool requires_validation(Type type);
+
 private:
 	/// <summary>
 	/// Validates Arithmetic & Logic instructions
 	/// </summary>	
-	bool valid_alu() const;
+	static bool valid_alu(const DecodedInstruction& data);
 	/// <summary>
 	/// Validates Multiply instructions (MUL, MLA)
 	/// </summary>	
-	bool valid_mul() const;
+	static bool valid_mul(const DecodedInstruction& data);
 	/// <summary>
 	/// Validates Long Multiply instructions
 	/// </summary>	
-	bool valid_mull() const;
+	static bool valid_mull(const DecodedInstruction& data);
 };
 
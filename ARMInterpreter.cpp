@@ -0,0 +1,680 @@
+#include "ARMInterpreter.h"
+#include "HLEBios.h"
+#include "ARMInstruction.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#ifndef ARM_SWITCH_DISPATCH
+#define ARM_THREADED_DISPATCH
+#endif
+#endif
+
+// ALU Opcodes
+static const int OPCODE_AND = 0x0;
+static const int OPCODE_EOR = 0x1;
+static const int OPCODE_SUB = 0x2;
+static const int OPCODE_RSB = 0x3;
+static const int OPCODE_ADD = 0x4;
+static const int OPCODE_ADC = 0x5;
+static const int OPCODE_SBC = 0x6;
+static const int OPCODE_RSC = 0x7;
+static const int OPCODE_TST = 0x8;
+static const int OPCODE_TEQ = 0x9;
+static const int OPCODE_CMP = 0xA;
+static const int OPCODE_CMN = 0xB;
+static const int OPCODE_ORR = 0xC;
+static const int OPCODE_MOV = 0xD;
+static const int OPCODE_BIC = 0xE;
+static const int OPCODE_MVN = 0xF;
+
+// Shift types
+static const u8 SHIFT_LSL = 0;
+static const u8 SHIFT_LSR = 1;
+static const u8 SHIFT_ASR = 2;
+static const u8 SHIFT_ROR = 3;
+
+static constexpr bool is_logical(int op)
+{
+	return op == OPCODE_AND || op == OPCODE_EOR || op == OPCODE_TST || op == OPCODE_TEQ
+		|| op == OPCODE_ORR || op == OPCODE_MOV || op == OPCODE_BIC || op == OPCODE_MVN;
+}
+
+// TST, TEQ, CMP, CMN only set the flags
+static constexpr bool writes_rd(int op) { return op < OPCODE_TST || op > OPCODE_CMN; }
+
+static constexpr bool reads_rn(int op) { return op != OPCODE_MOV && op != OPCODE_MVN; }
+
+static constexpr bool reads_carry(int op) { return op == OPCODE_ADC || op == OPCODE_SBC || op == OPCODE_RSC; }
+
+// Handler of every ARMInstruction::Type, in declaration order
+#define ARM_HANDLERS(X) \
+	X(Unknown,            exec_undefined) \
+	X(DataProc_Reg_ShImm, exec_data_proc_shimm) \
+	X(DataProc_Reg_ShReg, exec_data_proc_shreg) \
+	X(DataProc_Imm,       exec_data_proc_imm) \
+	X(PSR_Imm,            exec_msr_imm) \
+	X(PSR_Reg,            exec_psr_reg) \
+	X(BX_BLX,             exec_bx) \
+	X(Multiply,           exec_multiply) \
+	X(MulLong,            exec_mul_long) \
+	X(TransSwp12,         exec_swap) \
+	X(TransReg10,         exec_halfword_reg) \
+	X(TransImm10,         exec_halfword_imm) \
+	X(TransImm9,          exec_single_imm) \
+	X(TransReg9,          exec_single_reg) \
+	X(Undefined,          exec_undefined) \
+	X(BlockTrans,         exec_block_trans) \
+	X(B_BL_BLX_Offset,    exec_branch) \
+	X(CoDataTrans,        exec_undefined) \
+	X(CoDataOp,           exec_undefined) \
+	X(CoRegTrans,         exec_undefined) \
+	X(SWI,                exec_swi)
+
+const ARMInterpreter::Handler ARMInterpreter::handlers[] =
+{
+#define __handler_entry__(type, handler) &ARMInterpreter::handler,
+	ARM_HANDLERS(__handler_entry__)
+#undef __handler_entry__
+};
+
+static inline u32 sign_extend(u32 value, int bits)
+{
+	return (u32)((s32)(value << (32 - bits)) >> (32 - bits));
+}
+
+static inline u32 rotate_right(u32 value, u32 amount)
+{
+	amount &= 31;
+	return amount ? (value >> amount) | (value << (32 - amount)) : value;
+}
+
+/// <summary>
+/// Barrel shifter with an immediate amount, where #0 encodes LSR #32, ASR #32 and RRX.
+/// carry holds C on entry and, when Carry is set, the shifter carry out on return.
+/// </summary>
+template <u8 Type, bool Carry>
+static inline u32 shift_by_immediate(u32 value, u8 amount, u32& carry)
+{
+	if constexpr (Type == SHIFT_LSL)
+	{
+		if (amount == 0) return value;
+		if constexpr (Carry) carry = (value >> (32 - amount)) & 1;
+		return value << amount;
+	}
+	else if constexpr (Type == SHIFT_LSR)
+	{
+		if (amount == 0) { if constexpr (Carry) carry = value >> 31; return 0; }
+		if constexpr (Carry) carry = (value >> (amount - 1)) & 1;
+		return value >> amount;
+	}
+	else if constexpr (Type == SHIFT_ASR)
+	{
+		if (amount == 0) { if constexpr (Carry) carry = value >> 31; return (u32)((s32)value >> 31); }
+		if constexpr (Carry) carry = (value >> (amount - 1)) & 1;
+		return (u32)((s32)value >> amount);
+	}
+	else
+	{
+		if (amount == 0)
+		{
+			u32 result = (carry << 31) | (value >> 1);
+			if constexpr (Carry) carry = value & 1;
+			return result;
+		}
+		if constexpr (Carry) carry = (value >> (amount - 1)) & 1;
+		return rotate_right(value, amount);
+	}
+}
+
+/// <summary>
+/// Barrel shifter with the amount taken from the bottom byte of a register
+/// </summary>
+template <u8 Type, bool Carry>
+static inline u32 shift_by_register(u32 value, u32 amount, u32& carry)
+{
+	amount &= 0xFF;
+	if (amount == 0) return value;
+	if constexpr (Type == SHIFT_LSL)
+	{
+		if (amount < 32) { if constexpr (Carry) carry = (value >> (32 - amount)) & 1; return value << amount; }
+		if constexpr (Carry) carry = amount == 32 ? value & 1 : 0;
+		return 0;
+	}
+	else if constexpr (Type == SHIFT_LSR)
+	{
+		if (amount < 32) { if constexpr (Carry) carry = (value >> (amount - 1)) & 1; return value >> amount; }
+		if constexpr (Carry) carry = amount == 32 ? value >> 31 : 0;
+		return 0;
+	}
+	else if constexpr (Type == SHIFT_ASR)
+	{
+		if (amount < 32) { if constexpr (Carry) carry = (value >> (amount - 1)) & 1; return (u32)((s32)value >> amount); }
+		if constexpr (Carry) carry = value >> 31;
+		return (u32)((s32)value >> 31);
+	}
+	else
+	{
+		if ((amount & 31) == 0) { if constexpr (Carry) carry = value >> 31; return value; }
+		if constexpr (Carry) carry = (value >> ((amount & 31) - 1)) & 1;
+		return rotate_right(value, amount);
+	}
+}
+
+static inline u32 shift_by_immediate(u32 value, u8 type, u8 amount, u32& carry)
+{
+	switch (type)
+	{
+	case SHIFT_LSL: return shift_by_immediate<SHIFT_LSL, true>(value, amount, carry);
+	case SHIFT_LSR: return shift_by_immediate<SHIFT_LSR, true>(value, amount, carry);
+	case SHIFT_ASR: return shift_by_immediate<SHIFT_ASR, true>(value, amount, carry);
+	default: return shift_by_immediate<SHIFT_ROR, true>(value, amount, carry);
+	}
+}
+
+/// <summary>
+/// Misaligned word loads rotate the aligned word, like the ARM7TDMI does
+/// </summary>
+static inline u32 read_word_rotated(const Memory* memory, u32 address)
+{
+	return rotate_right(memory->get32(address & ~3), (address & 3) << 3);
+}
+
+// Multiplier steps: the array stops early once the remaining bits of the multiplier are all zeros (or all ones, signed)
+static inline u32 multiplier_cycles(u32 multiplier, bool is_signed)
+{
+	if (is_signed && (s32)multiplier < 0) multiplier = ~multiplier;
+	if ((multiplier >> 8) == 0) return 1;
+	if ((multiplier >> 16) == 0) return 2;
+	if ((multiplier >> 24) == 0) return 3;
+	return 4;
+}
+
+static inline u32 popcount16(u16 value)
+{
+	u32 count = 0;
+	for (; value; value &= value - 1) count++;
+	return count;
+}
+
+void ARMInterpreter::execute(Cpu* cpu, const DecodedInstruction& data)
+{
+	static_assert(sizeof(handlers) / sizeof(Handler) == (int)ARMInstruction::Type::SWI + 1, "Every ARMInstruction::Type needs a handler");
+	if (cpu->condition_passed(data.Cond))
+		handlers[data.type](cpu, data);
+}
+
+u32 ARMInterpreter::execute_block(Cpu* cpu, const DecodedInstruction* instructions, u32 count)
+{
+	const DecodedInstruction* instr = instructions;
+	const DecodedInstruction* end = instructions + count;
+	// a store over the block retires it: stop before running the next slot
+	u32 generation = cpu->block_cache.get_generation();
+	cpu->branched = false;
+	u32 cycles = 0;
+
+#ifdef ARM_THREADED_DISPATCH
+	static void* const labels[] =
+	{
+#define __label_entry__(type, handler) &&op_##type,
+		ARM_HANDLERS(__label_entry__)
+#undef __label_entry__
+	};
+
+	// every handler ends with its own copy of the dispatch, so that each gets its own indirect branch
+#define __dispatch__() \
+	for (;;) \
+	{ \
+		if (instr == end || cpu->branched || cpu->block_cache.get_generation() != generation) goto done; \
+		cycles += instr->cycles; \
+		cpu->PC = instr->address + 8; \
+		if (cpu->condition_passed(instr->Cond)) goto *labels[instr->type]; \
+		instr++; \
+	}
+
+	__dispatch__();
+#define __label_body__(type, handler) op_##type: handler(cpu, *instr++); __dispatch__();
+	ARM_HANDLERS(__label_body__)
+#undef __label_body__
+#undef __dispatch__
+done:
+#else
+	for (; instr != end && !cpu->branched && cpu->block_cache.get_generation() == generation; instr++)
+	{
+		cycles += instr->cycles;
+		cpu->PC = instr->address + 8;
+		if (!cpu->condition_passed(instr->Cond))
+			continue;
+		switch ((ARMInstruction::Type)instr->type)
+		{
+#define __case_entry__(type, handler) case ARMInstruction::Type::type: handler(cpu, *instr); break;
+			ARM_HANDLERS(__case_entry__)
+#undef __case_entry__
+		}
+	}
+#endif
+
+	u32 executed = (u32)(instr - instructions);
+	if (!cpu->branched && executed > 0)
+		cpu->PC -= 4;
+	cpu->pending_cycles += cycles;
+	return executed;
+}
+
+void ARMInterpreter::exec_undefined(Cpu* cpu, const DecodedInstruction& data)
+{
+	cpu->enter_exception(Cpu::MODE_UND, 0x04, data.address + 4);
+}
+
+void ARMInterpreter::exec_data_proc_shimm(Cpu* cpu, const DecodedInstruction& data)
+{
+	data_proc_handlers[OPERAND_SHIMM][data_proc_index(data)](cpu, data);
+}
+
+void ARMInterpreter::exec_data_proc_shreg(Cpu* cpu, const DecodedInstruction& data)
+{
+	data_proc_handlers[OPERAND_SHREG][data_proc_index(data)](cpu, data);
+}
+
+void ARMInterpreter::exec_data_proc_imm(Cpu* cpu, const DecodedInstruction& data)
+{
+	data_proc_handlers[OPERAND_IMM][data_proc_index(data)](cpu, data);
+}
+
+template <u8 Op, bool S, u8 Form, u8 ShiftType>
+void ARMInterpreter::exec_data_proc(Cpu* cpu, const DecodedInstruction& data)
+{
+	// the shifter carry only matters to flag-setting logical ops
+	constexpr bool shifter_carry = S && is_logical(Op);
+	u32 carry = 0;
+	if constexpr (shifter_carry || (Form == OPERAND_SHIMM && ShiftType == SHIFT_ROR))
+		carry = cpu->get_carry();
+
+	u32 op1 = 0, op2;
+	if constexpr (Form == OPERAND_IMM)
+	{
+		op2 = rotate_right(data.Immediate, data.Shift << 1);
+		if constexpr (shifter_carry)
+		{
+			if (data.Shift != 0) carry = op2 >> 31;
+		}
+		if constexpr (reads_rn(Op)) op1 = cpu->R[data.Rn];
+	}
+	else if constexpr (Form == OPERAND_SHIMM)
+	{
+		op2 = shift_by_immediate<ShiftType, shifter_carry>(cpu->R[data.Rm], data.Shift, carry);
+		if constexpr (reads_rn(Op)) op1 = cpu->R[data.Rn];
+	}
+	else
+	{
+		// the extra cycle for reading Rs lets R15 run 12 bytes ahead
+		u32 rm = cpu->R[data.Rm] + (data.Rm == 15 ? 4 : 0);
+		op2 = shift_by_register<ShiftType, shifter_carry>(rm, cpu->R[data.Rs], carry);
+		if constexpr (reads_rn(Op)) op1 = cpu->R[data.Rn] + (data.Rn == 15 ? 4 : 0);
+	}
+
+	u32 carry_in = 0;
+	if constexpr (reads_carry(Op)) carry_in = cpu->get_carry();
+
+	// flags are only recorded here, see Cpu::lazy_flags
+	u32 result;
+	Cpu::FlagOp flag_op = Cpu::FlagOp::Logical;
+	u32 a = op1, b = op2;
+	if constexpr (Op == OPCODE_AND || Op == OPCODE_TST) result = op1 & op2;
+	else if constexpr (Op == OPCODE_EOR || Op == OPCODE_TEQ) result = op1 ^ op2;
+	else if constexpr (Op == OPCODE_ORR) result = op1 | op2;
+	else if constexpr (Op == OPCODE_MOV) result = op2;
+	else if constexpr (Op == OPCODE_BIC) result = op1 & ~op2;
+	else if constexpr (Op == OPCODE_MVN) result = ~op2;
+	else if constexpr (Op == OPCODE_SUB || Op == OPCODE_CMP)
+	{
+		result = op1 - op2;
+		flag_op = Cpu::FlagOp::Sub;
+	}
+	else if constexpr (Op == OPCODE_RSB)
+	{
+		result = op2 - op1;
+		flag_op = Cpu::FlagOp::Sub;
+		a = op2; b = op1;
+	}
+	else if constexpr (Op == OPCODE_ADD || Op == OPCODE_CMN)
+	{
+		result = op1 + op2;
+		flag_op = Cpu::FlagOp::Add;
+	}
+	else if constexpr (Op == OPCODE_ADC)
+	{
+		result = op1 + op2 + carry_in;
+		flag_op = Cpu::FlagOp::Adc;
+	}
+	else if constexpr (Op == OPCODE_SBC)
+	{
+		result = op1 - op2 - (1 - carry_in);
+		flag_op = Cpu::FlagOp::Sbc;
+	}
+	else
+	{
+		result = op2 - op1 - (1 - carry_in);
+		flag_op = Cpu::FlagOp::Sbc;
+		a = op2; b = op1;
+	}
+
+	if constexpr (writes_rd(Op))
+	{
+		if (data.Rd == 15)
+		{
+			if constexpr (S)
+			{
+				// return from exception: restore the caller's state
+				if (u32* spsr = cpu->current_SPSR())
+					cpu->set_CPSR(*spsr);
+			}
+			cpu->branch_to(result);
+			return;
+		}
+		cpu->R[data.Rd] = result;
+	}
+
+	if constexpr (S)
+	{
+		// logical ops read C above, which resolved the previous flags and so their V
+		if constexpr (is_logical(Op))
+			cpu->set_lazy_flags(Cpu::FlagOp::Logical, result, 0, 0, carry);
+		else
+			cpu->set_lazy_flags(flag_op, result, a, b, carry_in);
+	}
+}
+
+template <u8 Form, size_t... Index>
+constexpr std::array<ARMInterpreter::Handler, 128> ARMInterpreter::make_data_proc_table(std::index_sequence<Index...>)
+{
+	// the immediate form has no shift type: its Typ is always 0
+	return { { &exec_data_proc<(u8)(Index >> 3), ((Index >> 2) & 1) != 0, Form, (u8)(Form == OPERAND_IMM ? 0 : Index & 3)>... } };
+}
+
+const std::array<ARMInterpreter::Handler, 128> ARMInterpreter::data_proc_handlers[3] =
+{
+	make_data_proc_table<OPERAND_SHIMM>(std::make_index_sequence<128>{}),
+	make_data_proc_table<OPERAND_SHREG>(std::make_index_sequence<128>{}),
+	make_data_proc_table<OPERAND_IMM>(std::make_index_sequence<128>{}),
+};
+
+void ARMInterpreter::exec_msr_imm(Cpu* cpu, const DecodedInstruction& data)
+{
+	write_psr(cpu, data, rotate_right(data.Immediate, data.Shift << 1));
+}
+
+void ARMInterpreter::exec_psr_reg(Cpu* cpu, const DecodedInstruction& data)
+{
+	if (data.L)
+	{
+		write_psr(cpu, data, cpu->R[data.Rm]);
+		return;
+	}
+
+	// MRS
+	cpu->resolve_flags();
+	u32* spsr = data.P ? cpu->current_SPSR() : nullptr;
+	cpu->R[data.Rd] = spsr ? *spsr : cpu->CPSR;
+}
+
+void ARMInterpreter::write_psr(Cpu* cpu, const DecodedInstruction& data, u32 value)
+{
+	u32 mask = 0;
+	if (data.Field & 0b1000) mask |= 0xFF000000;
+	if (data.Field & 0b0100) mask |= 0x00FF0000;
+	if (data.Field & 0b0010) mask |= 0x0000FF00;
+	if (data.Field & 0b0001) mask |= 0x000000FF;
+
+	cpu->resolve_flags();
+	if (data.P)
+	{
+		if (u32* spsr = cpu->current_SPSR())
+			*spsr = (*spsr & ~mask) | (value & mask);
+		return;
+	}
+
+	// User mode may only change the flags, and MSR never changes the instruction state
+	if ((cpu->CPSR & 0x1F) == Cpu::MODE_USR)
+		mask &= 0xFF000000;
+	mask &= ~Cpu::FLAG_T;
+	cpu->set_CPSR((cpu->CPSR & ~mask) | (value & mask));
+}
+
+void ARMInterpreter::exec_bx(Cpu* cpu, const DecodedInstruction& data)
+{
+	// BLX is ARMv5 and above
+	if (data.L)
+	{
+		exec_undefined(cpu, data);
+		return;
+	}
+
+	u32 target = cpu->R[data.Rn];
+	if (target & 1)
+	{
+		cpu->CPSR |= Cpu::FLAG_T;
+		cpu->instruction_state = Cpu::InstructionState::Thumb;
+	}
+	else
+	{
+		cpu->CPSR &= ~Cpu::FLAG_T;
+		cpu->instruction_state = Cpu::InstructionState::ARM;
+	}
+	cpu->branch_to(target);
+}
+
+void ARMInterpreter::exec_multiply(Cpu* cpu, const DecodedInstruction& data)
+{
+	// the decoder names the fields after their bit positions: Rn (19-16) is the destination, Rd (15-12) the accumulator
+	u32 result = cpu->R[data.Rm] * cpu->R[data.Rs];
+	if (data.A) result += cpu->R[data.Rd];
+	cpu->pending_cycles += multiplier_cycles(cpu->R[data.Rs], true);
+	cpu->R[data.Rn] = result;
+
+	if (data.S)
+	{
+		cpu->resolve_flags();
+		cpu->CPSR = (cpu->CPSR & ~(Cpu::FLAG_N | Cpu::FLAG_Z)) | (result & Cpu::FLAG_N) | (result == 0 ? Cpu::FLAG_Z : 0);
+	}
+}
+
+void ARMInterpreter::exec_mul_long(Cpu* cpu, const DecodedInstruction& data)
+{
+	u64 result;
+	if (data.U)
+		result = (u64)((s64)(s32)cpu->R[data.Rm] * (s64)(s32)cpu->R[data.Rs]);
+	else
+		result = (u64)cpu->R[data.Rm] * cpu->R[data.Rs];
+	if (data.A)
+		result += ((u64)cpu->R[data.RdHi] << 32) | cpu->R[data.RdLo];
+	cpu->pending_cycles += multiplier_cycles(cpu->R[data.Rs], data.U);
+
+	cpu->R[data.RdLo] = (u32)result;
+	cpu->R[data.RdHi] = (u32)(result >> 32);
+
+	if (data.S)
+	{
+		cpu->resolve_flags();
+		cpu->CPSR = (cpu->CPSR & ~(Cpu::FLAG_N | Cpu::FLAG_Z)) | ((u32)(result >> 32) & Cpu::FLAG_N) | (result == 0 ? Cpu::FLAG_Z : 0);
+	}
+}
+
+void ARMInterpreter::exec_swap(Cpu* cpu, const DecodedInstruction& data)
+{
+	u32 address = cpu->R[data.Rn];
+	u32 source = cpu->R[data.Rm];
+	cpu->pending_cycles += 2 * cpu->memory->access_time(address, !data.B, false);
+	if (data.B)
+	{
+		u8 old = (*cpu->memory)[address];
+		cpu->memory->set_at(address, (u8)source);
+		cpu->R[data.Rd] = old;
+	}
+	else
+	{
+		u32 old = read_word_rotated(cpu->memory, address);
+		cpu->memory->set32(address & ~3, source);
+		cpu->R[data.Rd] = old;
+	}
+	cpu->check_halt();
+}
+
+void ARMInterpreter::exec_halfword_reg(Cpu* cpu, const DecodedInstruction& data)
+{
+	halfword_transfer(cpu, data, cpu->R[data.Rm]);
+}
+
+void ARMInterpreter::exec_halfword_imm(Cpu* cpu, const DecodedInstruction& data)
+{
+	halfword_transfer(cpu, data, ((u32)data.OffsetH << 4) | data.OffsetL);
+}
+
+void ARMInterpreter::halfword_transfer(Cpu* cpu, const DecodedInstruction& data, u32 offset)
+{
+	u32 base = cpu->R[data.Rn];
+	u32 target = data.U ? base + offset : base - offset;
+	u32 address = data.P ? target : base;
+	bool write_back = !data.P || data.W;
+	if (data.L || data.S == 0)
+		cpu->pending_cycles += cpu->memory->access_time(address, false, false);
+
+	if (data.L)
+	{
+		u32 value;
+		if (data.S == 0) // LDRH, misaligned reads rotate
+			value = rotate_right(cpu->memory->get16(address & ~1), (address & 1) << 3);
+		else if (data.H == 0 || (address & 1)) // LDRSB, misaligned LDRSH loads the byte
+			value = sign_extend((*cpu->memory)[address], 8);
+		else // LDRSH
+			value = sign_extend(cpu->memory->get16(address), 16);
+
+		// the loaded value wins over the written back base
+		if (write_back) write_register(cpu, data.Rn, target);
+		write_register(cpu, data.Rd, value);
+		return;
+	}
+
+	// STRH; the signed encodings are LDRD/STRD on ARMv5 and do nothing here
+	if (data.S == 0)
+		cpu->memory->set16(address & ~1, (u16)(cpu->R[data.Rd] + (data.Rd == 15 ? 4 : 0)));
+	if (write_back) write_register(cpu, data.Rn, target);
+	cpu->check_halt();
+}
+
+void ARMInterpreter::exec_single_imm(Cpu* cpu, const DecodedInstruction& data)
+{
+	single_transfer(cpu, data, data.Offset);
+}
+
+void ARMInterpreter::exec_single_reg(Cpu* cpu, const DecodedInstruction& data)
+{
+	// only RRX needs C
+	u32 carry = data.Typ == SHIFT_ROR && data.Shift == 0 ? cpu->get_carry() : 0;
+	single_transfer(cpu, data, shift_by_immediate(cpu->R[data.Rm], data.Typ, data.Shift, carry));
+}
+
+void ARMInterpreter::single_transfer(Cpu* cpu, const DecodedInstruction& data, u32 offset)
+{
+	u32 base = cpu->R[data.Rn];
+	u32 target = data.U ? base + offset : base - offset;
+	u32 address = data.P ? target : base;
+	// post-indexed transfers always write back (W then selects the user mode access)
+	bool write_back = !data.P || data.W;
+	cpu->pending_cycles += cpu->memory->access_time(address, !data.B, false);
+
+	if (data.L)
+	{
+		u32 value = data.B ? (*cpu->memory)[address] : read_word_rotated(cpu->memory, address);
+		if (write_back) write_register(cpu, data.Rn, target);
+		write_register(cpu, data.Rd, value);
+		return;
+	}
+
+	u32 value = cpu->R[data.Rd] + (data.Rd == 15 ? 4 : 0);
+	if (data.B)
+		cpu->memory->set_at(address, (u8)value);
+	else
+		cpu->memory->set32(address & ~3, value);
+	if (write_back) write_register(cpu, data.Rn, target);
+	cpu->check_halt();
+}
+
+void ARMInterpreter::exec_block_trans(Cpu* cpu, const DecodedInstruction& data)
+{
+	u16 list = data.RegList;
+	u32 bytes = popcount16(list) * 4;
+	if (list == 0)
+	{
+		// ARMv4 quirk: an empty list transfers R15 and moves the base by 0x40
+		list = 0x8000;
+		bytes = 0x40;
+	}
+
+	u32 base = cpu->R[data.Rn];
+	u32 address = data.U ? base : base - bytes;
+	if (data.P == data.U) address += 4;
+	u32 new_base = data.U ? base + bytes : base - bytes;
+	bool write_back = data.W && data.Rn != 15;
+	// one non-sequential access, the rest sequential
+	cpu->pending_cycles += cpu->memory->access_time(address, true, false)
+		+ (popcount16(list) - 1) * cpu->memory->access_time(address, true, true);
+
+	// S without R15 loaded transfers the User mode registers
+	bool loads_pc = data.L && (list & 0x8000);
+	u32 mode = cpu->CPSR & 0x1F;
+	bool user_bank = data.S && !loads_pc;
+	if (user_bank) cpu->switch_mode(Cpu::MODE_USR);
+
+	if (data.L)
+	{
+		// a loaded base overwrites the written back one
+		if (write_back) cpu->R[data.Rn] = new_base;
+		u32 pc_value = 0;
+		for (int r = 0; r < 16; r++)
+		{
+			if (!(list & (1 << r))) continue;
+			u32 value = cpu->memory->get32(address & ~3);
+			address += 4;
+			if (r == 15) pc_value = value;
+			else cpu->R[r] = value;
+		}
+		if (user_bank) cpu->switch_mode(mode);
+		if (loads_pc)
+		{
+			if (data.S)
+			{
+				if (u32* spsr = cpu->current_SPSR())
+					cpu->set_CPSR(*spsr);
+			}
+			cpu->branch_to(pc_value);
+		}
+		return;
+	}
+
+	// the base is written back after the first store: a base listed first is stored unchanged
+	bool first = true;
+	for (int r = 0; r < 16; r++)
+	{
+		if (!(list & (1 << r))) continue;
+		u32 value = cpu->R[r] + (r == 15 ? 4 : 0);
+		cpu->memory->set32(address & ~3, value);
+		address += 4;
+		if (first && write_back) cpu->R[data.Rn] = new_base;
+		first = false;
+	}
+	if (user_bank) cpu->switch_mode(mode);
+	cpu->check_halt();
+}
+
+void ARMInterpreter::exec_branch(Cpu* cpu, const DecodedInstruction& data)
+{
+	if (data.L)
+		cpu->R[14] = data.address + 4;
+	cpu->branch_to(cpu->R[15] + (sign_extend(data.Offset, 24) << 2));
+}
+
+void ARMInterpreter::exec_swi(Cpu* cpu, const DecodedInstruction& data)
+{
+	if (cpu->hle_bios && HLEBios::call(cpu, (u8)(data.Immediate >> 16)))
+		return;
+	cpu->enter_exception(Cpu::MODE_SVC, 0x08, data.address + 4);
+}
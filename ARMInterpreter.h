@@ -0,0 +1,89 @@
+#pragma once
+#include "Cpu.h"
+#include "DecodedInstruction.h"
+
+#include <array>
+#include <utility>
+
+/// <summary>
+/// ARM7TDMI execution engine. Each ARMInstruction::Type has its own handler working on the Cpu register file.
+/// Blocks run with direct-threaded dispatch (computed goto) where the compiler supports it, with a switch otherwise.
+/// </summary>
+class ARMInterpreter
+{
+public:
+	/// <summary>
+	/// Executes one instruction, R15 already pointing 8 bytes past it
+	/// </summary>
+	static void execute(Cpu* cpu, const DecodedInstruction& data);
+
+	/// <summary>
+	/// Executes instructions in order until one changes the program flow, the block cache drops them
+	/// or count is reached. Leaves PC on the next instruction to execute and returns the number executed.
+	/// Their fetch and internal cycles go to Cpu::pending_cycles, with the run time charges.
+	/// </summary>
+	static u32 execute_block(Cpu* cpu, const DecodedInstruction* instructions, u32 count);
+
+private:
+	typedef void (*Handler)(Cpu* cpu, const DecodedInstruction& data);
+
+	/// <summary>
+	/// Handlers indexed by ARMInstruction::Type
+	/// </summary>
+	static const Handler handlers[];
+
+	static void exec_undefined(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_data_proc_shimm(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_data_proc_shreg(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_data_proc_imm(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_msr_imm(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_psr_reg(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_bx(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_multiply(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_mul_long(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_swap(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_halfword_reg(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_halfword_imm(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_single_imm(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_single_reg(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_block_trans(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_branch(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_swi(Cpu* cpu, const DecodedInstruction& data);
+
+	// Operand 2 forms of the data processing instructions
+	static const u8 OPERAND_SHIMM = 0;
+	static const u8 OPERAND_SHREG = 1;
+	static const u8 OPERAND_IMM = 2;
+
+	/// <summary>
+	/// Data processing handler specialized for one ALU opcode, S bit, operand 2 form and shift type
+	/// </summary>
+	template <u8 Op, bool S, u8 Form, u8 ShiftType>
+	static void exec_data_proc(Cpu* cpu, const DecodedInstruction& data);
+
+	template <u8 Form, size_t... Index>
+	static constexpr std::array<Handler, 128> make_data_proc_table(std::index_sequence<Index...>);
+
+	/// <summary>
+	/// Specialized data processing handlers per operand 2 form, indexed by data_proc_index
+	/// </summary>
+	static const std::array<Handler, 128> data_proc_handlers[3];
+
+	static inline u32 data_proc_index(const DecodedInstruction& data)
+	{
+		return ((u32)data.Op << 3) | ((u32)data.S << 2) | data.Typ;
+	}
+
+	static void write_psr(Cpu* cpu, const DecodedInstruction& data, u32 value);
+	static void single_transfer(Cpu* cpu, const DecodedInstruction& data, u32 offset);
+	static void halfword_transfer(Cpu* cpu, const DecodedInstruction& data, u32 offset);
+
+	/// <summary>
+	/// Writes a register, branching when it is R15
+	/// </summary>
+	static inline void write_register(Cpu* cpu, u8 index, u32 value)
+	{
+		if (index == 15) cpu->branch_to(value);
+		else cpu->R[index] = value;
+	}
+};
@@ -0,0 +1,775 @@
+#include "ARMJit.h"
+#include "ARMInstruction.h"
+#include "ARMInterpreter.h"
+#include "InstructionFormat.h"
+
+#ifdef ARM_JIT_X64
+#include "X64Emitter.h"
+
+#include <sys/mman.h>
+
+// ALU Opcodes
+static const u8 OPCODE_AND = 0x0;
+static const u8 OPCODE_EOR = 0x1;
+static const u8 OPCODE_SUB = 0x2;
+static const u8 OPCODE_RSB = 0x3;
+static const u8 OPCODE_ADD = 0x4;
+static const u8 OPCODE_ADC = 0x5;
+static const u8 OPCODE_SBC = 0x6;
+static const u8 OPCODE_RSC = 0x7;
+static const u8 OPCODE_TST = 0x8;
+static const u8 OPCODE_TEQ = 0x9;
+static const u8 OPCODE_CMP = 0xA;
+static const u8 OPCODE_CMN = 0xB;
+static const u8 OPCODE_ORR = 0xC;
+static const u8 OPCODE_MOV = 0xD;
+static const u8 OPCODE_BIC = 0xE;
+static const u8 OPCODE_MVN = 0xF;
+
+// Shift types
+static const u8 SHIFT_LSL = 0;
+static const u8 SHIFT_LSR = 1;
+static const u8 SHIFT_ASR = 2;
+static const u8 SHIFT_ROR = 3;
+
+static const u8 COND_AL = 0xE;
+
+static const u64 CODE_SIZE = 16 << 20;
+
+// worst case host code size, checked before compiling a block
+static const u64 MAX_INSTRUCTION_CODE = 192;
+static const u64 MAX_BLOCK_CODE = 256;
+
+static inline bool is_logical(u8 op)
+{
+	return op == OPCODE_AND || op == OPCODE_EOR || op == OPCODE_TST || op == OPCODE_TEQ
+		|| op == OPCODE_ORR || op == OPCODE_MOV || op == OPCODE_BIC || op == OPCODE_MVN;
+}
+
+static inline bool writes_rd(u8 op) { return op < OPCODE_TST || op > OPCODE_CMN; }
+
+static inline bool reads_rn(u8 op) { return op != OPCODE_MOV && op != OPCODE_MVN; }
+
+static inline u32 rotate_right(u32 value, u32 amount)
+{
+	amount &= 31;
+	return amount ? (value >> amount) | (value << (32 - amount)) : value;
+}
+
+static inline bool is_data_proc(const DecodedInstruction& data)
+{
+	return data.type == (u8)ARMInstruction::Type::DataProc_Imm || data.type == (u8)ARMInstruction::Type::DataProc_Reg_ShImm;
+}
+
+static inline bool is_branch(const DecodedInstruction& data)
+{
+	return data.type == (u8)ARMInstruction::Type::B_BL_BLX_Offset;
+}
+
+/// <summary>
+/// Tells whether the instruction gets native code; the others call ARMInterpreter.
+/// Register-shifted operands, carry-reading ops, RRX and writes to R15 stay interpreted.
+/// </summary>
+static bool is_translated(const DecodedInstruction& data)
+{
+	if (is_branch(data))
+		return true;
+	if (!is_data_proc(data))
+		return false;
+	if (data.Op == OPCODE_ADC || data.Op == OPCODE_SBC || data.Op == OPCODE_RSC)
+		return false;
+	if (writes_rd(data.Op) && data.Rd == 15)
+		return false;
+	if (data.type == (u8)ARMInstruction::Type::DataProc_Reg_ShImm && data.Typ == SHIFT_ROR && data.Shift == 0)
+		return false;
+	return true;
+}
+
+/// <summary>
+/// Translates one decoded block. Compiled code runs with RBP = Cpu*, the remaining budget at [RSP],
+/// EAX/ECX/R8 as scratch and the most used guest registers in RBX, R12-R15.
+/// </summary>
+class ARMJit::Compiler
+{
+private:
+	static const int HOST_REGISTER_COUNT = 5;
+	static constexpr X64Reg HOST_REGISTERS[HOST_REGISTER_COUNT] = { X64Reg::RBX, X64Reg::R12, X64Reg::R13, X64Reg::R14, X64Reg::R15 };
+
+	ARMJit& jit;
+	const DecodedBlock& block;
+	X64Emitter x;
+
+	bool allocated[16] = {};
+	X64Reg host[16] = {};
+
+	/// <summary>
+	/// Guest registers whose host copy is newer than Cpu::R
+	/// </summary>
+	u16 dirty = 0;
+
+	/// <summary>
+	/// Operation whose result still sits in the host EFLAGS, None once anything else touched them
+	/// </summary>
+	Cpu::FlagOp host_flags = Cpu::FlagOp::None;
+
+	static int host_condition(u8 cond, Cpu::FlagOp op);
+
+	inline s32 offset_of(u8 r) const { return jit.offset_R + 4 * r; }
+
+	void allocate_registers();
+	void load(X64Reg dst, u8 r, u32 pc);
+	void store(u8 r, X64Reg src);
+	void store(u8 r, u32 value);
+	void write_back(u16 mask);
+	void reload();
+
+	void call(const void* function, u64 argument);
+	u8* skip_unless(u8 cond);
+
+	void exit_static(u32 target, u32 cycles);
+	void emit_interpreted(const DecodedInstruction& data, u32 cycles);
+	void emit_data_proc(const DecodedInstruction& data);
+	void emit_branch(const DecodedInstruction& data, u32 cycles);
+public:
+	Compiler(ARMJit& jit, const DecodedBlock& block, u8* code) : jit{ jit }, block{ block }, x{ code } { }
+
+	/// <summary>
+	/// Emits the block and returns its entry point; get_end() is the first free byte after it
+	/// </summary>
+	const u8* compile();
+	u8* get_end() const { return x.get_cursor(); }
+};
+
+void ARMJit::Compiler::allocate_registers()
+{
+	u32 uses[16] = {};
+	for (const DecodedInstruction& data : block.instructions)
+	{
+		if (!is_translated(data))
+			continue;
+		if (is_branch(data))
+		{
+			if (data.L) uses[14]++;
+			continue;
+		}
+		if (reads_rn(data.Op)) uses[data.Rn]++;
+		if (data.type == (u8)ARMInstruction::Type::DataProc_Reg_ShImm) uses[data.Rm]++;
+		if (writes_rd(data.Op)) uses[data.Rd]++;
+	}
+	uses[15] = 0; // R15 reads are constants
+
+	// a register used once is cheaper left in memory than loaded and stored around the block
+	for (int slot = 0; slot < HOST_REGISTER_COUNT; slot++)
+	{
+		int best = -1;
+		for (int r = 0; r < 15; r++)
+		{
+			if (!allocated[r] && uses[r] >= 2 && (best < 0 || uses[r] > uses[best]))
+				best = r;
+		}
+		if (best < 0)
+			break;
+		allocated[best] = true;
+		host[best] = HOST_REGISTERS[slot];
+	}
+}
+
+void ARMJit::Compiler::load(X64Reg dst, u8 r, u32 pc)
+{
+	if (r == 15) x.mov(dst, pc);
+	else if (allocated[r]) x.mov(dst, host[r]);
+	else x.load_rbp(dst, offset_of(r));
+}
+
+void ARMJit::Compiler::store(u8 r, X64Reg src)
+{
+	if (allocated[r])
+	{
+		x.mov(host[r], src);
+		dirty |= 1 << r;
+	}
+	else x.store_rbp(offset_of(r), src);
+}
+
+void ARMJit::Compiler::store(u8 r, u32 value)
+{
+	if (allocated[r])
+	{
+		x.mov(host[r], value);
+		dirty |= 1 << r;
+	}
+	else x.store_rbp(offset_of(r), value);
+}
+
+void ARMJit::Compiler::write_back(u16 mask)
+{
+	for (u8 r = 0; r < 15; r++)
+	{
+		if (mask & (1 << r))
+			x.store_rbp(offset_of(r), host[r]);
+	}
+}
+
+void ARMJit::Compiler::reload()
+{
+	for (u8 r = 0; r < 15; r++)
+	{
+		if (allocated[r])
+			x.load_rbp(host[r], offset_of(r));
+	}
+}
+
+void ARMJit::Compiler::call(const void* function, u64 argument)
+{
+	x.mov64(X64Reg::RDI, X64Reg::RBP);
+	x.mov64(X64Reg::RSI, argument);
+	x.mov64(X64Reg::RAX, (u64)function);
+	x.call(X64Reg::RAX);
+}
+
+/// <summary>
+/// x86 condition code that matches the ARM condition right after the host ALU op behind op, -1 if none does.
+/// x86 sets CF on borrow where ARM clears C, hence the swapped carry conditions after a subtraction.
+/// </summary>
+int ARMJit::Compiler::host_condition(u8 cond, Cpu::FlagOp op)
+{
+	static const s8 AFTER_SUB[14] = { 0x4, 0x5, 0x3, 0x2, 0x8, 0x9, 0x0, 0x1, 0x7, 0x6, 0xD, 0xC, 0xF, 0xE };
+	static const s8 AFTER_ADD[14] = { 0x4, 0x5, 0x2, 0x3, 0x8, 0x9, 0x0, 0x1, -1, -1, 0xD, 0xC, 0xF, 0xE };
+	static const s8 AFTER_TEST[14] = { 0x4, 0x5, -1, -1, 0x8, 0x9, -1, -1, -1, -1, -1, -1, -1, -1 };
+	if (cond >= 14)
+		return -1;
+	switch (op)
+	{
+	case Cpu::FlagOp::Sub: return AFTER_SUB[cond];
+	case Cpu::FlagOp::Add: return AFTER_ADD[cond];
+	case Cpu::FlagOp::Logical: return AFTER_TEST[cond];
+	default: return -1;
+	}
+}
+
+u8* ARMJit::Compiler::skip_unless(u8 cond)
+{
+	if (cond == COND_AL)
+		return nullptr;
+
+	// flags set by the previous instruction need no trip through Cpu::condition_passed
+	int cc = host_condition(cond, host_flags);
+	if (cc >= 0)
+		return x.jcc((u8)(cc ^ 1), x.get_cursor());
+
+	call((const void*)&ARMJit::check_condition, cond);
+	x.test(X64Reg::RAX, X64Reg::RAX);
+	return x.jcc(X64Emitter::JE, x.get_cursor());
+}
+
+void ARMJit::Compiler::exit_static(u32 target, u32 cycles)
+{
+	write_back(dirty);
+	x.store_rbp(offset_of(15), target);
+	x.sub_rsp_mem(cycles);
+	x.jcc(X64Emitter::JLE, jit.epilogue);
+
+	// jumps to the stub below until run_linked points it at the target block
+	u8* site = x.jmp(x.get_cursor() + 5);
+	x.mov64(X64Reg::RAX, (u64)site);
+	x.jmp(jit.link_epilogue);
+}
+
+void ARMJit::Compiler::emit_interpreted(const DecodedInstruction& data, u32 cycles)
+{
+	write_back(dirty);
+	dirty = 0;
+	call((const void*)&ARMJit::call_interpreter, (u64)&data);
+	// wait states and multiplier steps count against the budget right away, as for the interpreter
+	x.load_rbp(X64Reg::RCX, jit.offset_pending_cycles);
+	x.store_rbp(jit.offset_pending_cycles, 0u);
+	x.sub_rsp_mem(X64Reg::RCX);
+	x.test(X64Reg::RAX, X64Reg::RAX);
+	u8* resume = x.jcc(X64Emitter::JE, x.get_cursor());
+
+	// Cpu::R is up to date, the interpreter left PC on the next instruction to run
+	x.sub_rsp_mem(cycles);
+	x.jmp(jit.epilogue);
+
+	X64Emitter::patch(resume, x.get_cursor());
+	reload();
+}
+
+void ARMJit::Compiler::emit_data_proc(const DecodedInstruction& data)
+{
+	const u8 op = data.Op;
+	const u32 pc = data.address + 8;
+	const bool logical_flags = data.S && is_logical(op);
+
+	// logical ops keep V, so the pending flags are resolved first; R8 starts out as C
+	if (logical_flags)
+	{
+		x.mov64(X64Reg::RDI, X64Reg::RBP);
+		x.mov64(X64Reg::RAX, (u64)&ARMJit::read_carry);
+		x.call(X64Reg::RAX);
+		x.mov(X64Reg::R8, X64Reg::RAX);
+	}
+
+	// operand 2 in ECX, shifter carry out in R8
+	if (data.type == (u8)ARMInstruction::Type::DataProc_Imm)
+	{
+		u32 value = rotate_right(data.Immediate, data.Shift << 1);
+		x.mov(X64Reg::RCX, value);
+		if (logical_flags && data.Shift != 0)
+			x.mov(X64Reg::R8, value >> 31);
+	}
+	else
+	{
+		load(X64Reg::RCX, data.Rm, pc);
+		u8 amount = data.Shift;
+		auto carry_from_bit = [&](u8 bit)
+		{
+			if (!logical_flags) return;
+			x.mov(X64Reg::R8, X64Reg::RCX);
+			x.shift(X64Emitter::EXT_SHR, X64Reg::R8, bit);
+			if (bit != 31) x.alu(X64Emitter::EXT_AND, X64Reg::R8, 1u);
+		};
+
+		switch (data.Typ)
+		{
+		case SHIFT_LSL:
+			if (amount == 0) break;
+			carry_from_bit(32 - amount);
+			x.shift(X64Emitter::EXT_SHL, X64Reg::RCX, amount);
+			break;
+		case SHIFT_LSR:
+			// LSR #0 encodes LSR #32
+			carry_from_bit(amount ? amount - 1 : 31);
+			if (amount == 0) x.mov(X64Reg::RCX, 0u);
+			else x.shift(X64Emitter::EXT_SHR, X64Reg::RCX, amount);
+			break;
+		case SHIFT_ASR:
+			carry_from_bit(amount ? amount - 1 : 31);
+			x.shift(X64Emitter::EXT_SAR, X64Reg::RCX, amount ? amount : 31);
+			break;
+		default:
+			carry_from_bit(amount - 1);
+			x.shift(X64Emitter::EXT_ROR, X64Reg::RCX, amount);
+			break;
+		}
+	}
+
+	if (reads_rn(op))
+		load(X64Reg::RAX, data.Rn, pc);
+
+	// result in EAX; arithmetic flag operands go straight to Cpu::lazy_flags
+	Cpu::FlagOp flag_op = Cpu::FlagOp::Logical;
+	switch (op)
+	{
+	case OPCODE_AND:
+	case OPCODE_TST:
+		x.alu(X64Emitter::AND, X64Reg::RAX, X64Reg::RCX);
+		break;
+	case OPCODE_EOR:
+	case OPCODE_TEQ:
+		x.alu(X64Emitter::XOR, X64Reg::RAX, X64Reg::RCX);
+		break;
+	case OPCODE_ORR:
+		x.alu(X64Emitter::OR, X64Reg::RAX, X64Reg::RCX);
+		break;
+	case OPCODE_MOV:
+		x.mov(X64Reg::RAX, X64Reg::RCX);
+		break;
+	case OPCODE_BIC:
+		x.not_(X64Reg::RCX);
+		x.alu(X64Emitter::AND, X64Reg::RAX, X64Reg::RCX);
+		break;
+	case OPCODE_MVN:
+		x.mov(X64Reg::RAX, X64Reg::RCX);
+		x.not_(X64Reg::RAX);
+		break;
+	case OPCODE_RSB:
+		flag_op = Cpu::FlagOp::Sub;
+		if (data.S)
+		{
+			x.store_rbp(jit.offset_flag_a, X64Reg::RCX);
+			x.store_rbp(jit.offset_flag_b, X64Reg::RAX);
+		}
+		x.alu(X64Emitter::SUB, X64Reg::RCX, X64Reg::RAX);
+		x.mov(X64Reg::RAX, X64Reg::RCX);
+		break;
+	default:
+		// SUB, CMP, ADD, CMN
+		flag_op = op == OPCODE_ADD || op == OPCODE_CMN ? Cpu::FlagOp::Add : Cpu::FlagOp::Sub;
+		if (data.S)
+		{
+			x.store_rbp(jit.offset_flag_a, X64Reg::RAX);
+			x.store_rbp(jit.offset_flag_b, X64Reg::RCX);
+		}
+		x.alu(flag_op == Cpu::FlagOp::Add ? X64Emitter::ADD : X64Emitter::SUB, X64Reg::RAX, X64Reg::RCX);
+		break;
+	}
+
+	if (data.S)
+	{
+		x.store8_rbp(jit.offset_flag_op, (u8)flag_op);
+		x.store_rbp(jit.offset_flag_result, X64Reg::RAX);
+		if (logical_flags)
+			x.store_rbp(jit.offset_flag_carry, X64Reg::R8);
+	}
+
+	if (writes_rd(op))
+		store(data.Rd, X64Reg::RAX);
+
+	// mov leaves EFLAGS alone, so the ALU op above still owns them; logical ops only give N and Z
+	if (data.S && logical_flags)
+		x.test(X64Reg::RAX, X64Reg::RAX);
+	host_flags = data.S && data.Cond == COND_AL ? flag_op : Cpu::FlagOp::None;
+}
+
+void ARMJit::Compiler::emit_branch(const DecodedInstruction& data, u32 cycles)
+{
+	u8* not_taken = skip_unless(data.Cond);
+	u16 dirty_before = dirty;
+
+	u32 offset = (u32)((s32)(data.Offset << 8) >> 8) << 2;
+	u32 target = data.address + 8 + offset;
+	if (data.L)
+		store(14, data.address + 4);
+	// the pipeline refill, as Cpu::branch_to charges it
+	const Memory* memory = jit.cpu->memory;
+	u32 taken_cycles = cycles + memory->access_time(target, true, false) + memory->access_time(target, true, true);
+	if (block.idle && target == block.address)
+	{
+		// the idle loop went round once: halt, and leave for Cpu::run to skip ahead instead of linking
+		write_back(dirty);
+		x.store_rbp(offset_of(15), target);
+		x.store8_rbp(jit.offset_halted, 1);
+		x.sub_rsp_mem(taken_cycles);
+		x.jmp(jit.epilogue);
+	}
+	else exit_static(target, taken_cycles);
+
+	if (not_taken)
+	{
+		X64Emitter::patch(not_taken, x.get_cursor());
+		dirty = dirty_before;
+		exit_static(data.address + 4, cycles);
+	}
+}
+
+const u8* ARMJit::Compiler::compile()
+{
+	const u8* entry = x.get_cursor();
+	allocate_registers();
+	reload();
+
+	// fetch and internal cycles up to and including the current instruction
+	u32 cycles = 0;
+	for (const DecodedInstruction& data : block.instructions)
+	{
+		cycles += data.cycles;
+		if (!is_translated(data))
+		{
+			emit_interpreted(data, cycles);
+			host_flags = Cpu::FlagOp::None;
+			continue;
+		}
+		if (is_branch(data))
+		{
+			emit_branch(data, cycles);
+			return entry;
+		}
+
+		u8* skip = skip_unless(data.Cond);
+		emit_data_proc(data);
+		if (skip) X64Emitter::patch(skip, x.get_cursor());
+	}
+
+	// the block was cut by a page boundary or an instruction the interpreter branched on
+	exit_static(block.instructions.back().address + 4, cycles);
+	return entry;
+}
+
+bool ARMJit::is_available()
+{
+	return true;
+}
+
+ARMJit::ARMJit(Cpu* cpu) : cpu{ cpu }
+{
+	void* memory = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+		throw std::bad_alloc();
+	code = (u8*)memory;
+	code_size = CODE_SIZE;
+
+	auto offset = [cpu](const void* field) { return (s32)((const u8*)field - (const u8*)cpu); };
+	offset_R = offset(cpu->R);
+	offset_flag_op = offset(&cpu->lazy_flags.op);
+	offset_flag_result = offset(&cpu->lazy_flags.result);
+	offset_flag_a = offset(&cpu->lazy_flags.a);
+	offset_flag_b = offset(&cpu->lazy_flags.b);
+	offset_flag_carry = offset(&cpu->lazy_flags.carry);
+	offset_pending_cycles = offset(&cpu->pending_cycles);
+	offset_halted = offset(&cpu->halted);
+
+	emit_trampoline();
+	flush();
+}
+
+void ARMJit::emit_trampoline()
+{
+	X64Emitter x{ code };
+	enter = (EntryPoint)code;
+
+	// RSP is 16-byte aligned again after six pushes and the budget slot
+	x.push(X64Reg::RBX);
+	x.push(X64Reg::RBP);
+	x.push(X64Reg::R12);
+	x.push(X64Reg::R13);
+	x.push(X64Reg::R14);
+	x.push(X64Reg::R15);
+	x.sub_rsp(8);
+	x.store_rsp(X64Reg::RDX);
+	x.mov64(X64Reg::RBP, X64Reg::RDI);
+	x.jmp(X64Reg::RSI);
+
+	// RAX = jmp displacement to patch once the block at PC is compiled
+	link_epilogue = x.get_cursor();
+	x.mov64(X64Reg::RCX, (u64)&link_site);
+	x.mov64_store(X64Reg::RCX, X64Reg::RAX);
+
+	epilogue = x.get_cursor();
+	x.load_rsp(X64Reg::RAX);
+	x.add_rsp(8);
+	x.pop(X64Reg::R15);
+	x.pop(X64Reg::R14);
+	x.pop(X64Reg::R13);
+	x.pop(X64Reg::R12);
+	x.pop(X64Reg::RBP);
+	x.pop(X64Reg::RBX);
+	x.ret();
+
+	trampoline_size = x.get_cursor() - code;
+}
+
+void ARMJit::flush()
+{
+	blocks.clear();
+	code_used = trampoline_size;
+	link_site = nullptr;
+	block_generation = cpu->block_cache.get_generation();
+}
+
+const u8* ARMJit::compile(u32 address)
+{
+	const DecodedBlock* block = cpu->block_cache.lookup(address, false);
+	if (code_used + block->instructions.size() * MAX_INSTRUCTION_CODE + MAX_BLOCK_CODE > code_size)
+		flush();
+
+	Compiler compiler{ *this, *block, code + code_used };
+	const u8* entry = compiler.compile();
+	code_used = compiler.get_end() - code;
+	return blocks[address] = entry;
+}
+
+const u8* ARMJit::entry_for(u32 address)
+{
+	// compiled code points into the decoded blocks, which only live for one generation
+	if (block_generation != cpu->block_cache.get_generation())
+		flush();
+
+	auto it = blocks.find(address);
+	return it != blocks.end() ? it->second : compile(address);
+}
+
+u32 ARMJit::call_interpreter(Cpu* cpu, const DecodedInstruction* data)
+{
+	// read before running: the instruction may write over its own block
+	u32 address = data->address;
+	u32 generation = cpu->block_cache.get_generation();
+	cpu->PC = address + 8;
+	cpu->branched = false;
+	try
+	{
+		ARMInterpreter::execute(cpu, *data);
+	}
+	catch (...)
+	{
+		cpu->jit->pending_exception = std::current_exception();
+		return 1;
+	}
+
+	if (cpu->branched)
+		return 1;
+	if (cpu->block_cache.get_generation() != generation)
+	{
+		// the instruction wrote over decoded code, maybe this very block
+		cpu->PC = address + 4;
+		return 1;
+	}
+	return 0;
+}
+
+u32 ARMJit::check_condition(Cpu* cpu, u32 cond)
+{
+	return cpu->condition_passed((u8)cond);
+}
+
+u32 ARMJit::read_carry(Cpu* cpu)
+{
+	return cpu->get_carry();
+}
+
+s32 ARMJit::run_linked(s32 budget)
+{
+	s32 remaining = budget;
+	while (remaining > 0 && !cpu->halted && cpu->instruction_state == Cpu::InstructionState::ARM)
+	{
+		const u8* block = entry_for(cpu->PC);
+		if (link_site)
+		{
+			X64Emitter::patch(link_site, block);
+			link_site = nullptr;
+		}
+
+		remaining = enter(cpu, block, remaining);
+		if (pending_exception)
+		{
+			std::exception_ptr exception = pending_exception;
+			pending_exception = nullptr;
+			link_site = nullptr;
+			std::rethrow_exception(exception);
+		}
+	}
+	return remaining;
+}
+
+u32 ARMJit::run(u32 budget)
+{
+	if (shadow_cpu)
+		return run_lockstep(budget);
+	return (u32)((s64)budget - run_linked((s32)budget));
+}
+
+void ARMJit::set_lockstep(bool enabled)
+{
+	if (!enabled)
+	{
+		shadow_cpu.reset();
+		shadow_memory.reset();
+		return;
+	}
+	if (shadow_cpu)
+		return;
+
+	const Memory* memory = cpu->memory;
+	shadow_memory = std::make_unique<Memory>();
+	shadow_memory->set_access_mode(memory->get_access_mode());
+	if (memory->get_BIOS()) shadow_memory->map_BIOS(memory->get_BIOS());
+	if (memory->get_ROM()) shadow_memory->map_ROM(memory->get_ROM());
+	shadow_cpu = std::make_unique<Cpu>(shadow_memory.get());
+	shadow_snapshot.resize(Memory::ARENA_SIZE);
+}
+
+void ARMJit::sync_shadow()
+{
+	// the caller may have changed anything since the last run
+	if (!shadow_memory->same_contents(*cpu->memory))
+	{
+		cpu->memory->snapshot(shadow_snapshot.data());
+		shadow_memory->restore(shadow_snapshot.data());
+	}
+
+	Cpu& shadow = *shadow_cpu;
+	memcpy(shadow.R, cpu->R, sizeof(cpu->R));
+	shadow.CPSR = cpu->CPSR;
+	shadow.lazy_flags = cpu->lazy_flags;
+	shadow.bank = cpu->bank;
+	memcpy(shadow.banked_R13_R14, cpu->banked_R13_R14, sizeof(cpu->banked_R13_R14));
+	memcpy(shadow.banked_R8_R12, cpu->banked_R8_R12, sizeof(cpu->banked_R8_R12));
+	memcpy(shadow.SPSR, cpu->SPSR, sizeof(cpu->SPSR));
+	shadow.instruction_state = cpu->instruction_state;
+	shadow.halted = cpu->halted;
+	shadow.hle_bios = cpu->hle_bios;
+	memcpy(shadow.dma.channels, cpu->dma.channels, sizeof(cpu->dma.channels));
+}
+
+void ARMJit::compare_shadow(u32 address, u32 cycles, u32 shadow_cycles)
+{
+	const Cpu& shadow = *shadow_cpu;
+	std::string difference;
+	if (cycles != shadow_cycles)
+		difference = string_format("%u cycles, interpreter %u", cycles, shadow_cycles);
+	for (int i = 0; i < 16 && difference.empty(); i++)
+	{
+		if (cpu->R[i] != shadow.R[i])
+			difference = string_format("R%i = %08X, interpreter %08X", i, cpu->R[i], shadow.R[i]);
+	}
+	if (difference.empty() && cpu->get_CPSR() != shadow.get_CPSR())
+		difference = string_format("CPSR = %08X, interpreter %08X", cpu->get_CPSR(), shadow.get_CPSR());
+	if (difference.empty() && memcmp(cpu->SPSR, shadow.SPSR, sizeof(cpu->SPSR)) != 0)
+		difference = "banked SPSR";
+	if (difference.empty() && cpu->halted != shadow.halted)
+		difference = cpu->halted ? "halted, interpreter running" : "running, interpreter halted";
+	if (difference.empty() && !cpu->memory->same_contents(*shadow.memory))
+		difference = "memory contents";
+
+	if (!difference.empty())
+		throw std::exception(string_format("JIT lockstep mismatch in block %08X: %s", address, difference.c_str()).c_str());
+}
+
+u32 ARMJit::run_lockstep(u32 budget)
+{
+	sync_shadow();
+	// the interpreter replica counts run time charges per block: start both from zero
+	u32 executed = cpu->take_pending_cycles();
+	while (executed < budget && !cpu->halted && cpu->instruction_state == Cpu::InstructionState::ARM)
+	{
+		u32 address = cpu->PC;
+		u32 shadow_executed = shadow_cpu->run_block();
+
+		// one block at a time: a budget of 1 never takes the linked exits
+		s32 remaining = enter(cpu, entry_for(address), 1);
+		link_site = nullptr;
+		if (pending_exception)
+		{
+			std::exception_ptr exception = pending_exception;
+			pending_exception = nullptr;
+			std::rethrow_exception(exception);
+		}
+
+		u32 step = (u32)(1 - remaining) + cpu->take_pending_cycles();
+		compare_shadow(address, step, shadow_executed);
+		executed += step;
+	}
+	return executed;
+}
+
+ARMJit::~ARMJit()
+{
+	munmap(code, code_size);
+}
+
+#else
+
+bool ARMJit::is_available()
+{
+	return false;
+}
+
+ARMJit::ARMJit(Cpu* cpu) : cpu{ cpu }
+{
+	throw std::exception("The ARM JIT needs an x86-64 Linux host");
+}
+
+u32 ARMJit::run(u32 budget)
+{
+	return 0;
+}
+
+void ARMJit::set_lockstep(bool enabled)
+{
+}
+
+ARMJit::~ARMJit()
+{
+}
+
+#endif
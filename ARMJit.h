@@ -0,0 +1,105 @@
+#pragma once
+#include "Cpu.h"
+#include "DecodedInstruction.h"
+
+#include <exception>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(ARM_NO_JIT)
+#define ARM_JIT_X64
+#endif
+
+/// <summary>
+/// Dynamic recompiler turning decoded ARM blocks into x86-64 code (Linux hosts).
+/// Data processing and branches are translated; every other instruction calls back into ARMInterpreter.
+/// Up to five guest registers per block live in callee-saved host registers, and blocks ending on a
+/// known target jump straight into the next compiled block once it exists.
+/// </summary>
+class ARMJit
+{
+private:
+	Cpu* cpu;
+
+	u8* code = nullptr;
+	u64 code_size = 0;
+	u64 code_used = 0;
+	u64 trampoline_size = 0;
+
+	/// <summary>
+	/// s32 enter(Cpu* cpu, const u8* block, s32 budget): runs compiled code, returns the cycle budget left
+	/// </summary>
+	typedef s32 (*EntryPoint)(Cpu* cpu, const u8* block, s32 budget);
+	EntryPoint enter = nullptr;
+	const u8* epilogue = nullptr;
+	const u8* link_epilogue = nullptr;
+
+	/// <summary>
+	/// Compiled code of the ARM block at each guest address, valid for block_generation
+	/// </summary>
+	std::unordered_map<u32, const u8*> blocks;
+	u32 block_generation = 0;
+
+	/// <summary>
+	/// jmp displacement of the last block exit that asked to be linked to the block at PC
+	/// </summary>
+	u8* link_site = nullptr;
+
+	/// <summary>
+	/// Exception thrown by an interpreted instruction, rethrown once out of compiled code
+	/// </summary>
+	std::exception_ptr pending_exception;
+
+	// Cpu field offsets the compiled code addresses relative to RBP
+	s32 offset_R = 0;
+	s32 offset_flag_op = 0, offset_flag_result = 0, offset_flag_a = 0, offset_flag_b = 0, offset_flag_carry = 0;
+	s32 offset_pending_cycles = 0, offset_halted = 0;
+
+	/// <summary>
+	/// Interpreter replica checked against the compiled code after every block, when lockstep is on
+	/// </summary>
+	std::unique_ptr<Memory> shadow_memory;
+	std::unique_ptr<Cpu> shadow_cpu;
+	std::vector<u8> shadow_snapshot;
+
+	void emit_trampoline();
+	void flush();
+	const u8* compile(u32 address);
+	const u8* entry_for(u32 address);
+
+	s32 run_linked(s32 budget);
+	u32 run_lockstep(u32 budget);
+	void sync_shadow();
+	void compare_shadow(u32 address, u32 cycles, u32 shadow_cycles);
+
+	// called from compiled code
+	static u32 call_interpreter(Cpu* cpu, const DecodedInstruction* data);
+	static u32 check_condition(Cpu* cpu, u32 cond);
+	static u32 read_carry(Cpu* cpu);
+
+	class Compiler;
+public:
+	/// <summary>
+	/// Tells whether this build and host can run compiled code
+	/// </summary>
+	static bool is_available();
+
+	ARMJit(Cpu* cpu);
+	ARMJit(const ARMJit&) = delete;
+	ARMJit& operator=(const ARMJit&) = delete;
+
+	/// <summary>
+	/// Runs whole blocks from PC until at least budget cycles passed or the CPU leaves ARM state.
+	/// Returns the cycles run, with the run time charges of interpreted instructions.
+	/// </summary>
+	u32 run(u32 budget);
+
+	/// <summary>
+	/// Replays every block on an interpreter copy of the CPU and memory and throws on the first difference
+	/// </summary>
+	void set_lockstep(bool enabled);
+	bool get_lockstep() const { return shadow_cpu != nullptr; }
+
+	~ARMJit();
+};
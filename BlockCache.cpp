@@ -0,0 +1,257 @@
+#include "BlockCache.h"
+#include "ARMInstruction.h"
+#include "ThumbDecoder.h"
+#include "IdleLoop.h"
+
+BlockCache::BlockCache(Memory* memory) : memory{ memory }
+{
+}
+
+const DecodedBlock* BlockCache::lookup(u32 address, bool thumb)
+{
+	retired.clear();
+
+	u32 key = make_key(address, thumb);
+	auto it = blocks.find(key);
+	if (it != blocks.end())
+		return &it->second;
+
+	DecodedBlock block;
+	block.address = address;
+	block.thumb = thumb;
+	compile(block);
+	time(block);
+	block.idle = IdleLoop::detect(block);
+
+	int page = ram_page(address);
+	if (page >= 0)
+	{
+		page_blocks[page].push_back(key);
+		memory->protect_code_page(address);
+	}
+	return &(blocks[key] = std::move(block));
+}
+
+void BlockCache::compile(DecodedBlock& block)
+{
+	u32 address = block.address;
+	u32 page_end = (address | ((1 << PAGE_SHIFT) - 1)) + 1;
+	u32 size = block.thumb ? 2 : 4;
+
+	for (u32 n = (page_end - address) / size; n--; address += size)
+	{
+		DecodedInstruction instr{};
+		instr.address = address;
+		try
+		{
+			instr.opcode = block.thumb ? memory->get16(address) : memory->get32(address);
+		}
+		catch (const InvalidMemoryAccess&)
+		{
+			// the block simply ends where readable memory does
+			if (block.instructions.empty()) throw;
+			break;
+		}
+
+		if (block.thumb)
+		{
+			ThumbInstruction::decode(instr);
+			// a BL prefix followed by its suffix on the same page runs as one instruction
+			if (instr.type == (u8)ThumbInstruction::InstructionType::BLhi && n > 0)
+			{
+				u16 next = memory->get16(address + 2);
+				if ((next & 0xF800) == 0xF800)
+				{
+					instr.opcode |= (u32)next << 16;
+					ThumbInstruction::decode(instr);
+					address += 2;
+					n--;
+				}
+			}
+			block.instructions.push_back(instr);
+			if (ThumbInstruction::ends_block(instr))
+				break;
+		}
+		else
+		{
+			ARMInstruction::decode(instr);
+			block.instructions.push_back(instr);
+			if (ARMInstruction::ends_block(instr))
+				break;
+		}
+	}
+}
+
+// Internal (I) cycles of ARM instructions, besides the multiplier steps that depend on the operand
+static u32 internal_cycles(const DecodedInstruction& instr)
+{
+	switch ((ARMInstruction::Type)instr.type)
+	{
+	case ARMInstruction::Type::DataProc_Reg_ShReg:
+	case ARMInstruction::Type::TransSwp12:
+		return 1;
+	case ARMInstruction::Type::Multiply:
+		return instr.A;
+	case ARMInstruction::Type::MulLong:
+		return 1 + instr.A;
+	case ARMInstruction::Type::TransImm9:
+	case ARMInstruction::Type::TransReg9:
+	case ARMInstruction::Type::TransImm10:
+	case ARMInstruction::Type::TransReg10:
+	case ARMInstruction::Type::BlockTrans:
+		return instr.L;
+	default:
+		return 0;
+	}
+}
+
+// Stores leave the bus on the data side, so the next code fetch is non-sequential
+static bool stores_data(const DecodedInstruction& instr)
+{
+	switch ((ARMInstruction::Type)instr.type)
+	{
+	case ARMInstruction::Type::TransImm9:
+	case ARMInstruction::Type::TransReg9:
+	case ARMInstruction::Type::TransImm10:
+	case ARMInstruction::Type::TransReg10:
+	case ARMInstruction::Type::BlockTrans:
+		return !instr.L;
+	default:
+		return false;
+	}
+}
+
+// Internal (I) cycles of Thumb instructions, besides the multiplier steps
+static u32 thumb_internal_cycles(const DecodedInstruction& instr)
+{
+	switch ((ThumbInstruction::InstructionType)instr.type)
+	{
+	case ThumbInstruction::InstructionType::LSLr:
+	case ThumbInstruction::InstructionType::LSRr:
+	case ThumbInstruction::InstructionType::ASRr:
+	case ThumbInstruction::InstructionType::ROR:
+	case ThumbInstruction::InstructionType::LDRpc:
+	case ThumbInstruction::InstructionType::LDRr:
+	case ThumbInstruction::InstructionType::LDRBr:
+	case ThumbInstruction::InstructionType::LDSBr:
+	case ThumbInstruction::InstructionType::LDRHr:
+	case ThumbInstruction::InstructionType::LDSHr:
+	case ThumbInstruction::InstructionType::LDRi:
+	case ThumbInstruction::InstructionType::LDRBi:
+	case ThumbInstruction::InstructionType::LDRHi:
+	case ThumbInstruction::InstructionType::LDRsp:
+	case ThumbInstruction::InstructionType::POP:
+	case ThumbInstruction::InstructionType::LDMIA:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static bool thumb_stores_data(const DecodedInstruction& instr)
+{
+	switch ((ThumbInstruction::InstructionType)instr.type)
+	{
+	case ThumbInstruction::InstructionType::STRr:
+	case ThumbInstruction::InstructionType::STRBr:
+	case ThumbInstruction::InstructionType::STRHr:
+	case ThumbInstruction::InstructionType::STRi:
+	case ThumbInstruction::InstructionType::STRBi:
+	case ThumbInstruction::InstructionType::STRHi:
+	case ThumbInstruction::InstructionType::STRsp:
+	case ThumbInstruction::InstructionType::PUSH:
+	case ThumbInstruction::InstructionType::STMIA:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void BlockCache::time(DecodedBlock& block) const
+{
+	const bool word = !block.thumb;
+	const u32 fetch_size = block.thumb ? 1 : 2; // halfwords
+	const u32 region = block.address >> 24;
+	const bool prefetch = memory->is_prefetch_enabled() && region >= 0x8 && region <= 0xD;
+	const u32 halfword_time = memory->access_time(block.address, false, true);
+
+	u32 buffered = 0, fill = 0;
+	bool sequential = true;
+	for (DecodedInstruction& instr : block.instructions)
+	{
+		// a fused BL pair fetches both of its halfwords
+		u32 fetch = 0;
+		u32 fetches = block.thumb ? ThumbInstruction::size(instr) / 2 : 1;
+		for (u32 i = 0; i < fetches; i++)
+		{
+			u32 time = memory->access_time(instr.address + 2 * i, word, sequential || i > 0);
+			if (prefetch && buffered >= fetch_size)
+			{
+				time = 1;
+				buffered -= fetch_size;
+			}
+			fetch += time;
+		}
+
+		u32 internal = block.thumb ? thumb_internal_cycles(instr) : internal_cycles(instr);
+		instr.cycles = (u8)(fetch + internal);
+
+		if (prefetch)
+		{
+			fill += internal;
+			while (fill >= halfword_time && buffered < 8)
+			{
+				fill -= halfword_time;
+				buffered++;
+			}
+			if (buffered == 8) fill = 0;
+		}
+		sequential = block.thumb ? !thumb_stores_data(instr) : !stores_data(instr);
+	}
+}
+
+void BlockCache::invalidate_range(u32 offset1, u32 offset2)
+{
+	for (u64 address = offset1 & ~((1 << PAGE_SHIFT) - 1); address < offset2; address += (1 << PAGE_SHIFT))
+	{
+		int page = ram_page((u32)address);
+		if (page >= 0 && !page_blocks[page].empty())
+			invalidate_page(page);
+	}
+}
+
+bool BlockCache::has_code(u32 offset1, u32 offset2) const
+{
+	for (u64 address = offset1 & ~((1 << PAGE_SHIFT) - 1); address < offset2; address += (1 << PAGE_SHIFT))
+	{
+		int page = ram_page((u32)address);
+		if (page >= 0 && !page_blocks[page].empty())
+			return true;
+	}
+	return false;
+}
+
+void BlockCache::invalidate_page(int page)
+{
+	for (u32 key : page_blocks[page])
+	{
+		auto it = blocks.find(key);
+		if (it != blocks.end())
+		{
+			retired.push_back(std::move(it->second));
+			blocks.erase(it);
+		}
+	}
+	page_blocks[page].clear();
+	generation++;
+}
+
+void BlockCache::clear()
+{
+	for (auto& entry : blocks)
+		retired.push_back(std::move(entry.second));
+	blocks.clear();
+	for (auto& keys : page_blocks)
+		keys.clear();
+	generation++;
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include "Types.h"
+#include "DecodedInstruction.h"
+#include "Memory.h"
+
+#include <unordered_map>
+#include <vector>
+
+/// <summary>
+/// Straight-line run of pre-decoded instructions, ending at the first instruction
+/// that may change the program flow or at a 256-byte page boundary
+/// </summary>
+struct DecodedBlock
+{
+	u32 address = 0;
+	bool thumb = false;
+	std::vector<DecodedInstruction> instructions;
+
+	/// <summary>
+	/// Side effect free polling loop, see IdleLoop: once it branches back to its start,
+	/// nothing changes before the next event
+	/// </summary>
+	bool idle = false;
+};
+
+/// <summary>
+/// Decoded basic blocks keyed by guest address and instruction state.
+/// Blocks living in EWRAM/IWRAM are dropped when Memory writes over them.
+/// </summary>
+class BlockCache
+{
+private:
+	Memory* memory;
+	std::unordered_map<u32, DecodedBlock> blocks;
+
+	static const u32 PAGE_SHIFT = 8;
+	static const u32 EWRAM_PAGES = Memory::EWRAM_SIZE >> PAGE_SHIFT;
+	static const u32 IWRAM_PAGES = Memory::IWRAM_SIZE >> PAGE_SHIFT;
+
+	/// <summary>
+	/// Keys of the blocks decoded from each code-bearing RAM page
+	/// </summary>
+	std::vector<u32> page_blocks[EWRAM_PAGES + IWRAM_PAGES];
+
+	/// <summary>
+	/// Blocks dropped since the last lookup. A store can drop the block that is running it,
+	/// so they are only freed once the execution loops are back to looking up the next block.
+	/// </summary>
+	std::vector<DecodedBlock> retired;
+
+	u32 generation = 0;
+
+	static inline u32 make_key(u32 address, bool thumb) { return address | (thumb ? 1 : 0); }
+
+	/// <summary>
+	/// Index into page_blocks, or -1 if the address is not in EWRAM/IWRAM
+	/// </summary>
+	static inline int ram_page(u32 address)
+	{
+		switch (address >> 24)
+		{
+		case 0x2: return (int)((address & (Memory::EWRAM_SIZE - 1)) >> PAGE_SHIFT);
+		case 0x3: return (int)(EWRAM_PAGES + ((address & (Memory::IWRAM_SIZE - 1)) >> PAGE_SHIFT));
+		default: return -1;
+		}
+	}
+
+	void compile(DecodedBlock& block);
+
+	/// <summary>
+	/// Sets the fetch and internal cycles of every instruction from the current wait states.
+	/// Game Pak code with the prefetch buffer on gets the fetches the buffer covers for 1 cycle:
+	/// it fills at the sequential rate while instructions spend internal cycles, and a branch empties it.
+	/// </summary>
+	void time(DecodedBlock& block) const;
+	void invalidate_range(u32 offset1, u32 offset2);
+	void invalidate_page(int page);
+public:
+	BlockCache(Memory* memory);
+
+	/// <summary>
+	/// Returns the block starting at address, decoding it on a miss, and frees the retired blocks.
+	/// The pointer stays valid while get_generation() does not change; the instructions
+	/// of a dropped block stay readable until the next lookup.
+	/// </summary>
+	const DecodedBlock* lookup(u32 address, bool thumb);
+
+	/// <summary>
+	/// Drops the blocks decoded from [offset1, offset2)
+	/// </summary>
+	inline void invalidate(u32 offset1, u32 offset2)
+	{
+		if ((offset1 >> 24) > 0x3 || ((offset2 - 1) >> 24) < 0x2) return;
+		invalidate_range(offset1, offset2);
+	}
+
+	/// <summary>
+	/// Tells whether decoded blocks were read from [offset1, offset2)
+	/// </summary>
+	bool has_code(u32 offset1, u32 offset2) const;
+
+	void clear();
+
+	u32 get_generation() const { return generation; }
+};
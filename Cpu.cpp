@@ -1,22 +1,83 @@
 #include "Cpu.h"
 #include "ARMInstruction.h"
+#include "ARMInterpreter.h"
+#include "ThumbInterpreter.h"
+#include "ARMJit.h"
+#include "IRInterpreter.h"
 
-Cpu::Cpu(Memory* memory) : memory{ memory }
+#include <algorithm>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Carry and overflow of 32-bit additions and subtractions, where C is the inverted borrow
+static inline bool add_carry(u32 a, u32 b, u32& result)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_add_overflow(a, b, &result);
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	return _addcarry_u32(0, a, b, &result) != 0;
+#else
+	result = a + b;
+	return result < a;
+#endif
+}
+
+static inline bool sub_borrow(u32 a, u32 b, u32& result)
 {
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_sub_overflow(a, b, &result);
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	return _subborrow_u32(0, a, b, &result) != 0;
+#else
+	result = a - b;
+	return a < b;
+#endif
+}
+
+static inline bool add_overflow(u32 a, u32 b)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	s32 result;
+	return __builtin_add_overflow((s32)a, (s32)b, &result);
+#else
+	return ((~(a ^ b) & (a ^ (a + b))) >> 31) != 0;
+#endif
+}
+
+static inline bool sub_overflow(u32 a, u32 b)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	s32 result;
+	return __builtin_sub_overflow((s32)a, (s32)b, &result);
+#else
+	return (((a ^ b) & (a ^ (a - b))) >> 31) != 0;
+#endif
+}
+
+Cpu::Cpu(Memory* memory) : memory{ memory }, block_cache{ memory }, dma{ this }
+{
+	memory->set_block_cache(&block_cache);
+	memory->set_dma(&dma);
+
 	for (int i = 0; i < 16; i++) R[i] = 0;
-	for (int i = 0; i < 7; i++) R_fiq[i] = 0;
-	R_svc[0] = R_svc[1] = 0;
-	R_abt[0] = R_abt[1] = 0;
-	R_irq[0] = R_irq[1] = 0;
-	R_und[0] = R_und[1] = 0;	
-	CPSR = 0;
-	SPSR_fiq = 0;
-	SPSR_svc = 0;
-	SPSR_abt = 0;
-	SPSR_irq = 0;
-	SPSR_und = 0;
+	for (int i = 0; i < BANK_COUNT; i++)
+	{
+		banked_R13_R14[i][0] = banked_R13_R14[i][1] = 0;
+		SPSR[i] = 0;
+	}
+	for (int i = 0; i < 5; i++) banked_R8_R12[0][i] = banked_R8_R12[1][i] = 0;
+	CPSR = MODE_SVC | FLAG_I | FLAG_F; // reset state
+	bank = MODE_BANK[MODE_SVC];
 
 	PC = 0;
+
+	for (int i = 0; i < 3; i++) pipeline[i] = DecodedInstruction{};
+}
+
+Cpu::~Cpu()
+{
 }
 
 
@@ -24,33 +85,379 @@ void Cpu::do_cycle()
 {
 	if(instruction_state == Cpu::InstructionState::ARM)
 	{ 
-		if (pipeline[2] == nullptr)
+		// execute (PC already points 8 bytes past the executed instruction)
+		if (pipeline_size == 2)
+		{
+			ARMInstruction::execute(this, pipeline[pipeline_head]);
+			if (pipeline_size == 0) return; // flushed by a branch
+		}
+
+		// decode (already done by the block cache)
+		if (pipeline_size > 0)
+		{
+			const DecodedInstruction& instr = pipeline[(pipeline_head + pipeline_size - 1) % 3];
+			if (trace) *trace << ARMInstruction::to_string(instr) << '\n';
+		}
+
+		// fetch
+		const DecodedInstruction& fetched = fetch_decoded(false);
+		pipeline[(pipeline_head + pipeline_size) % 3] = fetched;
+		memory->set_open_bus(fetched.opcode);
+		PC += 4;
+
+		if (++pipeline_size == 3)
+		{
+			pipeline_head = (pipeline_head + 1) % 3;
+			pipeline_size--;
+		}
+	}
+	else
+	{
+		// execute; a fused BL takes two fetch slots, so PC is set from the instruction itself
+		if (pipeline_size == 2)
 		{
-			pipeline[2] = pipeline[1];
-			pipeline[1] = pipeline[0];
-			pipeline[0] = new ARMInstruction(PC, memory->get32(PC));
-			PC += 4;
+			u32 fetch_PC = PC;
+			PC = pipeline[pipeline_head].address + 4;
+			ThumbInterpreter::execute(this, pipeline[pipeline_head]);
+			if (pipeline_size == 0) return; // flushed by a branch
+			PC = fetch_PC;
 		}
 
-		if (pipeline[1])
+		// decode (already done by the block cache)
+		if (pipeline_size > 0)
 		{
-			pipeline[1]->decode();			
-			std::cout << pipeline[1]->to_string() << '\n';
+			const DecodedInstruction& instr = pipeline[(pipeline_head + pipeline_size - 1) % 3];
+			if (trace) *trace << ThumbInstruction::to_string(instr) << '\n';
 		}
 
-		if (pipeline[2])
+		// fetch, halfword by halfword; the bus holds the last fetched halfword twice
+		const DecodedInstruction& fetched = fetch_decoded(true);
+		u32 size = ThumbInstruction::size(fetched);
+		pipeline[(pipeline_head + pipeline_size) % 3] = fetched;
+		memory->set_open_bus(((fetched.opcode >> ((size - 2) * 8)) & 0xFFFF) * 0x00010001);
+		PC += size;
+
+		if (++pipeline_size == 3)
 		{
-			pipeline[2]->execute(this);
-			delete pipeline[2];
-			pipeline[2] = pipeline[1];
-			pipeline[1] = pipeline[0];
-			pipeline[0] = new ARMInstruction(PC, memory->get32(PC));
-			PC += 4;
-		}		
+			pipeline_head = (pipeline_head + 1) % 3;
+			pipeline_size--;
+		}
+	}
+}
 
+u32 Cpu::step()
+{
+	bool thumb = instruction_state == InstructionState::Thumb;
+	flush_pipeline();
+	const DecodedInstruction& instr = fetch_decoded(thumb);
+	// a store over code retires the decoded block
+	u32 address = instr.address;
+	u32 cycles = instr.cycles;
+	u32 size = thumb ? ThumbInstruction::size(instr) : 4;
+	if (trace) *trace << (thumb ? ThumbInstruction::to_string(instr) : ARMInstruction::to_string(instr)) << '\n';
+
+	branched = false;
+	if (thumb)
+	{
+		PC = address + 4;
+		ThumbInterpreter::execute(this, instr);
 	}
 	else
 	{
+		PC = address + 8;
+		ARMInterpreter::execute(this, instr);
+	}
+	if (!branched)
+		PC = address + size;
+	return cycles + take_pending_cycles();
+}
+
+u32 Cpu::run_slice(u32 budget, bool first)
+{
+	if (breakpoints.empty() && trace == nullptr)
+		return run_blocks(budget);
+
+	u32 executed = 0;
+	while (executed < budget && !halted)
+	{
+		if ((!first || executed > 0) && std::find(breakpoints.begin(), breakpoints.end(), PC) != breakpoints.end())
+		{
+			stop_reason = StopReason::Breakpoint;
+			break;
+		}
+		u32 count = step();
+		if (count == 0) break;
+		executed += count;
+	}
+	return executed;
+}
+
+u64 Cpu::run(u64 cycles)
+{
+	u64 start = scheduler.now();
+	u64 end = start + cycles;
+	stop_reason = StopReason::Budget;
+	while (scheduler.now() < end)
+	{
+		// run freely up to whichever comes first, the end of the budget or the next event
+		u64 deadline = scheduler.next_deadline();
+		if (deadline > end) deadline = end;
+		if (halted)
+			sleep(end);
+		else if (deadline > scheduler.now())
+		{
+			u64 left = deadline - scheduler.now();
+			u32 count = run_slice(left > 0x40000000 ? 0x40000000 : (u32)left, scheduler.now() == start);
+			scheduler.advance(count);
+			if (stop_reason != StopReason::Budget)
+				break;
+			if (count == 0)
+			{
+				stop_reason = StopReason::Stalled;
+				break;
+			}
+		}
+		scheduler.dispatch();
+	}
+	return scheduler.now() - start;
+}
+
+void Cpu::sleep(u64 end)
+{
+	u64 deadline = scheduler.next_deadline();
+	if (deadline > end) deadline = end;
+	if (deadline > scheduler.now())
+	{
+		idle_cycles += deadline - scheduler.now();
+		scheduler.advance(deadline - scheduler.now());
+	}
+	if (scheduler.now() >= scheduler.next_deadline())
+		halted = false;
+}
+
+void Cpu::add_breakpoint(u32 address)
+{
+	if (std::find(breakpoints.begin(), breakpoints.end(), address) == breakpoints.end())
+		breakpoints.push_back(address);
+}
+
+void Cpu::remove_breakpoint(u32 address)
+{
+	breakpoints.erase(std::remove(breakpoints.begin(), breakpoints.end(), address), breakpoints.end());
+}
+
+u32 Cpu::run_block()
+{
+	bool thumb = instruction_state == InstructionState::Thumb;
+	flush_pipeline();
+	if (!thumb && jit)
+		return jit->run(1) + take_pending_cycles();
+	if (!thumb && ir_interpreter)
+		return ir_interpreter->run(1);
+
+	// loops usually branch back to the block that just ran
+	if (fetch_block == nullptr || fetch_generation != block_cache.get_generation()
+		|| fetch_block->address != PC || fetch_block->thumb != thumb)
+	{
+		fetch_block = block_cache.lookup(PC, thumb);
+		fetch_generation = block_cache.get_generation();
+	}
+	fetch_index = 0;
+	if (thumb)
+		ThumbInterpreter::execute_block(this, fetch_block->instructions.data(), (u32)fetch_block->instructions.size());
+	else
+		ARMInterpreter::execute_block(this, fetch_block->instructions.data(), (u32)fetch_block->instructions.size());
+	// an idle loop that went round once keeps going round until an event
+	if (fetch_generation == block_cache.get_generation() && fetch_block->idle && PC == fetch_block->address)
+		halted = true;
+	return take_pending_cycles();
+}
+
+u32 Cpu::run_blocks(u32 budget)
+{
+	u32 executed = 0;
+	while (executed < budget && !halted)
+	{
+		// the JIT and the IR interpreter run ARM code until it leaves ARM state
+		u32 count;
+		if (instruction_state == InstructionState::ARM && jit)
+		{
+			flush_pipeline();
+			count = jit->run(budget - executed) + take_pending_cycles();
+		}
+		else if (instruction_state == InstructionState::ARM && ir_interpreter)
+		{
+			flush_pipeline();
+			count = ir_interpreter->run(budget - executed);
+		}
+		else
+			count = run_block();
+		if (count == 0) break;
+		executed += count;
+	}
+	return executed;
+}
+
+bool Cpu::set_execution_mode(ExecutionMode mode)
+{
+	if (mode == ExecutionMode::Interpreter || mode == ExecutionMode::Optimized)
+		jit.reset();
+	else
+	{
+		if (!ARMJit::is_available())
+			return false;
+		if (!jit)
+			jit = std::make_unique<ARMJit>(this);
+		jit->set_lockstep(mode == ExecutionMode::JitLockstep);
+	}
+
+	if (mode != ExecutionMode::Optimized)
+		ir_interpreter.reset();
+	else if (!ir_interpreter)
+		ir_interpreter = std::make_unique<IRInterpreter>(this);
+	execution_mode = mode;
+	return true;
+}
+
+void Cpu::flush_pipeline()
+{
+	pipeline_size = 0;
+	branched = true;
+}
+
+const u8 Cpu::MODE_BANK[32] =
+{
+	BANK_USR, BANK_USR, BANK_USR, BANK_USR, BANK_USR, BANK_USR, BANK_USR, BANK_USR,
+	BANK_USR, BANK_USR, BANK_USR, BANK_USR, BANK_USR, BANK_USR, BANK_USR, BANK_USR,
+	BANK_USR, BANK_FIQ, BANK_IRQ, BANK_SVC, BANK_USR, BANK_USR, BANK_USR, BANK_ABT, // 0x10-0x17
+	BANK_USR, BANK_USR, BANK_USR, BANK_UND, BANK_USR, BANK_USR, BANK_USR, BANK_USR, // 0x18-0x1F
+};
+
+void Cpu::switch_mode(u32 mode)
+{
+	u8 new_bank = MODE_BANK[mode & 0x1F];
+	CPSR = (CPSR & ~0x1F) | mode;
+	if (new_bank == bank)
+		return;
+
+	banked_R13_R14[bank][0] = R[13];
+	banked_R13_R14[bank][1] = R[14];
+	R[13] = banked_R13_R14[new_bank][0];
+	R[14] = banked_R13_R14[new_bank][1];
+
+	bool was_fiq = bank == BANK_FIQ;
+	if (was_fiq != (new_bank == BANK_FIQ))
+	{
+		for (int i = 0; i < 5; i++) banked_R8_R12[was_fiq][i] = R[8 + i];
+		for (int i = 0; i < 5; i++) R[8 + i] = banked_R8_R12[!was_fiq][i];
+	}
+
+	bank = new_bank;
+}
+
+void Cpu::set_CPSR(u32 value)
+{
+	switch_mode(value & 0x1F);
+	CPSR = value;
+	lazy_flags.op = FlagOp::None;
+	instruction_state = (value & FLAG_T) ? InstructionState::Thumb : InstructionState::ARM;
+}
+
+void Cpu::enter_exception(u32 mode, u32 vector, u32 return_address)
+{
+	resolve_flags();
+	u32 old_CPSR = CPSR;
+	switch_mode(mode);
+	*current_SPSR() = old_CPSR;
+	R[14] = return_address;
+	CPSR = (CPSR & ~FLAG_T) | FLAG_I | (mode == MODE_FIQ ? FLAG_F : 0);
+	instruction_state = InstructionState::ARM;
+	branch_to(vector);
+}
+
+u32 Cpu::evaluate_flags() const
+{
+	u32 a = lazy_flags.a, b = lazy_flags.b, carry = lazy_flags.carry;
+	u32 flags = (lazy_flags.result & FLAG_N) | (lazy_flags.result == 0 ? FLAG_Z : 0);
+	u32 scratch;
+	bool C, V;
+	switch (lazy_flags.op)
+	{
+	case FlagOp::Logical:
+		return flags | (carry << 29) | (CPSR & FLAG_V);
+	case FlagOp::Add:
+		C = add_carry(a, b, scratch);
+		V = add_overflow(a, b);
+		break;
+	case FlagOp::Sub:
+		C = !sub_borrow(a, b, scratch);
+		V = sub_overflow(a, b);
+		break;
+	case FlagOp::Adc:
+	{
+		u32 sum;
+		C = add_carry(a, b, sum) | add_carry(sum, carry, scratch);
+		V = add_overflow(a, b) ^ add_overflow(sum, carry);
+		break;
+	}
+	case FlagOp::Sbc:
+	{
+		// the inverted carry is subtracted as a second step
+		u32 difference;
+		C = !(sub_borrow(a, b, difference) | sub_borrow(difference, 1 - carry, scratch));
+		V = sub_overflow(a, b) ^ sub_overflow(difference, 1 - carry);
+		break;
+	}
+	default:
+		return CPSR & 0xF0000000;
+	}
+	return flags | (C ? FLAG_C : 0) | (V ? FLAG_V : 0);
+}
+
+static constexpr bool condition_holds(u8 cond, u8 nzcv)
+{
+	bool N = (nzcv & 0x8) != 0;
+	bool Z = (nzcv & 0x4) != 0;
+	bool C = (nzcv & 0x2) != 0;
+	bool V = (nzcv & 0x1) != 0;
+	switch (cond)
+	{
+	case 0x0: return Z;              // EQ
+	case 0x1: return !Z;             // NE
+	case 0x2: return C;              // HS
+	case 0x3: return !C;             // LO
+	case 0x4: return N;              // MI
+	case 0x5: return !N;             // PL
+	case 0x6: return V;              // VS
+	case 0x7: return !V;             // VC
+	case 0x8: return C && !Z;        // HI
+	case 0x9: return !C || Z;        // LS
+	case 0xA: return N == V;         // GE
+	case 0xB: return N != V;         // LT
+	case 0xC: return !Z && N == V;   // GT
+	case 0xD: return Z || N != V;    // LE
+	case 0xE: return true;           // always
+	default: return false;           // NV
+	}
+}
+
+static constexpr u16 condition_mask(u8 cond)
+{
+	u16 mask = 0;
+	for (u8 nzcv = 0; nzcv < 16; nzcv++)
+	{
+		if (condition_holds(cond, nzcv))
+			mask |= (u16)(1 << nzcv);
+	}
+	return mask;
+}
+
+const u16 Cpu::CONDITION_TABLE[16] =
+{
+	condition_mask(0x0), condition_mask(0x1), condition_mask(0x2), condition_mask(0x3),
+	condition_mask(0x4), condition_mask(0x5), condition_mask(0x6), condition_mask(0x7),
+	condition_mask(0x8), condition_mask(0x9), condition_mask(0xA), condition_mask(0xB),
+	condition_mask(0xC), condition_mask(0xD), condition_mask(0xE), condition_mask(0xF),
+};
 
-	}	
-}
\ No newline at end of file
+static_assert(condition_mask(0x0) == 0xF0F0 && condition_mask(0xE) == 0xFFFF && condition_mask(0xF) == 0, "Condition table layout");
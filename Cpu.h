@@ -1,9 +1,15 @@
 #pragma once
 #include "Memory.h"
-#include "Instruction.h"
+#include "DecodedInstruction.h"
+#include "BlockCache.h"
+#include "Scheduler.h"
+#include "Dma.h"
 #include <iostream>
+#include <memory>
+#include <vector>
 
-class Instruction;
+class ARMJit;
+class IRInterpreter;
 
 class Cpu
 {
@@ -13,32 +19,439 @@ public:
 		Thumb = 0,
 		ARM = 1
 	};
+
+	enum class ExecutionMode
+	{
+		Interpreter,
+		/// <summary>
+		/// ARM blocks run as native code where ARMJit::is_available()
+		/// </summary>
+		Jit,
+		/// <summary>
+		/// Jit, checking every block against the interpreter
+		/// </summary>
+		JitLockstep,
+		/// <summary>
+		/// ARM blocks go through IROptimizer and run on IRInterpreter
+		/// </summary>
+		Optimized
+	};
+
+	/// <summary>
+	/// Why the last run / run_until call returned
+	/// </summary>
+	enum class StopReason
+	{
+		/// <summary>
+		/// The cycle budget ran out
+		/// </summary>
+		Budget,
+		/// <summary>
+		/// The run_until predicate held
+		/// </summary>
+		Predicate,
+		/// <summary>
+		/// PC reached a breakpoint, which has not executed yet
+		/// </summary>
+		Breakpoint,
+		/// <summary>
+		/// Nothing could execute
+		/// </summary>
+		Stalled
+	};
+
+	// CPSR mode bits
+	static const u32 MODE_USR = 0x10;
+	static const u32 MODE_FIQ = 0x11;
+	static const u32 MODE_IRQ = 0x12;
+	static const u32 MODE_SVC = 0x13;
+	static const u32 MODE_ABT = 0x17;
+	static const u32 MODE_UND = 0x1B;
+	static const u32 MODE_SYS = 0x1F;
+
+	// CPSR flag bits
+	static const u32 FLAG_N = 1u << 31;
+	static const u32 FLAG_Z = 1u << 30;
+	static const u32 FLAG_C = 1u << 29;
+	static const u32 FLAG_V = 1u << 28;
+	static const u32 FLAG_I = 1u << 7;
+	static const u32 FLAG_F = 1u << 6;
+	static const u32 FLAG_T = 1u << 5;
+
+	/// <summary>
+	/// ALU operation behind the pending NZCV flags
+	/// </summary>
+	enum class FlagOp : u8
+	{
+		None,
+		/// <summary>
+		/// N, Z from result, C = carry, V unchanged
+		/// </summary>
+		Logical,
+		Add,
+		Sub,
+		Adc,
+		Sbc
+	};
 private:
-	Memory* memory;
+	friend class ARMInterpreter;
+	friend class ThumbInterpreter;
+	friend class ARMJit;
+	friend class IRInterpreter;
+	friend class HLEBios;
+	friend class Dma;
 
-	// registers
-	u32 R[16];
-	u32 R_fiq[7]; // 8+index
-	u32 R_svc[2]; // 13,14
-	u32 R_abt[2]; // 13,14
-	u32 R_irq[2]; // 13,14
-	u32 R_und[2]; // 13,14
+	// register banks; User and System share BANK_USR
+	static const u8 BANK_USR = 0;
+	static const u8 BANK_FIQ = 1;
+	static const u8 BANK_IRQ = 2;
+	static const u8 BANK_SVC = 3;
+	static const u8 BANK_ABT = 4;
+	static const u8 BANK_UND = 5;
+	static const u8 BANK_COUNT = 6;
 
+	/// <summary>
+	/// Bank index of each CPSR mode value, reserved modes fall back to BANK_USR
+	/// </summary>
+	static const u8 MODE_BANK[32];
+
+	// the registers the current mode sees, kept together at the front of Cpu
+	u32 R[16];
 	u32 CPSR;
-	u32 SPSR_fiq;
-	u32 SPSR_svc;
-	u32 SPSR_abt;
-	u32 SPSR_irq;
-	u32 SPSR_und;
+
+	/// <summary>
+	/// Last flag-setting ALU operation. The NZCV bits of CPSR are stale while op is not None
+	/// and only get computed when something reads them.
+	/// </summary>
+	struct
+	{
+		FlagOp op;
+		u32 result;
+		u32 a, b;
+		u32 carry;
+	} lazy_flags = { FlagOp::None, 0, 0, 0, 0 };
+
+	/// <summary>
+	/// Bank of the current mode, always MODE_BANK[CPSR & 0x1F]
+	/// </summary>
+	u8 bank = BANK_SVC;
+
+	// banked out registers, indexed by bank
+	u32 banked_R13_R14[BANK_COUNT][2];
+	u32 banked_R8_R12[2][5]; // [0] shared by all modes but FIQ, [1] FIQ
+	u32 SPSR[BANK_COUNT]; // SPSR[BANK_USR] is never used
+
+	Memory* memory;
 
 	u32& PC = R[15];
 	InstructionState instruction_state = InstructionState::ARM;
 
-	Instruction* pipeline[3] = { nullptr, nullptr, nullptr };
+	/// <summary>
+	/// Set by flush_pipeline, tells the block interpreter to stop at the current instruction
+	/// </summary>
+	bool branched = false;
+
+	/// <summary>
+	/// SWI runs the HLEBios version of the BIOS calls it knows instead of entering the BIOS
+	/// </summary>
+	bool hle_bios = false;
+
+	/// <summary>
+	/// Cycles charged since the run functions last collected them: data accesses, multiplier steps,
+	/// pipeline refills, and the fetch / internal cycles of interpreted blocks
+	/// </summary>
+	u32 pending_cycles = 0;
+
+	inline u32 take_pending_cycles()
+	{
+		u32 cycles = pending_cycles;
+		pending_cycles = 0;
+		return cycles;
+	}
+
+	/// <summary>
+	/// Nothing runs before the next scheduler event: HALTCNT was written, or an idle loop branched
+	/// back to its start. Any event wakes the CPU, as the interrupt it may raise would.
+	/// </summary>
+	bool halted = false;
+	u64 idle_cycles = 0;
+
+	/// <summary>
+	/// Takes a HALTCNT write made by the instruction running now; the CPU sleeps from the next one on
+	/// </summary>
+	inline void check_halt()
+	{
+		if (!memory->take_halt_request())
+			return;
+		halted = true;
+		if (!branched)
+		{
+			PC -= instruction_state == InstructionState::ARM ? 4 : 2;
+			flush_pipeline();
+		}
+	}
+
+	/// <summary>
+	/// Skips the halted time up to the next event, or to end if that comes first,
+	/// and wakes the CPU once an event is due
+	/// </summary>
+	void sleep(u64 end);
+
+	/// <summary>
+	/// Fetch / decode / execute slots, reused in place every cycle.
+	/// pipeline[pipeline_head] is the oldest instruction.
+	/// </summary>
+	DecodedInstruction pipeline[3];
+	u8 pipeline_head = 0;
+	u8 pipeline_size = 0;
+
+	BlockCache block_cache;
+
+	ExecutionMode execution_mode = ExecutionMode::Interpreter;
+	std::unique_ptr<ARMJit> jit;
+	std::unique_ptr<IRInterpreter> ir_interpreter;
+
+	/// <summary>
+	/// Master clock and pending device events
+	/// </summary>
+	Scheduler scheduler;
+
+	/// <summary>
+	/// DMA channels, fed by the register writes Memory reports
+	/// </summary>
+	Dma dma;
+	StopReason stop_reason = StopReason::Budget;
+
+	std::vector<u32> breakpoints;
+
+	/// <summary>
+	/// Receives every executed instruction when not null; run then steps one instruction at a time
+	/// </summary>
+	std::ostream* trace = nullptr;
+
+	/// <summary>
+	/// Runs up to budget cycles in the current mode; with breakpoints or tracing on,
+	/// one at a time, stopping before a breakpoint unless it is the first instruction of the call
+	/// </summary>
+	u32 run_slice(u32 budget, bool first);
+
+	/// <summary>
+	/// Decoded block the fetch stage currently reads from
+	/// </summary>
+	const DecodedBlock* fetch_block = nullptr;
+	u32 fetch_index = 0;
+	u32 fetch_generation = 0;
+
+	inline const DecodedInstruction& fetch_decoded(bool thumb)
+	{
+		if (fetch_block == nullptr || fetch_generation != block_cache.get_generation()
+			|| fetch_index >= fetch_block->instructions.size() || fetch_block->instructions[fetch_index].address != PC)
+		{
+			fetch_block = block_cache.lookup(PC, thumb);
+			fetch_generation = block_cache.get_generation();
+			fetch_index = 0;
+		}
+		return fetch_block->instructions[fetch_index++];
+	}
+
+	/// <summary>
+	/// SPSR of the current mode, nullptr in User/System mode
+	/// </summary>
+	inline u32* current_SPSR()
+	{
+		return bank == BANK_USR ? nullptr : &SPSR[bank];
+	}
+
+	/// <summary>
+	/// Banks the registers of the current mode out and those of mode in; only the CPSR mode bits change.
+	/// Swaps R13/R14 and, entering or leaving FIQ, R8-R12, without looking at which modes are involved.
+	/// </summary>
+	void switch_mode(u32 mode);
+
+	/// <summary>
+	/// Writes CPSR, switching register banks and instruction state as needed
+	/// </summary>
+	void set_CPSR(u32 value);
+
+	/// <summary>
+	/// Enters an exception mode: saves CPSR into its SPSR, sets LR and jumps to vector in ARM state
+	/// </summary>
+	void enter_exception(u32 mode, u32 vector, u32 return_address);
+
+	/// <summary>
+	/// Bit NZCV of CONDITION_TABLE[cond] is set when cond passes with those flags
+	/// </summary>
+	static const u16 CONDITION_TABLE[16];
+
+	inline bool condition_passed(u8 cond)
+	{
+		// AL needs no flags, so it never forces the pending ones
+		if (cond == 0xE)
+			return true;
+
+		resolve_flags();
+		return (CONDITION_TABLE[cond] >> (CPSR >> 28)) & 1;
+	}
+
+	/// <summary>
+	/// NZCV bits of the pending ALU operation
+	/// </summary>
+	u32 evaluate_flags() const;
+
+	inline void resolve_flags()
+	{
+		if (lazy_flags.op != FlagOp::None)
+		{
+			CPSR = (CPSR & 0x0FFFFFFF) | evaluate_flags();
+			lazy_flags.op = FlagOp::None;
+		}
+	}
+
+	/// <summary>
+	/// Records a flag-setting operation. Logical ops keep V, so the flags must be resolved beforehand.
+	/// </summary>
+	inline void set_lazy_flags(FlagOp op, u32 result, u32 a, u32 b, u32 carry)
+	{
+		lazy_flags.op = op;
+		lazy_flags.result = result;
+		lazy_flags.a = a;
+		lazy_flags.b = b;
+		lazy_flags.carry = carry;
+	}
+
+	inline u32 get_carry()
+	{
+		resolve_flags();
+		return (CPSR >> 29) & 1;
+	}
+
+	/// <summary>
+	/// Writes R15 and flushes the pipeline, aligning target to the instruction state.
+	/// Charges the refill: one non-sequential and one sequential fetch at the target.
+	/// </summary>
+	inline void branch_to(u32 target)
+	{
+		bool arm = instruction_state == InstructionState::ARM;
+		PC = arm ? target & ~3 : target & ~1;
+		pending_cycles += memory->access_time(PC, arm, false) + memory->access_time(PC, arm, true);
+		flush_pipeline();
+	}
 public:
 	Cpu(Memory* memory);
+	Cpu(const Cpu&) = delete;
+	Cpu& operator=(const Cpu&) = delete;
 
 	void do_cycle();	
 
+	/// <summary>
+	/// Executes the single instruction at PC, bypassing the pipeline.
+	/// Returns the cycles it took.
+	/// </summary>
+	u32 step();
+
+	/// <summary>
+	/// Runs for cycles guest cycles, or up to a breakpoint. Returns the number of cycles run;
+	/// get_stop_reason tells why it returned. Blocks run back to back up to the next scheduler
+	/// deadline, where due events are dispatched. A halted CPU skips straight to that deadline.
+	/// </summary>
+	u64 run(u64 cycles);
+
+	/// <summary>
+	/// Like run, but returns as soon as stop() holds. stop is checked before every block,
+	/// so it sees the state at block boundaries (branches, and stores over code).
+	/// </summary>
+	template <class Predicate>
+	u64 run_until(Predicate stop, u64 cycles)
+	{
+		u64 start = scheduler.now();
+		u64 end = start + cycles;
+		stop_reason = StopReason::Budget;
+		while (scheduler.now() < end)
+		{
+			if (stop())
+			{
+				stop_reason = StopReason::Predicate;
+				break;
+			}
+			if (halted)
+				sleep(end);
+			else
+			{
+				u32 count = run_slice(1, scheduler.now() == start);
+				scheduler.advance(count);
+				if (count == 0 && stop_reason == StopReason::Budget)
+					stop_reason = StopReason::Stalled;
+			}
+			if (scheduler.now() >= scheduler.next_deadline())
+				scheduler.dispatch();
+			if (stop_reason != StopReason::Budget)
+				break;
+		}
+		return scheduler.now() - start;
+	}
+
+	StopReason get_stop_reason() const { return stop_reason; }
+	u64 get_cycle_count() const { return scheduler.now(); }
+	Scheduler& get_scheduler() { return scheduler; }
+
+	/// <summary>
+	/// The DMA controller, for the video and sound models to trigger HBlank, VBlank and FIFO transfers
+	/// </summary>
+	Dma& get_dma() { return dma; }
+
+	/// <summary>
+	/// Tells whether the CPU sleeps until the next event, after a HALTCNT write or in an idle loop
+	/// </summary>
+	bool is_halted() const { return halted; }
+
+	/// <summary>
+	/// Cycles skipped while halted, out of get_cycle_count()
+	/// </summary>
+	u64 get_idle_cycles() const { return idle_cycles; }
+
+	void add_breakpoint(u32 address);
+	void remove_breakpoint(u32 address);
+
+	/// <summary>
+	/// Sends a disassembly of every executed instruction to out; nullptr turns tracing off
+	/// </summary>
+	void set_trace(std::ostream* out) { trace = out; }
+
+	/// <summary>
+	/// Emulates the BIOS calls natively, for running without a BIOS image or to skip the BIOS code
+	/// </summary>
+	void set_hle_bios(bool enabled) { hle_bios = enabled; }
+	bool get_hle_bios() const { return hle_bios; }
+
+	/// <summary>
+	/// Executes the decoded block at PC in one go, bypassing the pipeline.
+	/// On return PC holds the address of the next instruction. Returns the cycles taken, 0 if nothing ran.
+	/// </summary>
+	u32 run_block();
+
+	/// <summary>
+	/// Runs whole blocks until at least budget cycles passed or a block cannot run.
+	/// Compiled ARM blocks jump into each other without returning in between; Thumb blocks are interpreted.
+	/// </summary>
+	u32 run_blocks(u32 budget);
+
+	/// <summary>
+	/// Switches between the interpreters and the JIT; returns false if the JIT is not available here
+	/// </summary>
+	bool set_execution_mode(ExecutionMode mode);
+	ExecutionMode get_execution_mode() const { return execution_mode; }
+
+	/// <summary>
+	/// Drops every fetched instruction; the next cycle refetches from PC
+	/// </summary>
+	void flush_pipeline();
+
+	u32 get_register(u8 index) const { return R[index]; }
+	void set_register(u8 index, u32 value) { R[index] = value; if (index == 15) flush_pipeline(); }
+	u32 get_CPSR() const { return lazy_flags.op == FlagOp::None ? CPSR : (CPSR & 0x0FFFFFFF) | evaluate_flags(); }
+	InstructionState get_instruction_state() const { return instruction_state; }
+
+	~Cpu();
+
 };
 
@@ -0,0 +1,48 @@
+#pragma once
+#include "Types.h"
+
+/// <summary>
+/// Fixed-layout decoded form of an ARM or Thumb instruction. It is filled in place by the decoders,
+/// so decoding costs no allocations and execution reads the fields with plain loads.
+/// Field names follow the ARM_INSTR_TYPES field names.
+/// </summary>
+struct alignas(64) DecodedInstruction
+{
+	u32 address;
+	u32 opcode;
+
+	/// <summary>
+	/// Immediate operand, SWI comment
+	/// </summary>
+	u32 Immediate;
+	/// <summary>
+	/// Branch / transfer offset
+	/// </summary>
+	u32 Offset;
+	u16 RegList;
+
+	/// <summary>
+	/// ARMInstruction::Type or ThumbInstruction::InstructionType, depending on thumb
+	/// </summary>
+	u8 type;
+	u8 thumb;
+
+	/// <summary>
+	/// Code fetch and internal cycles, set by BlockCache. Data accesses, multiplier steps and
+	/// pipeline refills depend on run time values and are charged as they happen.
+	/// </summary>
+	u8 cycles;
+
+	u8 Cond;
+	u8 Op;
+	u8 S;
+	u8 Rn, Rd, Rs, Rm;
+	u8 RdHi, RdLo;
+	u8 Shift, Typ;
+	u8 P, U, B, W, L, A, H, N;
+	u8 Field;
+	u8 OffsetH, OffsetL;
+	u8 CRn, CRd, CRm, CPn, CPopc, CP;
+};
+
+static_assert(sizeof(DecodedInstruction) == 64, "DecodedInstruction must fit a cache line");
@@ -0,0 +1,174 @@
+#include "Dma.h"
+#include "Cpu.h"
+
+#include <string.h>
+
+// internal address bus widths: DMA0 only reaches the internal memory, DMA3 is the only one writing to the Game Pak
+static const u32 SOURCE_MASK[Dma::CHANNEL_COUNT] = { 0x07FFFFFF, 0x0FFFFFFF, 0x0FFFFFFF, 0x0FFFFFFF };
+static const u32 DEST_MASK[Dma::CHANNEL_COUNT] = { 0x07FFFFFF, 0x07FFFFFF, 0x07FFFFFF, 0x0FFFFFFF };
+
+// word count field width; 0 stands for the maximum
+static const u32 COUNT_MAX[Dma::CHANNEL_COUNT] = { 0x4000, 0x4000, 0x4000, 0x10000 };
+
+// IO registers have side effects per access width: transfers touching them go unit by unit
+static inline bool touches_io(u32 offset, u32 size)
+{
+	return (offset >> 24) == 0x4 || ((offset + size - 1) >> 24) == 0x4;
+}
+
+Dma::Dma(Cpu* cpu) : cpu{ cpu }
+{
+	for (u32 i = 0; i < CHANNEL_COUNT; i++)
+		channels[i] = { 0, 0, 0, false };
+	cpu->scheduler.set_handler(Scheduler::Event::DMA, run_pending, this);
+}
+
+u16 Dma::get_control(u32 index) const
+{
+	u16 value;
+	memcpy(&value, cpu->memory->buff_IO + (REGISTERS_OFFSET - Memory::IO_OFFSET) + index * CHANNEL_SIZE + 10, 2);
+	return value;
+}
+
+void Dma::set_control(u32 index, u16 value)
+{
+	// straight to the register, a write through Memory would come back to register_written
+	memcpy(cpu->memory->buff_IO + (REGISTERS_OFFSET - Memory::IO_OFFSET) + index * CHANNEL_SIZE + 10, &value, 2);
+}
+
+void Dma::reload(u32 index, bool dest)
+{
+	const Memory& memory = *cpu->memory;
+	u32 registers = REGISTERS_OFFSET + index * CHANNEL_SIZE;
+	Channel& channel = channels[index];
+	channel.count = memory.get16(registers + 8) & (COUNT_MAX[index] - 1);
+	if (channel.count == 0) channel.count = COUNT_MAX[index];
+	if (dest) channel.dest = memory.get32(registers + 4) & DEST_MASK[index];
+}
+
+void Dma::register_written(u32 offset)
+{
+	// only the upper byte of CNT_H holds the enable bit
+	u32 relative_offset = offset - REGISTERS_OFFSET;
+	if (relative_offset % CHANNEL_SIZE != CHANNEL_SIZE - 1)
+		return;
+
+	u32 index = relative_offset / CHANNEL_SIZE;
+	Channel& channel = channels[index];
+	u16 control = get_control(index);
+	if (!(control & CNT_ENABLE))
+	{
+		channel.enabled = false;
+		return;
+	}
+	if (channel.enabled)
+		return;
+
+	channel.enabled = true;
+	channel.source = cpu->memory->get32(REGISTERS_OFFSET + index * CHANNEL_SIZE) & SOURCE_MASK[index];
+	reload(index, true);
+	if ((Timing)((control & CNT_TIMING) >> 12) == Timing::Immediate)
+		transfer(index);
+}
+
+void Dma::trigger(Timing timing)
+{
+	for (u32 index = 0; index < CHANNEL_COUNT; index++)
+	{
+		// special timing on DMA1 and DMA2 means sound FIFO requests
+		if (timing == Timing::Special && (index == 1 || index == 2))
+			continue;
+		if (channels[index].enabled && (Timing)((get_control(index) & CNT_TIMING) >> 12) == timing)
+			request(index);
+	}
+}
+
+void Dma::request_fifo(u32 fifo_offset)
+{
+	for (u32 index = 1; index <= 2; index++)
+	{
+		if (channels[index].enabled && (Timing)((get_control(index) & CNT_TIMING) >> 12) == Timing::Special
+			&& channels[index].dest == fifo_offset)
+			request(index);
+	}
+}
+
+void Dma::request(u32 index)
+{
+	pending |= (u8)(1 << index);
+	// the requests come from scheduler handlers and stores; transfers wait for the next block boundary
+	if (!cpu->scheduler.is_scheduled(Scheduler::Event::DMA))
+		cpu->scheduler.schedule_at(Scheduler::Event::DMA, cpu->scheduler.now());
+}
+
+void Dma::run_pending(void* context, u64 late)
+{
+	Dma* dma = (Dma*)context;
+	for (u32 index = 0; index < CHANNEL_COUNT; index++)
+	{
+		u8 bit = (u8)(1 << index);
+		if (!(dma->pending & bit))
+			continue;
+		dma->pending &= ~bit;
+		// the channel may have been turned off since the request
+		if (dma->channels[index].enabled)
+			dma->transfer(index);
+	}
+}
+
+void Dma::transfer(u32 index)
+{
+	Memory* memory = cpu->memory;
+	Channel& channel = channels[index];
+	u16 control = get_control(index);
+	Timing timing = (Timing)((control & CNT_TIMING) >> 12);
+
+	// FIFO transfers send 4 words to the fixed FIFO address, whatever the count and width say
+	bool fifo = timing == Timing::Special && (index == 1 || index == 2);
+	bool word = fifo || (control & CNT_WORD);
+	u32 unit = word ? 4 : 2;
+	u32 count = fifo ? 4 : channel.count;
+	u8 dest_control = fifo ? ADDRESS_FIXED : (u8)((control & CNT_DEST_CONTROL) >> 5);
+	u8 source_control = (u8)((control & CNT_SOURCE_CONTROL) >> 7);
+	u32 source_step = source_control == ADDRESS_DECREMENT ? 0u - unit : source_control == ADDRESS_FIXED ? 0 : unit;
+	u32 dest_step = dest_control == ADDRESS_DECREMENT ? 0u - unit : dest_control == ADDRESS_FIXED ? 0 : unit;
+	u32 source = channel.source & ~(unit - 1);
+	u32 dest = channel.dest & ~(unit - 1);
+	u32 size = count * unit;
+
+	// first unit non-sequential, then sequential; 2 internal cycles, 4 when both ends are on the Game Pak
+	u32 cycles = memory->access_time(source, word, false) + memory->access_time(dest, word, false)
+		+ (count - 1) * (memory->access_time(source, word, true) + memory->access_time(dest, word, true))
+		+ ((source >> 24) >= 0x8 && (dest >> 24) >= 0x8 ? 4 : 2);
+
+	if (source_step == unit && dest_step == unit && !touches_io(source, size) && !touches_io(dest, size)
+		&& !memory->overlaps_forward(source, dest, size))
+	{
+		// both counting up through plain memory, no forward overlap even through mirrors: one bulk copy
+		memory->copy(source, dest, size);
+		source += size;
+		dest += size;
+	}
+	else
+	{
+		for (u32 i = 0; i < count; i++, source += source_step, dest += dest_step)
+		{
+			if (word) memory->set32(dest, memory->get32(source));
+			else memory->set16(dest, memory->get16(source));
+		}
+	}
+	channel.source = source & SOURCE_MASK[index];
+	channel.dest = dest & DEST_MASK[index];
+
+	if (control & CNT_IRQ)
+		cpu->memory->buff_IO[IF_OFFSET - Memory::IO_OFFSET + 1] |= (u8)(1 << index);
+
+	if ((control & CNT_REPEAT) && timing != Timing::Immediate)
+		reload(index, dest_control == ADDRESS_RELOAD);
+	else
+	{
+		channel.enabled = false;
+		set_control(index, control & ~CNT_ENABLE);
+	}
+	cpu->pending_cycles += cycles;
+}
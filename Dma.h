@@ -0,0 +1,125 @@
+#pragma once
+#include "Types.h"
+
+class Cpu;
+
+/// <summary>
+/// The four DMA channels. Their registers live in the IO area; Memory reports the writes,
+/// and a channel starts when its enable bit goes from 0 to 1. Immediate transfers run inside
+/// the store that enables them, the CPU stalling for their cycles. The other start timings wait for trigger
+/// or request_fifo, which queue the channels on the scheduler's DMA event: they run between blocks.
+/// Transfers between plain memory with both addresses counting up move in one Memory::copy.
+/// </summary>
+class Dma
+{
+	friend class ARMJit;
+public:
+	enum class Timing : u8
+	{
+		Immediate,
+		VBlank,
+		HBlank,
+		/// <summary>
+		/// Sound FIFO requests on DMA1 and DMA2, video capture on DMA3
+		/// </summary>
+		Special
+	};
+
+	static const u32 CHANNEL_COUNT = 4;
+
+	/// <summary>
+	/// DMA0SAD; each channel has SAD, DAD, CNT_L and CNT_H, 12 bytes in all
+	/// </summary>
+	static const u32 REGISTERS_OFFSET = (u32)0x040000B0;
+	static const u32 CHANNEL_SIZE = 12;
+	static const u32 REGISTERS_SIZE = CHANNEL_COUNT * CHANNEL_SIZE;
+
+	/// <summary>
+	/// Interrupt request flags; a channel with the IRQ bit set raises bit 8 + channel when it finishes
+	/// </summary>
+	static const u32 IF_OFFSET = (u32)0x04000202;
+
+	static const u32 FIFO_A_OFFSET = (u32)0x040000A0;
+	static const u32 FIFO_B_OFFSET = (u32)0x040000A4;
+
+private:
+	// CNT_H bits
+	static const u16 CNT_DEST_CONTROL = 3 << 5;
+	static const u16 CNT_SOURCE_CONTROL = 3 << 7;
+	static const u16 CNT_REPEAT = 1 << 9;
+	static const u16 CNT_WORD = 1 << 10;
+	static const u16 CNT_TIMING = 3 << 12;
+	static const u16 CNT_IRQ = 1 << 14;
+	static const u16 CNT_ENABLE = 1 << 15;
+
+	// address control values
+	static const u8 ADDRESS_INCREMENT = 0;
+	static const u8 ADDRESS_DECREMENT = 1;
+	static const u8 ADDRESS_FIXED = 2;
+	static const u8 ADDRESS_RELOAD = 3;
+
+	/// <summary>
+	/// Internal registers, loaded from SAD / DAD / CNT_L when the channel is enabled
+	/// </summary>
+	struct Channel
+	{
+		u32 source;
+		u32 dest;
+		u32 count;
+		bool enabled;
+	};
+
+	Cpu* cpu;
+	Channel channels[CHANNEL_COUNT];
+
+	/// <summary>
+	/// Channels whose start timing came, one bit each, waiting for the DMA event
+	/// </summary>
+	u8 pending = 0;
+
+	u16 get_control(u32 index) const;
+	void set_control(u32 index, u16 value);
+
+	/// <summary>
+	/// Reloads the word count, and the destination with address control 3, for a repeating channel
+	/// </summary>
+	void reload(u32 index, bool dest);
+
+	/// <summary>
+	/// Runs the whole transfer of a channel and charges its cycles to the CPU
+	/// </summary>
+	void transfer(u32 index);
+
+	/// <summary>
+	/// Queues a channel and schedules the DMA event at the current cycle
+	/// </summary>
+	void request(u32 index);
+
+	/// <summary>
+	/// Scheduler handler of the DMA event: runs the queued channels, DMA0 first
+	/// </summary>
+	static void run_pending(void* context, u64 late);
+
+public:
+	Dma(Cpu* cpu);
+	Dma(const Dma&) = delete;
+	Dma& operator=(const Dma&) = delete;
+
+	/// <summary>
+	/// Called by Memory after a byte of the DMA registers changed
+	/// </summary>
+	void register_written(u32 offset);
+
+	/// <summary>
+	/// Starts the enabled channels waiting for timing at the next DMA event. The video model calls it at
+	/// HBlank / VBlank from its scheduler handlers; FIFO requests go through request_fifo.
+	/// </summary>
+	void trigger(Timing timing);
+
+	/// <summary>
+	/// A sound FIFO (FIFO_A_OFFSET or FIFO_B_OFFSET) runs low: the special-timing DMA1 or DMA2 feeding it sends 4 words
+	/// </summary>
+	void request_fifo(u32 fifo_offset);
+
+	bool is_enabled(u32 index) const { return channels[index].enabled; }
+};
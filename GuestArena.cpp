@@ -0,0 +1,80 @@
+#include "GuestArena.h"
+
+#include <cstdint>
+#include <new>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+GuestArena::GuestArena(u64 size, bool huge_pages) : size(size)
+{
+	if (huge_pages)
+	{
+		// large pages are committed up front and need SeLockMemoryPrivilege
+		SIZE_T large_page = GetLargePageMinimum();
+		if (large_page > 0)
+		{
+			reserved_size = (size + large_page - 1) & ~(u64)(large_page - 1);
+			data = (u8*)VirtualAlloc(nullptr, (SIZE_T)reserved_size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			this->huge_pages = data != nullptr;
+		}
+	}
+	if (data == nullptr)
+	{
+		// committed pages get their physical memory on first touch
+		reserved_size = size;
+		data = (u8*)VirtualAlloc(nullptr, (SIZE_T)size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	}
+	if (data == nullptr)
+		throw std::bad_alloc();
+}
+
+GuestArena::~GuestArena()
+{
+	VirtualFree(data, 0, MEM_RELEASE);
+}
+
+#else
+#include <sys/mman.h>
+
+GuestArena::GuestArena(u64 size, bool huge_pages) : size(size)
+{
+	if (huge_pages)
+	{
+		// over-reserve, then trim so that the block starts on a huge page boundary
+		u64 aligned_size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		void* block = mmap(nullptr, (size_t)(aligned_size + HUGE_PAGE_SIZE), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (block != MAP_FAILED)
+		{
+			uintptr_t start = ((uintptr_t)block + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+			uintptr_t end = start + (uintptr_t)aligned_size;
+			uintptr_t block_end = (uintptr_t)block + (uintptr_t)(aligned_size + HUGE_PAGE_SIZE);
+			if (start > (uintptr_t)block) munmap(block, (size_t)(start - (uintptr_t)block));
+			if (block_end > end) munmap((void*)end, (size_t)(block_end - end));
+			data = (u8*)start;
+			reserved_size = aligned_size;
+#ifdef MADV_HUGEPAGE
+			this->huge_pages = madvise(data, (size_t)reserved_size, MADV_HUGEPAGE) == 0;
+#endif
+		}
+	}
+	if (data == nullptr)
+	{
+		// anonymous pages are zero-filled and backed on first touch
+		reserved_size = size;
+		void* block = mmap(nullptr, (size_t)size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (block != MAP_FAILED)
+			data = (u8*)block;
+	}
+	if (data == nullptr)
+		throw std::bad_alloc();
+}
+
+GuestArena::~GuestArena()
+{
+	munmap(data, (size_t)reserved_size);
+}
+
+#endif
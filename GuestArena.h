@@ -0,0 +1,36 @@
+#pragma once
+#include "Types.h"
+
+/// <summary>
+/// One zero-filled block of host virtual memory holding every writable guest region.
+/// Pages are only backed by physical memory once they are first touched.
+/// </summary>
+class GuestArena
+{
+private:
+	u8* data = nullptr;
+	u64 size = 0;
+	u64 reserved_size = 0;
+	bool huge_pages = false;
+public:
+	static const u64 HUGE_PAGE_SIZE = 0x200000;
+
+	/// <summary>
+	/// Reserves size bytes; with huge_pages the block is 2MB aligned and, where the
+	/// host allows it, backed by huge pages (falls back to regular pages silently)
+	/// </summary>
+	GuestArena(u64 size, bool huge_pages = false);
+
+	GuestArena(const GuestArena&) = delete;
+	GuestArena& operator=(const GuestArena&) = delete;
+
+	u8* get_data() const { return data; }
+	u64 get_size() const { return size; }
+
+	/// <summary>
+	/// Tells whether the block actually got huge pages
+	/// </summary>
+	bool has_huge_pages() const { return huge_pages; }
+
+	~GuestArena();
+};
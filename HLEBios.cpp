@@ -0,0 +1,434 @@
+#include "HLEBios.h"
+
+#include <cmath>
+#include <cstdint>
+#include <string.h>
+
+// BIOS call numbers
+static const u8 SWI_DIV = 0x06;
+static const u8 SWI_DIV_ARM = 0x07;
+static const u8 SWI_SQRT = 0x08;
+static const u8 SWI_ARC_TAN = 0x09;
+static const u8 SWI_CPU_SET = 0x0B;
+static const u8 SWI_CPU_FAST_SET = 0x0C;
+static const u8 SWI_BG_AFFINE_SET = 0x0E;
+static const u8 SWI_OBJ_AFFINE_SET = 0x0F;
+static const u8 SWI_LZ77_UNCOMP_WRAM = 0x11;
+static const u8 SWI_LZ77_UNCOMP_VRAM = 0x12;
+static const u8 SWI_HUFF_UNCOMP = 0x13;
+static const u8 SWI_RL_UNCOMP_WRAM = 0x14;
+static const u8 SWI_RL_UNCOMP_VRAM = 0x15;
+
+// Stack tops the BIOS boot code sets up
+static const u32 STACK_SVC = 0x03007FE0;
+static const u32 STACK_IRQ = 0x03007FA0;
+static const u32 STACK_SYS = 0x03007F00;
+static const u32 GAME_PAK_ENTRY = 0x08000000;
+
+// IO registers have write side effects that bulk writes would skip
+static inline bool is_io(u32 address) { return (address >> 24) == 0x4; }
+
+/// <summary>
+/// The 256-step sine table of the BIOS, 1.14 fixed point, truncated like the BIOS values
+/// </summary>
+class SineTable
+{
+private:
+	s16 entries[256];
+public:
+	SineTable()
+	{
+		const double pi = 3.14159265358979323846;
+		for (int i = 0; i < 256; i++)
+			entries[i] = (s16)(std::sin(i * pi / 128) * 0x4000);
+	}
+
+	inline s32 sin(u32 step) const { return entries[step & 0xFF]; }
+	inline s32 cos(u32 step) const { return entries[(step + 64) & 0xFF]; }
+};
+
+static const SineTable& sine_table()
+{
+	static const SineTable table;
+	return table;
+}
+
+bool HLEBios::call(Cpu* cpu, u8 number)
+{
+	switch (number)
+	{
+	case SWI_DIV: div(cpu, (s32)cpu->R[0], (s32)cpu->R[1]); break;
+	case SWI_DIV_ARM: div(cpu, (s32)cpu->R[1], (s32)cpu->R[0]); break;
+	case SWI_SQRT: sqrt(cpu); break;
+	case SWI_ARC_TAN: arc_tan(cpu); break;
+	case SWI_CPU_SET: cpu_set(cpu); break;
+	case SWI_CPU_FAST_SET: cpu_fast_set(cpu); break;
+	case SWI_BG_AFFINE_SET: bg_affine_set(cpu); break;
+	case SWI_OBJ_AFFINE_SET: obj_affine_set(cpu); break;
+	case SWI_LZ77_UNCOMP_WRAM: lz77_uncomp(cpu, false); break;
+	case SWI_LZ77_UNCOMP_VRAM: lz77_uncomp(cpu, true); break;
+	case SWI_HUFF_UNCOMP: huff_uncomp(cpu); break;
+	case SWI_RL_UNCOMP_WRAM: rl_uncomp(cpu, false); break;
+	case SWI_RL_UNCOMP_VRAM: rl_uncomp(cpu, true); break;
+	default: return false;
+	}
+	return true;
+}
+
+void HLEBios::boot(Cpu* cpu)
+{
+	cpu->set_CPSR(Cpu::MODE_SVC | Cpu::FLAG_I | Cpu::FLAG_F);
+	cpu->R[13] = STACK_SVC;
+	cpu->R[14] = 0;
+	cpu->set_CPSR(Cpu::MODE_IRQ | Cpu::FLAG_I | Cpu::FLAG_F);
+	cpu->R[13] = STACK_IRQ;
+	cpu->R[14] = 0;
+	cpu->set_CPSR(Cpu::MODE_SYS);
+	for (int i = 0; i < 13; i++) cpu->R[i] = 0;
+	cpu->R[13] = STACK_SYS;
+	cpu->R[14] = 0;
+	cpu->set_register(15, GAME_PAK_ENTRY);
+}
+
+void HLEBios::div(Cpu* cpu, s32 numerator, s32 denominator)
+{
+	s32 quotient, remainder;
+	if (denominator == 0)
+	{
+		// the BIOS never returns from a division by zero: hand back the sign and the numerator
+		quotient = numerator < 0 ? -1 : 1;
+		remainder = numerator;
+	}
+	else if (denominator == -1 && numerator == INT32_MIN)
+	{
+		quotient = INT32_MIN;
+		remainder = 0;
+	}
+	else
+	{
+		quotient = numerator / denominator;
+		remainder = numerator % denominator;
+	}
+	cpu->R[0] = (u32)quotient;
+	cpu->R[1] = (u32)remainder;
+	cpu->R[3] = quotient < 0 ? 0u - (u32)quotient : (u32)quotient;
+}
+
+void HLEBios::sqrt(Cpu* cpu)
+{
+	// one result bit at a time, from the top
+	u32 value = cpu->R[0];
+	u32 root = 0;
+	for (u32 bit = 1u << 30; bit != 0; bit >>= 2)
+	{
+		if (value >= root + bit)
+		{
+			value -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else
+			root >>= 1;
+	}
+	cpu->R[0] = root;
+}
+
+void HLEBios::arc_tan(Cpu* cpu)
+{
+	// the BIOS polynomial, 1.14 fixed point in and out; R1 and R3 keep its intermediate values
+	s32 x = (s32)cpu->R[0];
+	s32 a = -((x * x) >> 14);
+	s32 b = ((0xA9 * a) >> 14) + 0x390;
+	b = ((b * a) >> 14) + 0x91C;
+	b = ((b * a) >> 14) + 0xFB6;
+	b = ((b * a) >> 14) + 0x16AA;
+	b = ((b * a) >> 14) + 0x2081;
+	b = ((b * a) >> 14) + 0x3651;
+	b = ((b * a) >> 14) + 0xA2F9;
+	cpu->R[0] = (u32)((x * b) >> 16);
+	cpu->R[1] = (u32)a;
+	cpu->R[3] = (u32)b;
+}
+
+void HLEBios::cpu_set(Cpu* cpu)
+{
+	u32 source = cpu->R[0], dest = cpu->R[1], control = cpu->R[2];
+	// the BIOS refuses to read itself
+	if ((source & 0x0E000000) == 0)
+		return;
+
+	bool word = (control >> 26) & 1;
+	u32 unit = word ? 4 : 2;
+	source &= ~(unit - 1);
+	dest &= ~(unit - 1);
+	u32 size = (control & 0x1FFFFF) * unit;
+
+	if ((control >> 24) & 1)
+	{
+		u32 value = word ? cpu->memory->get32(source) : cpu->memory->get16(source) * 0x00010001u;
+		cpu->pending_cycles += cpu->memory->access_time(source, word, false);
+		fill(cpu, dest, size, value, word);
+	}
+	else
+		copy(cpu, source, dest, size, word);
+}
+
+void HLEBios::cpu_fast_set(Cpu* cpu)
+{
+	u32 source = cpu->R[0] & ~3, dest = cpu->R[1] & ~3, control = cpu->R[2];
+	if ((source & 0x0E000000) == 0)
+		return;
+
+	// whole blocks of 8 words
+	u32 size = ((control & 0x1FFFFF) + 7) / 8 * 32;
+	if ((control >> 24) & 1)
+	{
+		cpu->pending_cycles += cpu->memory->access_time(source, true, false);
+		fill(cpu, dest, size, cpu->memory->get32(source), true);
+	}
+	else
+		copy(cpu, source, dest, size, true);
+}
+
+void HLEBios::copy(Cpu* cpu, u32 source, u32 dest, u32 size, bool word)
+{
+	if (size == 0)
+		return;
+	u32 unit = word ? 4 : 2;
+	Memory* memory = cpu->memory;
+	cpu->pending_cycles += (size / unit) * (memory->access_time(source, word, true) + memory->access_time(dest, word, true));
+
+	// the BIOS copies forward: a destination overlapping the source from above, mirrors included, sees its own writes
+	if (!is_io(dest) && !memory->overlaps_forward(source, dest, size))
+	{
+		memory->copy(source, dest, size);
+		return;
+	}
+
+	for (u32 offset = 0; offset < size; offset += unit)
+	{
+		if (word) memory->set32(dest + offset, memory->get32(source + offset));
+		else memory->set16(dest + offset, memory->get16(source + offset));
+	}
+}
+
+void HLEBios::fill(Cpu* cpu, u32 dest, u32 size, u32 value, bool word)
+{
+	if (size == 0)
+		return;
+	u32 unit = word ? 4 : 2;
+	Memory* memory = cpu->memory;
+	cpu->pending_cycles += (size / unit) * memory->access_time(dest, word, true);
+
+	if (!is_io(dest))
+	{
+		memory->fill(dest, dest + size, value);
+		return;
+	}
+
+	for (u32 offset = 0; offset < size; offset += unit)
+	{
+		if (word) memory->set32(dest + offset, value);
+		else memory->set16(dest + offset, (u16)value);
+	}
+}
+
+void HLEBios::bg_affine_set(Cpu* cpu)
+{
+	const SineTable& table = sine_table();
+	Memory* memory = cpu->memory;
+	u32 source = cpu->R[0], dest = cpu->R[1];
+	for (u32 count = cpu->R[2]; count--; source += 20, dest += 16)
+	{
+		// origin in 24.8, display center in pixels, scale in 8.8, angle in 1/65536 turns
+		s32 origin_x = (s32)memory->get32(source);
+		s32 origin_y = (s32)memory->get32(source + 4);
+		s32 center_x = (s16)memory->get16(source + 8);
+		s32 center_y = (s16)memory->get16(source + 10);
+		s32 scale_x = (s16)memory->get16(source + 12);
+		s32 scale_y = (s16)memory->get16(source + 14);
+		u32 angle = memory->get16(source + 16) >> 8;
+
+		s32 pa = (scale_x * table.cos(angle)) >> 14;
+		s32 pb = -((scale_x * table.sin(angle)) >> 14);
+		s32 pc = (scale_y * table.sin(angle)) >> 14;
+		s32 pd = (scale_y * table.cos(angle)) >> 14;
+		memory->set16(dest, (u16)pa);
+		memory->set16(dest + 2, (u16)pb);
+		memory->set16(dest + 4, (u16)pc);
+		memory->set16(dest + 6, (u16)pd);
+		memory->set32(dest + 8, (u32)(origin_x - (pa * center_x + pb * center_y)));
+		memory->set32(dest + 12, (u32)(origin_y - (pc * center_x + pd * center_y)));
+	}
+}
+
+void HLEBios::obj_affine_set(Cpu* cpu)
+{
+	const SineTable& table = sine_table();
+	Memory* memory = cpu->memory;
+	u32 source = cpu->R[0], dest = cpu->R[1];
+	// R3 is the distance between the parameters: 2 for BG registers, 8 for OAM
+	u32 stride = cpu->R[3];
+	for (u32 count = cpu->R[2]; count--; source += 8, dest += 4 * stride)
+	{
+		s32 scale_x = (s16)memory->get16(source);
+		s32 scale_y = (s16)memory->get16(source + 2);
+		u32 angle = memory->get16(source + 4) >> 8;
+
+		memory->set16(dest, (u16)((scale_x * table.cos(angle)) >> 14));
+		memory->set16(dest + stride, (u16)-((scale_x * table.sin(angle)) >> 14));
+		memory->set16(dest + 2 * stride, (u16)((scale_y * table.sin(angle)) >> 14));
+		memory->set16(dest + 3 * stride, (u16)((scale_y * table.cos(angle)) >> 14));
+	}
+}
+
+void HLEBios::lz77_uncomp(Cpu* cpu, bool vram)
+{
+	const Memory& memory = *cpu->memory;
+	u32 source = cpu->R[0], dest = cpu->R[1];
+	u32 size = memory.get32(source & ~3) >> 8;
+	std::vector<u8> output(size);
+
+	u32 input = source + 4;
+	u32 position = 0;
+	while (position < size)
+	{
+		u8 flags = memory[input++];
+		for (int block = 0; block < 8 && position < size; block++, flags <<= 1)
+		{
+			if (!(flags & 0x80))
+			{
+				output[position++] = memory[input++];
+				continue;
+			}
+
+			// 4-bit length - 3 and 12-bit displacement - 1
+			u8 high = memory[input], low = memory[input + 1];
+			input += 2;
+			u32 length = (high >> 4) + 3;
+			u32 displacement = (((high & 0xF) << 8) | low) + 1;
+			if (length > size - position) length = size - position;
+
+			if (displacement >= length && displacement <= position)
+				memcpy(&output[position], &output[position - displacement], length);
+			else
+			{
+				// overlapping run repeating the last bytes, or a reference before the start of the output
+				for (u32 i = 0; i < length; i++, position++)
+					output[position] = displacement <= position ? output[position - displacement] : memory[dest + position - displacement];
+				continue;
+			}
+			position += length;
+		}
+	}
+
+	cpu->pending_cycles += (input - source) * memory.access_time(source, false, true);
+	write_output(cpu, dest, output, size, vram);
+}
+
+void HLEBios::rl_uncomp(Cpu* cpu, bool vram)
+{
+	const Memory& memory = *cpu->memory;
+	u32 source = cpu->R[0], dest = cpu->R[1];
+	u32 size = memory.get32(source & ~3) >> 8;
+	std::vector<u8> output(size);
+
+	u32 input = source + 4;
+	u32 position = 0;
+	while (position < size)
+	{
+		u8 flag = memory[input++];
+		u32 length;
+		if (flag & 0x80)
+		{
+			// one byte repeated 3-130 times
+			length = (flag & 0x7F) + 3;
+			if (length > size - position) length = size - position;
+			memset(&output[position], memory[input++], length);
+		}
+		else
+		{
+			// 1-128 literal bytes
+			length = (flag & 0x7F) + 1;
+			if (length > size - position) length = size - position;
+			memory.read(input, &output[position], length);
+			input += length;
+		}
+		position += length;
+	}
+
+	cpu->pending_cycles += (input - source) * memory.access_time(source, false, true);
+	write_output(cpu, dest, output, size, vram);
+}
+
+void HLEBios::huff_uncomp(Cpu* cpu)
+{
+	const Memory& memory = *cpu->memory;
+	u32 source = cpu->R[0] & ~3, dest = cpu->R[1];
+	u32 header = memory.get32(source);
+	u32 bits = header & 0xF;
+	if (bits != 4 && bits != 8) bits = 8;
+	u32 size = header >> 8;
+	// whole words come out
+	std::vector<u8> output((size + 3) & ~3);
+
+	// the tree size byte counts halfwords; the bit stream follows the tree, word aligned
+	u32 root = source + 5;
+	u32 input = source + 4 + (memory[source + 4] + 1) * 2;
+	u32 node = root;
+	u32 pending = 0, pending_bits = 0;
+	u32 position = 0;
+	while (position < size)
+	{
+		u32 stream = memory.get32(input);
+		input += 4;
+		for (int bit = 31; bit >= 0 && position < size; bit--)
+		{
+			// children at (node & ~1) + offset * 2 + 2, bit 7 / bit 6 set when child 0 / child 1 is a leaf
+			u32 right = (stream >> bit) & 1;
+			u8 value = memory[node];
+			u32 child = (node & ~1) + (value & 0x3F) * 2 + 2 + right;
+			if (!(value & (right ? 0x40 : 0x80)))
+			{
+				node = child;
+				continue;
+			}
+
+			pending |= (memory[child] & ((1u << bits) - 1)) << pending_bits;
+			pending_bits += bits;
+			node = root;
+			if (pending_bits == 32)
+			{
+				for (int i = 0; i < 4; i++) output[position + i] = (u8)(pending >> (i * 8));
+				position += 4;
+				pending = 0;
+				pending_bits = 0;
+			}
+		}
+	}
+
+	cpu->pending_cycles += (input - source) / 4 * memory.access_time(source, true, true);
+	write_output(cpu, dest & ~3, output, (u32)output.size(), false);
+}
+
+void HLEBios::write_output(Cpu* cpu, u32 dest, const std::vector<u8>& data, u32 size, bool vram)
+{
+	if (vram)
+	{
+		// halfword writes: an odd last byte never gets out
+		dest &= ~1;
+		size &= ~1;
+	}
+	if (size == 0)
+		return;
+
+	Memory* memory = cpu->memory;
+	bool word = !vram && (dest & 3) == 0 && (size & 3) == 0;
+	cpu->pending_cycles += size / (word ? 4 : vram ? 2 : 1) * memory->access_time(dest, word, true);
+	if (!is_io(dest))
+	{
+		memory->write(dest, data.data(), size);
+		return;
+	}
+	for (u32 i = 0; i < size; i++)
+		memory->set_at(dest + i, data[i]);
+}
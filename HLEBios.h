@@ -0,0 +1,54 @@
+#pragma once
+#include "Cpu.h"
+
+#include <vector>
+
+/// <summary>
+/// Native versions of the BIOS calls games make every frame: division, square root, arc tangent,
+/// memory copies and fills, decompression and affine matrix setup. With Cpu::set_hle_bios on, SWI runs
+/// them in place instead of entering the BIOS, which would take thousands of guest instructions per call.
+/// Calls it does not know still raise the SWI exception.
+/// </summary>
+class HLEBios
+{
+public:
+	/// <summary>
+	/// Runs the BIOS call number and returns true, or returns false if it is not emulated.
+	/// Registers and memory end up as the BIOS leaves them; the data accesses are charged,
+	/// the BIOS code fetches are not.
+	/// </summary>
+	static bool call(Cpu* cpu, u8 number);
+
+	/// <summary>
+	/// Sets the CPU up the way the BIOS boot code leaves it: System mode, the IRQ, Supervisor
+	/// and System stacks at the top of IWRAM and PC on the Game Pak entry point
+	/// </summary>
+	static void boot(Cpu* cpu);
+
+private:
+	static void div(Cpu* cpu, s32 numerator, s32 denominator);
+	static void sqrt(Cpu* cpu);
+	static void arc_tan(Cpu* cpu);
+	static void cpu_set(Cpu* cpu);
+	static void cpu_fast_set(Cpu* cpu);
+	static void bg_affine_set(Cpu* cpu);
+	static void obj_affine_set(Cpu* cpu);
+	static void lz77_uncomp(Cpu* cpu, bool vram);
+	static void rl_uncomp(Cpu* cpu, bool vram);
+	static void huff_uncomp(Cpu* cpu);
+
+	/// <summary>
+	/// Copies size bytes in units of 2 or 4 bytes, in bulk unless dest overlaps the source from above
+	/// </summary>
+	static void copy(Cpu* cpu, u32 source, u32 dest, u32 size, bool word);
+
+	/// <summary>
+	/// Fills size bytes with the repeated 32-bit pattern value
+	/// </summary>
+	static void fill(Cpu* cpu, u32 dest, u32 size, u32 value, bool word);
+
+	/// <summary>
+	/// Writes decompressed data out in one go; the VRAM variants only write whole halfwords
+	/// </summary>
+	static void write_output(Cpu* cpu, u32 dest, const std::vector<u8>& data, u32 size, bool vram);
+};
@@ -0,0 +1,97 @@
+#pragma once
+#include "Types.h"
+#include "DecodedInstruction.h"
+
+#include <vector>
+
+/// <summary>
+/// Operations of the block IR. Every instruction defines the value with its own index;
+/// a, b, c and imm are described per operation.
+/// </summary>
+#define IR_OPS(X) \
+	/* no operation, dropped by IROptimizer */ \
+	X(Nop) \
+	/* imm */ \
+	X(Const) \
+	/* guest register aux, read from the register file */ \
+	X(GetReg) \
+	/* C flag, resolving the pending flags */ \
+	X(GetCarry) \
+	/* a op b */ \
+	X(Add) X(Sub) X(And) X(Or) X(Xor) X(Bic) \
+	/* a op imm; RsbI is imm - a */ \
+	X(AddI) X(SubI) X(RsbI) X(AndI) X(OrI) X(XorI) \
+	/* ~a */ \
+	X(Not) \
+	/* a shifted by imm (1-31) */ \
+	X(Shl) X(Shr) X(Sar) X(Ror) \
+	/* guest register aux = a */ \
+	X(SetReg) \
+	/* pending flags (Cpu::FlagOp aux) of result c, operands a, b and carry value imm */ \
+	X(SetFlags) \
+	/* bus access at a + imm through memory check slot aux (0: none); b is the stored value */ \
+	X(Load8) X(Load32) X(Load32Rotated) X(Store8) X(Store32) \
+	/* memory check slot aux (from 1) covers [a + imm, a + imm + b) for reads / writes */ \
+	X(CheckRead) X(CheckWrite) \
+	/* charges the wait states of b data accesses from a + imm, the first non-sequential; aux set for words */ \
+	X(Wait) \
+	/* unless condition aux holds, skip the next imm instructions */ \
+	X(Skip) \
+	/* executes source instruction imm with ARMInterpreter; leaves the block if it branched */ \
+	X(Interpret) \
+	/* leaves the block if the stores of source instruction c replaced decoded code or wrote HALTCNT */ \
+	X(CheckCode) \
+	/* leaves the block for a, or for imm, after c source instructions; ExitConst refills the pipeline when aux is set */ \
+	X(Exit) X(ExitConst)
+
+enum class IROp : u8
+{
+#define __ir_op_entry__(name) name,
+	IR_OPS(__ir_op_entry__)
+#undef __ir_op_entry__
+};
+
+/// <summary>
+/// Operand slot holding no value
+/// </summary>
+static const u16 IR_NONE = 0xFFFF;
+
+struct IRInstruction
+{
+	IROp op;
+	/// <summary>
+	/// Guest register, Cpu::FlagOp, condition or memory check slot, depending on op
+	/// </summary>
+	u8 aux;
+	u16 a, b, c;
+	u32 imm;
+};
+
+/// <summary>
+/// Straight-line block in IR form, built from a DecodedBlock by IRBuilder
+/// </summary>
+struct IRBlock
+{
+	u32 address = 0;
+	std::vector<IRInstruction> code;
+
+	/// <summary>
+	/// Guest instructions the block was built from, for Interpret and the exit addresses
+	/// </summary>
+	std::vector<DecodedInstruction> sources;
+
+	/// <summary>
+	/// cycles[n]: fetch and internal cycles of the first n sources
+	/// </summary>
+	std::vector<u32> cycles;
+
+	/// <summary>
+	/// Copied from DecodedBlock::idle
+	/// </summary>
+	bool idle = false;
+
+	/// <summary>
+	/// Number of memory check slots used by CheckRead/CheckWrite
+	/// </summary>
+	u8 check_count = 0;
+};
@@ -0,0 +1,357 @@
+#include "IRBuilder.h"
+#include "ARMInstruction.h"
+#include "Cpu.h"
+
+// ALU Opcodes
+static const u8 OPCODE_AND = 0x0;
+static const u8 OPCODE_EOR = 0x1;
+static const u8 OPCODE_SUB = 0x2;
+static const u8 OPCODE_RSB = 0x3;
+static const u8 OPCODE_ADD = 0x4;
+static const u8 OPCODE_ADC = 0x5;
+static const u8 OPCODE_SBC = 0x6;
+static const u8 OPCODE_RSC = 0x7;
+static const u8 OPCODE_TST = 0x8;
+static const u8 OPCODE_TEQ = 0x9;
+static const u8 OPCODE_CMP = 0xA;
+static const u8 OPCODE_CMN = 0xB;
+static const u8 OPCODE_ORR = 0xC;
+static const u8 OPCODE_MOV = 0xD;
+static const u8 OPCODE_BIC = 0xE;
+static const u8 OPCODE_MVN = 0xF;
+
+// Shift types
+static const u8 SHIFT_LSL = 0;
+static const u8 SHIFT_LSR = 1;
+static const u8 SHIFT_ASR = 2;
+static const u8 SHIFT_ROR = 3;
+
+static const u8 COND_AL = 0xE;
+
+static inline bool is_logical(u8 op)
+{
+	return op == OPCODE_AND || op == OPCODE_EOR || op == OPCODE_TST || op == OPCODE_TEQ
+		|| op == OPCODE_ORR || op == OPCODE_MOV || op == OPCODE_BIC || op == OPCODE_MVN;
+}
+
+static inline bool writes_rd(u8 op) { return op < OPCODE_TST || op > OPCODE_CMN; }
+
+static inline bool reads_rn(u8 op) { return op != OPCODE_MOV && op != OPCODE_MVN; }
+
+static inline u32 rotate_right(u32 value, u32 amount)
+{
+	amount &= 31;
+	return amount ? (value >> amount) | (value << (32 - amount)) : value;
+}
+
+static inline u32 popcount16(u16 value)
+{
+	u32 count = 0;
+	for (; value; value &= value - 1) count++;
+	return count;
+}
+
+u16 IRBuilder::emit(IROp op, u8 aux, u16 a, u16 b, u16 c, u32 imm)
+{
+	block.code.push_back(IRInstruction{ op, aux, a, b, c, imm });
+	return (u16)(block.code.size() - 1);
+}
+
+u16 IRBuilder::constant(u32 value)
+{
+	return emit(IROp::Const, 0, IR_NONE, IR_NONE, IR_NONE, value);
+}
+
+u16 IRBuilder::get_reg(u8 r, u32 pc)
+{
+	// R15 reads are known when the block is built
+	if (r == 15) return constant(pc);
+	return emit(IROp::GetReg, r, IR_NONE, IR_NONE, IR_NONE);
+}
+
+void IRBuilder::set_reg(u8 r, u16 value)
+{
+	emit(IROp::SetReg, r, value, IR_NONE, IR_NONE);
+}
+
+u16 IRBuilder::shift_by_immediate(u16 value, u8 type, u8 amount, u16* carry)
+{
+	// carry out = bit of value, for amounts 1-32
+	auto carry_bit = [&](u8 bit)
+	{
+		if (carry == nullptr) return;
+		u16 shifted = bit == 0 ? value : emit(IROp::Shr, 0, value, IR_NONE, IR_NONE, bit);
+		*carry = bit == 31 ? shifted : emit(IROp::AndI, 0, shifted, IR_NONE, IR_NONE, 1);
+	};
+
+	switch (type)
+	{
+	case SHIFT_LSL:
+		if (amount == 0) return value;
+		carry_bit(32 - amount);
+		return emit(IROp::Shl, 0, value, IR_NONE, IR_NONE, amount);
+	case SHIFT_LSR:
+		// #0 encodes LSR #32
+		carry_bit(amount ? amount - 1 : 31);
+		return amount ? emit(IROp::Shr, 0, value, IR_NONE, IR_NONE, amount) : constant(0);
+	case SHIFT_ASR:
+		carry_bit(amount ? amount - 1 : 31);
+		return emit(IROp::Sar, 0, value, IR_NONE, IR_NONE, amount ? amount : 31);
+	default:
+		if (amount == 0)
+		{
+			// RRX
+			u16 carry_in = emit(IROp::GetCarry, 0, IR_NONE, IR_NONE, IR_NONE);
+			u16 top = emit(IROp::Shl, 0, carry_in, IR_NONE, IR_NONE, 31);
+			u16 rest = emit(IROp::Shr, 0, value, IR_NONE, IR_NONE, 1);
+			carry_bit(0);
+			return emit(IROp::Or, 0, top, rest, IR_NONE);
+		}
+		carry_bit(amount - 1);
+		return emit(IROp::Ror, 0, value, IR_NONE, IR_NONE, amount);
+	}
+}
+
+u16 IRBuilder::begin_condition(u8 cond)
+{
+	return cond == COND_AL ? IR_NONE : emit(IROp::Skip, cond, IR_NONE, IR_NONE, IR_NONE);
+}
+
+void IRBuilder::end_condition(u16 skip)
+{
+	if (skip != IR_NONE)
+		block.code[skip].imm = (u32)(block.code.size() - skip - 1);
+}
+
+bool IRBuilder::data_proc(const DecodedInstruction& data)
+{
+	const u8 op = data.Op;
+	if (data.type == (u8)ARMInstruction::Type::DataProc_Reg_ShReg || (writes_rd(op) && data.Rd == 15))
+		return false;
+
+	const u32 pc = data.address + 8;
+	const bool logical_flags = data.S && is_logical(op);
+	u16 carry = IR_NONE;
+
+	u16 op2;
+	if (data.type == (u8)ARMInstruction::Type::DataProc_Imm)
+	{
+		u32 value = rotate_right(data.Immediate, data.Shift << 1);
+		op2 = constant(value);
+		if (logical_flags && data.Shift != 0)
+			carry = constant(value >> 31);
+	}
+	else
+		op2 = shift_by_immediate(get_reg(data.Rm, pc), data.Typ, data.Shift, logical_flags ? &carry : nullptr);
+
+	// LSL #0 and unrotated immediates leave C alone
+	if (logical_flags && carry == IR_NONE)
+		carry = emit(IROp::GetCarry, 0, IR_NONE, IR_NONE, IR_NONE);
+
+	u16 op1 = reads_rn(op) ? get_reg(data.Rn, pc) : IR_NONE;
+	u16 carry_in = op == OPCODE_ADC || op == OPCODE_SBC || op == OPCODE_RSC
+		? emit(IROp::GetCarry, 0, IR_NONE, IR_NONE, IR_NONE) : IR_NONE;
+
+	u16 result;
+	u16 a = op1, b = op2;
+	Cpu::FlagOp flag_op = Cpu::FlagOp::Logical;
+	switch (op)
+	{
+	case OPCODE_AND: case OPCODE_TST: result = emit(IROp::And, 0, op1, op2, IR_NONE); break;
+	case OPCODE_EOR: case OPCODE_TEQ: result = emit(IROp::Xor, 0, op1, op2, IR_NONE); break;
+	case OPCODE_ORR: result = emit(IROp::Or, 0, op1, op2, IR_NONE); break;
+	case OPCODE_MOV: result = op2; break;
+	case OPCODE_BIC: result = emit(IROp::Bic, 0, op1, op2, IR_NONE); break;
+	case OPCODE_MVN: result = emit(IROp::Not, 0, op2, IR_NONE, IR_NONE); break;
+	case OPCODE_SUB: case OPCODE_CMP:
+		result = emit(IROp::Sub, 0, op1, op2, IR_NONE);
+		flag_op = Cpu::FlagOp::Sub;
+		break;
+	case OPCODE_RSB:
+		result = emit(IROp::Sub, 0, op2, op1, IR_NONE);
+		flag_op = Cpu::FlagOp::Sub;
+		a = op2; b = op1;
+		break;
+	case OPCODE_ADD: case OPCODE_CMN:
+		result = emit(IROp::Add, 0, op1, op2, IR_NONE);
+		flag_op = Cpu::FlagOp::Add;
+		break;
+	case OPCODE_ADC:
+		result = emit(IROp::Add, 0, emit(IROp::Add, 0, op1, op2, IR_NONE), carry_in, IR_NONE);
+		flag_op = Cpu::FlagOp::Adc;
+		break;
+	default:
+		// SBC, RSC: a - b - (1 - C)
+		if (op == OPCODE_RSC) { a = op2; b = op1; }
+		result = emit(IROp::SubI, 0, emit(IROp::Add, 0, emit(IROp::Sub, 0, a, b, IR_NONE), carry_in, IR_NONE), IR_NONE, IR_NONE, 1);
+		flag_op = Cpu::FlagOp::Sbc;
+		break;
+	}
+
+	if (writes_rd(op))
+		set_reg(data.Rd, result);
+
+	if (data.S)
+	{
+		if (logical_flags)
+			emit(IROp::SetFlags, (u8)flag_op, IR_NONE, IR_NONE, result, carry);
+		else
+			emit(IROp::SetFlags, (u8)flag_op, a, b, result, carry_in);
+	}
+	return true;
+}
+
+bool IRBuilder::single_transfer(const DecodedInstruction& data, u16 index)
+{
+	const bool write_back = !data.P || data.W;
+	if ((data.L && data.Rd == 15) || (data.Rn == 15 && write_back))
+		return false;
+
+	const u32 pc = data.address + 8;
+	u16 base = get_reg(data.Rn, pc);
+
+	// immediate offsets become the displacement of the access
+	u16 offset = IR_NONE;
+	u32 displacement = 0;
+	if (data.type == (u8)ARMInstruction::Type::TransImm9)
+		displacement = data.U ? data.Offset : 0u - data.Offset;
+	else
+		offset = shift_by_immediate(get_reg(data.Rm, pc), data.Typ, data.Shift, nullptr);
+
+	u16 target = IR_NONE;
+	if (offset != IR_NONE)
+		target = emit(data.U ? IROp::Add : IROp::Sub, 0, base, offset, IR_NONE);
+	else if (write_back)
+		target = emit(IROp::AddI, 0, base, IR_NONE, IR_NONE, displacement);
+
+	u16 address = base;
+	if (data.P && offset != IR_NONE)
+		address = target;
+	else if (!data.P)
+		displacement = 0;
+
+	emit(IROp::Wait, data.B ? 0 : 1, address, 1, IR_NONE, displacement);
+	if (data.L)
+	{
+		u16 value = emit(data.B ? IROp::Load8 : IROp::Load32Rotated, 0, address, IR_NONE, IR_NONE, displacement);
+		// the loaded value wins over the written back base
+		if (write_back) set_reg(data.Rn, target);
+		set_reg(data.Rd, value);
+		return true;
+	}
+
+	u16 value = data.Rd == 15 ? constant(pc + 4) : get_reg(data.Rd, pc);
+	emit(data.B ? IROp::Store8 : IROp::Store32, 0, address, value, IR_NONE, displacement);
+	if (write_back) set_reg(data.Rn, target);
+	emit(IROp::CheckCode, 0, IR_NONE, IR_NONE, index);
+	return true;
+}
+
+bool IRBuilder::block_transfer(const DecodedInstruction& data, u16 index)
+{
+	// user bank transfers, R15 and the empty list quirk stay with the interpreter
+	u16 list = data.RegList;
+	if (data.S || list == 0 || (list & 0x8000) || data.Rn == 15)
+		return false;
+
+	u32 bytes = popcount16(list) * 4;
+	u32 displacement = data.U ? 0 : 0u - bytes;
+	if (data.P == data.U) displacement += 4;
+
+	u16 base = get_reg(data.Rn, 0);
+	u16 new_base = data.W ? emit(IROp::AddI, 0, base, IR_NONE, IR_NONE, data.U ? bytes : 0u - bytes) : IR_NONE;
+	emit(IROp::Wait, 1, base, (u16)(bytes / 4), IR_NONE, displacement);
+
+	if (data.L)
+	{
+		if (data.W) set_reg(data.Rn, new_base);
+		for (u8 r = 0; r < 15; r++)
+		{
+			if (!(list & (1 << r))) continue;
+			set_reg(r, emit(IROp::Load32, 0, base, IR_NONE, IR_NONE, displacement));
+			displacement += 4;
+		}
+		return true;
+	}
+
+	// the base is written back after the first store: a base listed first is stored unchanged
+	bool first = true;
+	for (u8 r = 0; r < 15; r++)
+	{
+		if (!(list & (1 << r))) continue;
+		emit(IROp::Store32, 0, base, get_reg(r, 0), IR_NONE, displacement);
+		displacement += 4;
+		if (first && data.W) set_reg(data.Rn, new_base);
+		first = false;
+	}
+	emit(IROp::CheckCode, 0, IR_NONE, IR_NONE, index);
+	return true;
+}
+
+void IRBuilder::branch(const DecodedInstruction& data, u16 index)
+{
+	u32 offset = (u32)((s32)(data.Offset << 8) >> 8) << 2;
+	u16 skip = begin_condition(data.Cond);
+	if (data.L)
+		set_reg(14, constant(data.address + 4));
+	emit(IROp::ExitConst, 1, IR_NONE, IR_NONE, index + 1, data.address + 8 + offset);
+	end_condition(skip);
+}
+
+IRBlock IRBuilder::build(const DecodedBlock& decoded)
+{
+	IRBlock block;
+	block.address = decoded.address;
+	block.sources = decoded.instructions;
+	block.idle = decoded.idle;
+	block.cycles.push_back(0);
+	for (const DecodedInstruction& data : decoded.instructions)
+		block.cycles.push_back(block.cycles.back() + data.cycles);
+
+	IRBuilder builder{ block };
+	for (u16 index = 0; index < (u16)decoded.instructions.size(); index++)
+	{
+		const DecodedInstruction& data = decoded.instructions[index];
+		if (data.type == (u8)ARMInstruction::Type::B_BL_BLX_Offset)
+		{
+			builder.branch(data, index);
+			continue;
+		}
+
+		// an untranslated instruction rolls back whatever it emitted and goes to the interpreter
+		size_t start = block.code.size();
+		u16 skip = builder.begin_condition(data.Cond);
+		bool translated;
+		switch ((ARMInstruction::Type)data.type)
+		{
+		case ARMInstruction::Type::DataProc_Reg_ShImm:
+		case ARMInstruction::Type::DataProc_Reg_ShReg:
+		case ARMInstruction::Type::DataProc_Imm:
+			translated = builder.data_proc(data);
+			break;
+		case ARMInstruction::Type::TransImm9:
+		case ARMInstruction::Type::TransReg9:
+			translated = builder.single_transfer(data, index);
+			break;
+		case ARMInstruction::Type::BlockTrans:
+			translated = builder.block_transfer(data, index);
+			break;
+		default:
+			translated = false;
+			break;
+		}
+
+		if (translated)
+			builder.end_condition(skip);
+		else
+		{
+			block.code.resize(start);
+			builder.emit(IROp::Interpret, 0, IR_NONE, IR_NONE, IR_NONE, index);
+		}
+	}
+
+	// falls through when the block was cut short or its last branch was not taken
+	u16 count = (u16)decoded.instructions.size();
+	builder.emit(IROp::ExitConst, 0, IR_NONE, IR_NONE, count, decoded.instructions.back().address + 4);
+	return block;
+}
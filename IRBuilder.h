@@ -0,0 +1,35 @@
+#pragma once
+#include "IR.h"
+#include "BlockCache.h"
+
+/// <summary>
+/// Translates decoded ARM blocks into IR. Data processing with immediate shifts, single and block
+/// transfers and B/BL become IR operations; the rest is left to ARMInterpreter through Interpret.
+/// </summary>
+class IRBuilder
+{
+private:
+	IRBlock& block;
+
+	IRBuilder(IRBlock& block) : block{ block } { }
+
+	u16 emit(IROp op, u8 aux = 0, u16 a = 0, u16 b = 0, u16 c = 0, u32 imm = 0);
+	u16 constant(u32 value);
+	u16 get_reg(u8 r, u32 pc);
+	void set_reg(u8 r, u16 value);
+
+	/// <summary>
+	/// Barrel shifter with an immediate amount; stores the shifter carry out in *carry when carry is not null
+	/// </summary>
+	u16 shift_by_immediate(u16 value, u8 type, u8 amount, u16* carry);
+
+	u16 begin_condition(u8 cond);
+	void end_condition(u16 skip);
+
+	bool data_proc(const DecodedInstruction& data);
+	bool single_transfer(const DecodedInstruction& data, u16 index);
+	bool block_transfer(const DecodedInstruction& data, u16 index);
+	void branch(const DecodedInstruction& data, u16 index);
+public:
+	static IRBlock build(const DecodedBlock& decoded);
+};
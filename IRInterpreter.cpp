@@ -0,0 +1,227 @@
+#include "IRInterpreter.h"
+#include "ARMInterpreter.h"
+#include "IRBuilder.h"
+#include "IROptimizer.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#ifndef IR_SWITCH_DISPATCH
+#define IR_THREADED_DISPATCH
+#endif
+#endif
+
+const IRBlock& IRInterpreter::block_at(u32 address)
+{
+	// IR blocks keep copies of the decoded instructions, which only hold for one generation
+	if (block_generation != cpu->block_cache.get_generation())
+	{
+		blocks.clear();
+		block_generation = cpu->block_cache.get_generation();
+	}
+
+	auto it = blocks.find(address);
+	if (it != blocks.end())
+		return it->second;
+
+	IRBlock block = IRBuilder::build(*cpu->block_cache.lookup(address, false));
+	IROptimizer::optimize(block, cpu->memory);
+	if (values.size() < block.code.size())
+		values.resize(block.code.size());
+	if (hosts.size() < (size_t)block.check_count + 1)
+		hosts.resize((size_t)block.check_count + 1, 0);
+	return blocks[address] = std::move(block);
+}
+
+u32 IRInterpreter::execute(const IRBlock& block)
+{
+	Cpu* cpu = this->cpu;
+	Memory* memory = cpu->memory;
+	u32* v = values.data();
+	uintptr_t* host = hosts.data();
+	u32 generation = cpu->block_cache.get_generation();
+	const IRInstruction* code = block.code.data();
+	const IRInstruction* instr = code;
+	// value slot of instr, stepped alongside it
+	u32* value = v;
+
+#define __value__ (*value)
+
+#ifdef IR_THREADED_DISPATCH
+	static void* const labels[] =
+	{
+#define __label_entry__(name) &&op_##name,
+		IR_OPS(__label_entry__)
+#undef __label_entry__
+	};
+#define __op__(name) op_##name:
+#define __next__() instr++; value++; goto *labels[(int)instr->op]
+	goto *labels[(int)instr->op];
+#else
+#define __op__(name) case IROp::name:
+#define __next__() instr++; value++; continue
+	for (;;) switch (instr->op) {
+#endif
+
+	__op__(Nop) __next__();
+	__op__(Const) __value__ = instr->imm; __next__();
+	__op__(GetReg) __value__ = cpu->R[instr->aux]; __next__();
+	__op__(GetCarry) __value__ = cpu->get_carry(); __next__();
+
+	__op__(Add) __value__ = v[instr->a] + v[instr->b]; __next__();
+	__op__(Sub) __value__ = v[instr->a] - v[instr->b]; __next__();
+	__op__(And) __value__ = v[instr->a] & v[instr->b]; __next__();
+	__op__(Or) __value__ = v[instr->a] | v[instr->b]; __next__();
+	__op__(Xor) __value__ = v[instr->a] ^ v[instr->b]; __next__();
+	__op__(Bic) __value__ = v[instr->a] & ~v[instr->b]; __next__();
+	__op__(AddI) __value__ = v[instr->a] + instr->imm; __next__();
+	__op__(SubI) __value__ = v[instr->a] - instr->imm; __next__();
+	__op__(RsbI) __value__ = instr->imm - v[instr->a]; __next__();
+	__op__(AndI) __value__ = v[instr->a] & instr->imm; __next__();
+	__op__(OrI) __value__ = v[instr->a] | instr->imm; __next__();
+	__op__(XorI) __value__ = v[instr->a] ^ instr->imm; __next__();
+	__op__(Not) __value__ = ~v[instr->a]; __next__();
+	__op__(Shl) __value__ = v[instr->a] << instr->imm; __next__();
+	__op__(Shr) __value__ = v[instr->a] >> instr->imm; __next__();
+	__op__(Sar) __value__ = (u32)((s32)v[instr->a] >> instr->imm); __next__();
+	__op__(Ror) __value__ = (v[instr->a] >> instr->imm) | (v[instr->a] << (32 - instr->imm)); __next__();
+
+	__op__(SetReg) cpu->R[instr->aux] = v[instr->a]; __next__();
+	__op__(SetFlags)
+	{
+		Cpu::FlagOp op = (Cpu::FlagOp)instr->aux;
+		u32 carry = instr->imm == IR_NONE ? 0 : v[instr->imm];
+		if (op == Cpu::FlagOp::Logical)
+		{
+			// V survives logical operations
+			cpu->resolve_flags();
+			cpu->set_lazy_flags(op, v[instr->c], 0, 0, carry);
+		}
+		else cpu->set_lazy_flags(op, v[instr->c], v[instr->a], v[instr->b], carry);
+	}
+	__next__();
+
+	__op__(Load8)
+	{
+		u32 address = v[instr->a] + instr->imm;
+		if (uintptr_t page = host[instr->aux]) __value__ = *(const u8*)(page + address);
+		else __value__ = (*memory)[address];
+	}
+	__next__();
+	__op__(Load32)
+	{
+		u32 address = (v[instr->a] + instr->imm) & ~3;
+		if (uintptr_t page = host[instr->aux]) __value__ = *(const u32*)(page + address);
+		else __value__ = memory->get32(address);
+	}
+	__next__();
+	__op__(Load32Rotated)
+	{
+		u32 address = v[instr->a] + instr->imm;
+		u32 aligned = address & ~3;
+		u32 word = host[instr->aux] ? *(const u32*)(host[instr->aux] + aligned) : memory->get32(aligned);
+		u32 rotation = (address & 3) << 3;
+		__value__ = rotation ? (word >> rotation) | (word << (32 - rotation)) : word;
+	}
+	__next__();
+	__op__(Store8)
+	{
+		u32 address = v[instr->a] + instr->imm;
+		if (uintptr_t page = host[instr->aux]) *(u8*)(page + address) = (u8)v[instr->b];
+		else memory->set_at(address, (u8)v[instr->b]);
+	}
+	__next__();
+	__op__(Store32)
+	{
+		u32 address = (v[instr->a] + instr->imm) & ~3;
+		if (uintptr_t page = host[instr->aux]) *(u32*)(page + address) = v[instr->b];
+		else memory->set32(address, v[instr->b]);
+	}
+	__next__();
+	__op__(CheckRead)
+	{
+		u32 low = v[instr->a] + instr->imm;
+		host[instr->aux] = memory->page_entry(low & ~3, low + instr->b - 1, false);
+	}
+	__next__();
+	__op__(CheckWrite)
+	{
+		u32 low = v[instr->a] + instr->imm;
+		host[instr->aux] = memory->page_entry(low & ~3, low + instr->b - 1, true);
+	}
+	__next__();
+
+	__op__(Wait)
+	{
+		u32 address = v[instr->a] + instr->imm;
+		cpu->pending_cycles += memory->access_time(address, instr->aux != 0, false)
+			+ (instr->b - 1) * memory->access_time(address, instr->aux != 0, true);
+	}
+	__next__();
+
+	__op__(Skip)
+	if (!cpu->condition_passed(instr->aux))
+	{
+		value += instr->imm;
+		instr += instr->imm;
+	}
+	__next__();
+	__op__(Interpret)
+	{
+		const DecodedInstruction& source = block.sources[instr->imm];
+		cpu->PC = source.address + 8;
+		cpu->branched = false;
+		ARMInterpreter::execute(cpu, source);
+		if (cpu->branched)
+			return instr->imm + 1;
+		if (cpu->block_cache.get_generation() != generation)
+		{
+			// the instruction wrote over decoded code, maybe this very block
+			cpu->PC = source.address + 4;
+			return instr->imm + 1;
+		}
+	}
+	__next__();
+	__op__(CheckCode)
+	{
+		// a HALTCNT write puts the CPU to sleep from the next instruction on
+		bool halt = cpu->memory->take_halt_request();
+		if (halt || cpu->block_cache.get_generation() != generation)
+		{
+			cpu->halted |= halt;
+			cpu->PC = block.sources[instr->c].address + 4;
+			return instr->c + 1;
+		}
+	}
+	__next__();
+	__op__(Exit)
+	cpu->branch_to(v[instr->a]);
+	return instr->c;
+	__op__(ExitConst)
+	cpu->PC = instr->imm;
+	if (instr->aux)
+		cpu->pending_cycles += memory->access_time(instr->imm, true, false) + memory->access_time(instr->imm, true, true);
+	return instr->c;
+
+#ifndef IR_THREADED_DISPATCH
+	}
+#endif
+#undef __op__
+#undef __next__
+#undef __value__
+}
+
+u32 IRInterpreter::run(u32 budget)
+{
+	u32 executed = 0;
+	const IRBlock* block = nullptr;
+	while (executed < budget && !cpu->halted && cpu->instruction_state == Cpu::InstructionState::ARM)
+	{
+		// loops usually branch back to the block that just ran
+		if (block == nullptr || block->address != cpu->PC || block_generation != cpu->block_cache.get_generation())
+			block = &block_at(cpu->PC);
+		executed += block->cycles[execute(*block)] + cpu->take_pending_cycles();
+		// an idle loop that went round once keeps going round until an event
+		if (block->idle && cpu->PC == block->address)
+			cpu->halted = true;
+	}
+	return executed;
+}
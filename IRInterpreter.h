@@ -0,0 +1,43 @@
+#pragma once
+#include "Cpu.h"
+#include "IR.h"
+
+#include <unordered_map>
+#include <vector>
+
+/// <summary>
+/// Runs ARM blocks as optimized IR: blocks are translated by IRBuilder, go through IROptimizer
+/// and are kept per guest address for as long as the decoded blocks they came from.
+/// </summary>
+class IRInterpreter
+{
+private:
+	Cpu* cpu;
+
+	std::unordered_map<u32, IRBlock> blocks;
+	u32 block_generation = 0;
+
+	/// <summary>
+	/// Value of every IR instruction of the running block
+	/// </summary>
+	std::vector<u32> values;
+
+	/// <summary>
+	/// Host page entry of each memory check slot; slot 0 stays 0 for unchecked accesses
+	/// </summary>
+	std::vector<uintptr_t> hosts;
+
+	const IRBlock& block_at(u32 address);
+
+	/// <summary>
+	/// Runs block once, leaving PC at the next instruction. Returns the number of guest instructions executed.
+	/// </summary>
+	u32 execute(const IRBlock& block);
+public:
+	IRInterpreter(Cpu* cpu) : cpu{ cpu } { }
+
+	/// <summary>
+	/// Runs whole blocks until at least budget cycles passed or the CPU left ARM state
+	/// </summary>
+	u32 run(u32 budget);
+};
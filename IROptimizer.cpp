@@ -0,0 +1,454 @@
+#include "IROptimizer.h"
+#include "Cpu.h"
+
+#include <algorithm>
+#include <cstdint>
+
+// Operand fields holding values, per op
+static const u8 OPERAND_A = 1;
+static const u8 OPERAND_B = 2;
+static const u8 OPERAND_C = 4;
+static const u8 OPERAND_IMM = 8;
+
+static u8 operand_fields(IROp op)
+{
+	switch (op)
+	{
+	case IROp::Add: case IROp::Sub: case IROp::And: case IROp::Or: case IROp::Xor: case IROp::Bic:
+	case IROp::Store8: case IROp::Store32:
+		return OPERAND_A | OPERAND_B;
+	case IROp::AddI: case IROp::SubI: case IROp::RsbI: case IROp::AndI: case IROp::OrI: case IROp::XorI:
+	case IROp::Not: case IROp::Shl: case IROp::Shr: case IROp::Sar: case IROp::Ror:
+	case IROp::SetReg: case IROp::Load8: case IROp::Load32: case IROp::Load32Rotated:
+	case IROp::CheckRead: case IROp::CheckWrite: case IROp::Wait: case IROp::Exit:
+		return OPERAND_A;
+	case IROp::SetFlags:
+		return OPERAND_A | OPERAND_B | OPERAND_C | OPERAND_IMM;
+	default:
+		return 0;
+	}
+}
+
+/// <summary>
+/// Calls f on every value operand of instr, skipping IR_NONE
+/// </summary>
+template <class F>
+static void for_each_operand(IRInstruction& instr, F f)
+{
+	u8 fields = operand_fields(instr.op);
+	if ((fields & OPERAND_A) && instr.a != IR_NONE) f(instr.a);
+	if ((fields & OPERAND_B) && instr.b != IR_NONE) f(instr.b);
+	if ((fields & OPERAND_C) && instr.c != IR_NONE) f(instr.c);
+	if ((fields & OPERAND_IMM) && instr.imm != IR_NONE)
+	{
+		u16 value = (u16)instr.imm;
+		f(value);
+		instr.imm = value;
+	}
+}
+
+static bool is_pure(IROp op)
+{
+	switch (op)
+	{
+	case IROp::Const: case IROp::GetReg: case IROp::GetCarry:
+	case IROp::Add: case IROp::Sub: case IROp::And: case IROp::Or: case IROp::Xor: case IROp::Bic:
+	case IROp::AddI: case IROp::SubI: case IROp::RsbI: case IROp::AndI: case IROp::OrI: case IROp::XorI:
+	case IROp::Not: case IROp::Shl: case IROp::Shr: case IROp::Sar: case IROp::Ror:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/// <summary>
+/// Points where the block may end, leaving the register file and flags to the outside
+/// </summary>
+static bool leaves_block(IROp op)
+{
+	return op == IROp::Interpret || op == IROp::CheckCode || op == IROp::Exit || op == IROp::ExitConst;
+}
+
+static u32 rotate_right(u32 value, u32 amount)
+{
+	amount &= 31;
+	return amount ? (value >> amount) | (value << (32 - amount)) : value;
+}
+
+/// <summary>
+/// Value of a pure operation on known operands
+/// </summary>
+static u32 evaluate(IROp op, u32 a, u32 b, u32 imm)
+{
+	switch (op)
+	{
+	case IROp::Add: return a + b;
+	case IROp::Sub: return a - b;
+	case IROp::And: return a & b;
+	case IROp::Or: return a | b;
+	case IROp::Xor: return a ^ b;
+	case IROp::Bic: return a & ~b;
+	case IROp::AddI: return a + imm;
+	case IROp::SubI: return a - imm;
+	case IROp::RsbI: return imm - a;
+	case IROp::AndI: return a & imm;
+	case IROp::OrI: return a | imm;
+	case IROp::XorI: return a ^ imm;
+	case IROp::Not: return ~a;
+	case IROp::Shl: return a << imm;
+	case IROp::Shr: return a >> imm;
+	case IROp::Sar: return (u32)((s32)a >> imm);
+	default: return rotate_right(a, imm); // Ror
+	}
+}
+
+/// <summary>
+/// Index of the Skip whose range holds each instruction, IR_NONE outside of them
+/// </summary>
+static std::vector<u16> conditional_ranges(const IRBlock& block)
+{
+	std::vector<u16> range(block.code.size(), IR_NONE);
+	for (size_t i = 0; i < block.code.size(); i++)
+	{
+		if (block.code[i].op != IROp::Skip) continue;
+		for (size_t j = i + 1; j <= i + block.code[i].imm && j < block.code.size(); j++)
+			range[j] = (u16)i;
+	}
+	return range;
+}
+
+void IROptimizer::forward_registers(IRBlock& block)
+{
+	std::vector<IRInstruction>& code = block.code;
+	std::vector<u16> replace(code.size());
+	u16 known[16];
+	for (u16& value : known) value = IR_NONE;
+
+	// values first seen inside a Skip range may not exist past it
+	size_t range_end = 0;
+	u16 range_registers = 0;
+
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		if (range_end != 0 && i == range_end)
+		{
+			for (int r = 0; r < 16; r++)
+				if (range_registers & (1 << r)) known[r] = IR_NONE;
+			range_end = 0;
+		}
+
+		IRInstruction& instr = code[i];
+		replace[i] = (u16)i;
+		for_each_operand(instr, [&](u16& value) { value = replace[value]; });
+
+		switch (instr.op)
+		{
+		case IROp::Skip:
+			range_end = i + 1 + instr.imm;
+			range_registers = 0;
+			break;
+		case IROp::GetReg:
+			if (known[instr.aux] != IR_NONE)
+			{
+				replace[i] = known[instr.aux];
+				instr.op = IROp::Nop;
+				break;
+			}
+			known[instr.aux] = (u16)i;
+			if (range_end != 0) range_registers |= 1 << instr.aux;
+			break;
+		case IROp::SetReg:
+			known[instr.aux] = instr.a;
+			if (range_end != 0) range_registers |= 1 << instr.aux;
+			break;
+		case IROp::Interpret:
+			for (u16& value : known) value = IR_NONE;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+void IROptimizer::fold_constants(IRBlock& block, const Memory* memory)
+{
+	std::vector<IRInstruction>& code = block.code;
+	std::vector<u16> replace(code.size());
+	auto is_constant = [&](u16 value) { return value != IR_NONE && code[value].op == IROp::Const; };
+
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		IRInstruction& instr = code[i];
+		replace[i] = (u16)i;
+		for_each_operand(instr, [&](u16& value) { value = replace[value]; });
+
+		switch (instr.op)
+		{
+		case IROp::Add: case IROp::Sub: case IROp::And: case IROp::Or: case IROp::Xor: case IROp::Bic:
+			if (is_constant(instr.a) && is_constant(instr.b))
+			{
+				instr.imm = evaluate(instr.op, code[instr.a].imm, code[instr.b].imm, 0);
+				instr.op = IROp::Const;
+			}
+			else if (is_constant(instr.b))
+			{
+				static const IROp IMMEDIATE_FORM[] = { IROp::AddI, IROp::SubI, IROp::AndI, IROp::OrI, IROp::XorI, IROp::AndI };
+				instr.imm = instr.op == IROp::Bic ? ~code[instr.b].imm : code[instr.b].imm;
+				instr.op = IMMEDIATE_FORM[(int)instr.op - (int)IROp::Add];
+				instr.b = IR_NONE;
+			}
+			else if (is_constant(instr.a) && instr.op != IROp::Bic)
+			{
+				static const IROp SWAPPED_FORM[] = { IROp::AddI, IROp::RsbI, IROp::AndI, IROp::OrI, IROp::XorI };
+				instr.imm = code[instr.a].imm;
+				instr.op = SWAPPED_FORM[(int)instr.op - (int)IROp::Add];
+				instr.a = instr.b;
+				instr.b = IR_NONE;
+			}
+			else break;
+			// the immediate form may simplify further
+			if (instr.op == IROp::Const) break;
+			[[fallthrough]];
+		case IROp::AddI: case IROp::SubI: case IROp::RsbI: case IROp::AndI: case IROp::OrI: case IROp::XorI:
+		case IROp::Not: case IROp::Shl: case IROp::Shr: case IROp::Sar: case IROp::Ror:
+			if (is_constant(instr.a))
+			{
+				instr.imm = evaluate(instr.op, code[instr.a].imm, 0, instr.imm);
+				instr.op = IROp::Const;
+				instr.a = IR_NONE;
+				break;
+			}
+			if (instr.op == IROp::SubI)
+			{
+				instr.op = IROp::AddI;
+				instr.imm = 0u - instr.imm;
+			}
+			if (instr.op == IROp::AddI && code[instr.a].op == IROp::AddI)
+			{
+				instr.imm += code[instr.a].imm;
+				instr.a = code[instr.a].a;
+			}
+			if ((instr.imm == 0 && (instr.op == IROp::AddI || instr.op == IROp::OrI || instr.op == IROp::XorI))
+				|| (instr.imm == 0xFFFFFFFF && instr.op == IROp::AndI))
+			{
+				replace[i] = instr.a;
+				instr.op = IROp::Nop;
+			}
+			break;
+		case IROp::Load8: case IROp::Load32: case IROp::Load32Rotated:
+		case IROp::Store8: case IROp::Store32:
+			// address arithmetic moves into the displacement
+			if (code[instr.a].op == IROp::AddI)
+			{
+				instr.imm += code[instr.a].imm;
+				instr.a = code[instr.a].a;
+			}
+			if (instr.op == IROp::Store8 || instr.op == IROp::Store32 || !is_constant(instr.a))
+				break;
+			{
+				// literal pools: BIOS and ROM contents are fixed for the life of the block
+				u32 address = code[instr.a].imm + instr.imm;
+				u32 aligned = instr.op == IROp::Load8 ? address : address & ~3;
+				u32 width = instr.op == IROp::Load8 ? 1 : 4;
+				if (!Memory::is_read_only(address) || memory->page_entry(aligned, aligned + width - 1, false) == 0)
+					break;
+				if (instr.op == IROp::Load8) instr.imm = (*memory)[address];
+				else if (instr.op == IROp::Load32) instr.imm = memory->get32(aligned);
+				else instr.imm = rotate_right(memory->get32(aligned), (address & 3) << 3);
+				instr.op = IROp::Const;
+				instr.a = IR_NONE;
+			}
+			break;
+		case IROp::Exit:
+			if (is_constant(instr.a))
+			{
+				instr.op = IROp::ExitConst;
+				instr.aux = 1;
+				instr.imm = code[instr.a].imm & ~3;
+				instr.a = IR_NONE;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+void IROptimizer::remove_dead_flags(IRBlock& block)
+{
+	std::vector<IRInstruction>& code = block.code;
+	std::vector<u16> range = conditional_ranges(block);
+
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		if (code[i].op != IROp::SetFlags) continue;
+		for (size_t j = i + 1; j < code.size(); j++)
+		{
+			const IRInstruction& next = code[j];
+			if (next.op == IROp::Skip || next.op == IROp::GetCarry || leaves_block(next.op))
+				break;
+			if (next.op != IROp::SetFlags) continue;
+
+			// logical ops keep V, ADC and SBC read C: only ADD and SUB forms replace all of NZCV
+			Cpu::FlagOp op = (Cpu::FlagOp)next.aux;
+			if (op != Cpu::FlagOp::Add && op != Cpu::FlagOp::Sub)
+				break;
+			if (range[j] == IR_NONE || range[j] == range[i])
+				code[i].op = IROp::Nop;
+			break;
+		}
+	}
+}
+
+void IROptimizer::remove_dead_stores(IRBlock& block)
+{
+	std::vector<IRInstruction>& code = block.code;
+	std::vector<u16> range = conditional_ranges(block);
+
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		if (code[i].op != IROp::SetReg) continue;
+		u8 r = code[i].aux;
+		for (size_t j = i + 1; j < code.size(); j++)
+		{
+			const IRInstruction& next = code[j];
+			if (leaves_block(next.op) || (next.op == IROp::GetReg && next.aux == r))
+				break;
+			if (next.op != IROp::SetReg || next.aux != r)
+				continue;
+			// a write that may be skipped does not hide this one
+			if (range[j] == IR_NONE || range[j] == range[i])
+			{
+				code[i].op = IROp::Nop;
+				break;
+			}
+		}
+	}
+}
+
+void IROptimizer::remove_dead_code(IRBlock& block)
+{
+	std::vector<IRInstruction>& code = block.code;
+	std::vector<u16> uses(code.size(), 0);
+	for (size_t i = code.size(); i-- > 0;)
+	{
+		IRInstruction& instr = code[i];
+		if (is_pure(instr.op) && uses[i] == 0)
+		{
+			instr.op = IROp::Nop;
+			continue;
+		}
+		for_each_operand(instr, [&](u16& value) { uses[value]++; });
+	}
+}
+
+void IROptimizer::share_memory_checks(IRBlock& block)
+{
+	struct Group
+	{
+		u16 base;
+		bool write;
+		std::vector<u16> accesses;
+	};
+
+	std::vector<IRInstruction>& code = block.code;
+	std::vector<u16> range = conditional_ranges(block);
+	std::vector<Group> groups;
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		IROp op = code[i].op;
+		bool write = op == IROp::Store8 || op == IROp::Store32;
+		if (!write && op != IROp::Load8 && op != IROp::Load32 && op != IROp::Load32Rotated)
+			continue;
+		// a check inside a Skip range may not run
+		if (range[i] != IR_NONE)
+			continue;
+
+		Group* group = nullptr;
+		for (Group& candidate : groups)
+			if (candidate.base == code[i].a && candidate.write == write) group = &candidate;
+		if (group == nullptr)
+		{
+			groups.push_back(Group{ code[i].a, write, {} });
+			group = &groups.back();
+		}
+		group->accesses.push_back((u16)i);
+	}
+
+	std::vector<Insertion> insertions;
+	for (const Group& group : groups)
+	{
+		if (group.accesses.size() < 2 || block.check_count == 0xFF)
+			continue;
+
+		s64 low = INT64_MAX, high = INT64_MIN;
+		for (u16 index : group.accesses)
+		{
+			const IRInstruction& access = code[index];
+			s64 displacement = (s32)access.imm;
+			u32 width = access.op == IROp::Load8 || access.op == IROp::Store8 ? 1 : 4;
+			if (displacement < low) low = displacement;
+			if (displacement + width > high) high = displacement + width;
+		}
+		// a span over a page never passes the check anyway
+		if (high - low > Memory::PAGE_SIZE)
+			continue;
+
+		u8 slot = ++block.check_count;
+		IRInstruction check{ group.write ? IROp::CheckWrite : IROp::CheckRead, slot, group.base, (u16)(high - low), IR_NONE, (u32)low };
+		insertions.push_back(Insertion{ group.accesses[0], check });
+		for (u16 index : group.accesses)
+			code[index].aux = slot;
+	}
+
+	if (!insertions.empty())
+	{
+		std::sort(insertions.begin(), insertions.end(), [](const Insertion& x, const Insertion& y) { return x.first < y.first; });
+		compact(block, insertions);
+	}
+}
+
+void IROptimizer::compact(IRBlock& block, const std::vector<Insertion>& insertions)
+{
+	const std::vector<IRInstruction>& code = block.code;
+	std::vector<IRInstruction> result;
+	result.reserve(code.size() + insertions.size());
+
+	// position[i]: where the output for old index i starts, new_index[i]: old instruction i itself
+	std::vector<u16> position(code.size() + 1);
+	std::vector<u16> new_index(code.size(), IR_NONE);
+	size_t next = 0;
+	for (size_t i = 0; i <= code.size(); i++)
+	{
+		position[i] = (u16)result.size();
+		for (; next < insertions.size() && insertions[next].first == i; next++)
+			result.push_back(insertions[next].second);
+		if (i < code.size() && code[i].op != IROp::Nop)
+		{
+			new_index[i] = (u16)result.size();
+			result.push_back(code[i]);
+		}
+	}
+
+	for (IRInstruction& instr : result)
+		for_each_operand(instr, [&](u16& value) { value = new_index[value]; });
+
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		if (code[i].op == IROp::Skip && new_index[i] != IR_NONE)
+			result[new_index[i]].imm = position[i + 1 + code[i].imm] - new_index[i] - 1;
+	}
+
+	block.code = std::move(result);
+}
+
+void IROptimizer::optimize(IRBlock& block, const Memory* memory)
+{
+	forward_registers(block);
+	fold_constants(block, memory);
+	remove_dead_flags(block);
+	remove_dead_stores(block);
+	remove_dead_code(block);
+	compact(block, {});
+	share_memory_checks(block);
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include "IR.h"
+#include "Memory.h"
+
+#include <utility>
+#include <vector>
+
+/// <summary>
+/// Optimization passes over IR blocks. Passes turn removed instructions into Nop
+/// and compact() drops them at the end, so indices stay stable while they run.
+/// </summary>
+class IROptimizer
+{
+private:
+	/// <summary>
+	/// Instruction to add in front of the one at the given index
+	/// </summary>
+	typedef std::pair<u16, IRInstruction> Insertion;
+
+	/// <summary>
+	/// Guest register reads after a write or an earlier read in the block use that value directly
+	/// </summary>
+	static void forward_registers(IRBlock& block);
+
+	/// <summary>
+	/// Evaluates operations on constants, turns constant operands into immediates and
+	/// reads loads from BIOS/ROM at constant addresses (PC-relative literals) when building the block
+	/// </summary>
+	static void fold_constants(IRBlock& block, const Memory* memory);
+
+	/// <summary>
+	/// Drops flag updates that a later one overwrites before anything reads the flags
+	/// </summary>
+	static void remove_dead_flags(IRBlock& block);
+
+	/// <summary>
+	/// Drops register writes that a later one overwrites before anything can see the register file
+	/// </summary>
+	static void remove_dead_stores(IRBlock& block);
+
+	/// <summary>
+	/// Drops side effect free instructions whose value is never used
+	/// </summary>
+	static void remove_dead_code(IRBlock& block);
+
+	/// <summary>
+	/// Gives accesses sharing a base value one page check, done once before the first of them
+	/// </summary>
+	static void share_memory_checks(IRBlock& block);
+
+	/// <summary>
+	/// Drops Nop instructions and adds the insertions, renumbering values and Skip lengths
+	/// </summary>
+	static void compact(IRBlock& block, const std::vector<Insertion>& insertions);
+public:
+	/// <summary>
+	/// Runs every pass; memory supplies the read-only contents folded into constants
+	/// </summary>
+	static void optimize(IRBlock& block, const Memory* memory);
+};
@@ -0,0 +1,143 @@
+#include "IdleLoop.h"
+#include "ARMInstruction.h"
+
+// ALU Opcodes
+static const u8 OPCODE_SUB = 0x2;
+static const u8 OPCODE_ADC = 0x5;
+static const u8 OPCODE_SBC = 0x6;
+static const u8 OPCODE_RSC = 0x7;
+static const u8 OPCODE_TST = 0x8;
+static const u8 OPCODE_CMP = 0xA;
+static const u8 OPCODE_CMN = 0xB;
+static const u8 OPCODE_MOV = 0xD;
+static const u8 OPCODE_MVN = 0xF;
+
+// Shift types
+static const u8 SHIFT_LSL = 0;
+static const u8 SHIFT_ROR = 3;
+
+static const u8 COND_AL = 0xE;
+
+// Flag resources, above the registers
+static const u32 FLAG_NZ = 1 << 16;
+static const u32 FLAG_C = 1 << 17;
+static const u32 FLAG_V = 1 << 18;
+
+static inline bool is_arithmetic(u8 op)
+{
+	return (op >= OPCODE_SUB && op <= OPCODE_RSC) || op == OPCODE_CMP || op == OPCODE_CMN;
+}
+
+static inline bool writes_rd(u8 op) { return op < OPCODE_TST || op > OPCODE_CMN; }
+
+static inline bool reads_rn(u8 op) { return op != OPCODE_MOV && op != OPCODE_MVN; }
+
+// R15 reads are constants
+static inline u32 reg(u8 r) { return r == 15 ? 0 : 1 << r; }
+
+// Flags a condition code reads
+static u32 condition_flags(u8 cond)
+{
+	switch (cond)
+	{
+	// EQ NE MI PL
+	case 0x0: case 0x1: case 0x4: case 0x5: return FLAG_NZ;
+	// CS CC
+	case 0x2: case 0x3: return FLAG_C;
+	// VS VC
+	case 0x6: case 0x7: return FLAG_V;
+	// HI LS
+	case 0x8: case 0x9: return FLAG_NZ | FLAG_C;
+	// GE LT GT LE
+	case 0xA: case 0xB: case 0xC: case 0xD: return FLAG_NZ | FLAG_V;
+	default: return 0;
+	}
+}
+
+bool IdleLoop::get_access(const DecodedInstruction& data, Access& access)
+{
+	if (data.Cond != COND_AL)
+		return false;
+
+	switch ((ARMInstruction::Type)data.type)
+	{
+	case ARMInstruction::Type::DataProc_Imm:
+	case ARMInstruction::Type::DataProc_Reg_ShImm:
+	case ARMInstruction::Type::DataProc_Reg_ShReg:
+	{
+		if (writes_rd(data.Op) && data.Rd == 15)
+			return false;
+		if (reads_rn(data.Op)) access.reads |= reg(data.Rn);
+		if (writes_rd(data.Op)) access.writes |= reg(data.Rd);
+
+		// does the shifter carry out differ from C, does the operand read C
+		bool shifter_carry;
+		if (data.type == (u8)ARMInstruction::Type::DataProc_Imm)
+			shifter_carry = data.Shift != 0;
+		else if (data.type == (u8)ARMInstruction::Type::DataProc_Reg_ShImm)
+		{
+			access.reads |= reg(data.Rm);
+			shifter_carry = data.Typ != SHIFT_LSL || data.Shift != 0;
+			if (data.Typ == SHIFT_ROR && data.Shift == 0) access.reads |= FLAG_C; // RRX
+		}
+		else
+		{
+			// a zero shift amount keeps C
+			access.reads |= reg(data.Rm) | reg(data.Rs) | FLAG_C;
+			shifter_carry = true;
+		}
+
+		if (data.Op == OPCODE_ADC || data.Op == OPCODE_SBC || data.Op == OPCODE_RSC)
+			access.reads |= FLAG_C;
+		if (data.S)
+		{
+			if (is_arithmetic(data.Op)) access.writes |= FLAG_NZ | FLAG_C | FLAG_V;
+			else access.writes |= FLAG_NZ | (shifter_carry ? FLAG_C : 0);
+		}
+		return true;
+	}
+	case ARMInstruction::Type::TransImm9:
+	case ARMInstruction::Type::TransReg9:
+	case ARMInstruction::Type::TransImm10:
+	case ARMInstruction::Type::TransReg10:
+	{
+		// loads only, without write back
+		if (!data.L || !data.P || data.W || data.Rd == 15)
+			return false;
+		access.reads |= reg(data.Rn);
+		if (data.type == (u8)ARMInstruction::Type::TransReg9 || data.type == (u8)ARMInstruction::Type::TransReg10)
+			access.reads |= reg(data.Rm);
+		access.writes |= reg(data.Rd);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+bool IdleLoop::detect(const DecodedBlock& block)
+{
+	if (block.thumb || block.instructions.empty())
+		return false;
+
+	const DecodedInstruction& branch = block.instructions.back();
+	if (branch.type != (u8)ARMInstruction::Type::B_BL_BLX_Offset || branch.L)
+		return false;
+	u32 offset = (u32)((s32)(branch.Offset << 8) >> 8) << 2;
+	if (branch.address + 8 + offset != block.address)
+		return false;
+
+	// a resource read before this pass writes it must not be written later on:
+	// otherwise its value comes from the previous pass
+	u32 written = 0, read_first = 0;
+	for (size_t i = 0; i + 1 < block.instructions.size(); i++)
+	{
+		Access access;
+		if (!get_access(block.instructions[i], access))
+			return false;
+		read_first |= access.reads & ~written;
+		written |= access.writes;
+	}
+	read_first |= condition_flags(branch.Cond) & ~written;
+	return (read_first & written) == 0;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include "BlockCache.h"
+
+/// <summary>
+/// Recognizes blocks that poll memory in a loop without side effects, such as a wait on VCOUNT
+/// or on an interrupt flag in IWRAM. Such a loop reads the same values on every pass until an
+/// event changes memory, so the CPU can sleep up to the next scheduler deadline instead.
+/// </summary>
+class IdleLoop
+{
+private:
+	/// <summary>
+	/// Register file (bits 0-14) and flag (NZ, C, V) resources an instruction reads and writes
+	/// </summary>
+	struct Access
+	{
+		u32 reads = 0, writes = 0;
+	};
+
+	/// <summary>
+	/// Resources of a loop body instruction; false if it has side effects or may leave the loop
+	/// </summary>
+	static bool get_access(const DecodedInstruction& data, Access& access);
+public:
+	/// <summary>
+	/// Tells whether block ends in a branch back to its start and runs the same way on every pass:
+	/// no stores, no writes to R15 and no register or flag carried over from the previous pass
+	/// </summary>
+	static bool detect(const DecodedBlock& block);
+};
@@ -0,0 +1,67 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+MappedFile::MappedFile(const std::string& filename)
+{
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+	file_handle = file;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+		return;
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr)
+		return;
+	mapping_handle = mapping;
+
+	data = (const u8*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data != nullptr)
+		size = (u64)file_size.QuadPart;
+}
+
+MappedFile::~MappedFile()
+{
+	if (data != nullptr) UnmapViewOfFile(data);
+	if (mapping_handle != nullptr) CloseHandle((HANDLE)mapping_handle);
+	if (file_handle != nullptr) CloseHandle((HANDLE)file_handle);
+}
+
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string& filename)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+	{
+		void* mapping = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping != MAP_FAILED)
+		{
+			data = (const u8*)mapping;
+			size = (u64)st.st_size;
+		}
+	}
+	// the mapping keeps the file referenced
+	close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+	if (data != nullptr) munmap((void*)data, (size_t)size);
+}
+
+#endif
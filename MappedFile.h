@@ -0,0 +1,28 @@
+#pragma once
+#include "Types.h"
+#include <string>
+
+/// <summary>
+/// Read-only memory mapping of a whole file
+/// </summary>
+class MappedFile
+{
+private:
+	const u8* data = nullptr;
+	u64 size = 0;
+#ifdef _WIN32
+	void* file_handle = nullptr;
+	void* mapping_handle = nullptr;
+#endif
+public:
+	MappedFile(const std::string& filename);
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool is_open() const { return data != nullptr; }
+	const u8* get_data() const { return data; }
+	u64 get_size() const { return size; }
+
+	~MappedFile();
+};
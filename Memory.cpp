@@ -1,7 +1,230 @@
 #include "Memory.h"
+#include "BlockCache.h"
+#include "Dma.h"
+#include "RomImage.h"
 #include <string.h>
 #include <fstream>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MEMORY_SSE2
+#endif
+
+Memory::Memory(bool huge_pages) : arena(ARENA_SIZE, huge_pages)
+{
+	build_rom_pages();
+	build_page_tables();
+	build_wait_states();
+}
+
+// Game Pak wait states selected by WAITCNT (gbatek "GBA System Control")
+static const u8 WAIT_N[4] = { 4, 3, 2, 8 };
+static const u8 WAIT_S[3][2] = { { 2, 1 }, { 4, 1 }, { 8, 1 } };
+
+void Memory::build_wait_states()
+{
+	// 16-bit and 32-bit cost of the internal regions; EWRAM, palette and VRAM have a 16-bit bus
+	static const u8 INTERNAL[8][2] =
+	{
+		{ 1, 1 }, { 1, 1 }, { 3, 6 }, { 1, 1 }, { 1, 1 }, { 1, 2 }, { 1, 2 }, { 1, 1 },
+	};
+	for (int region = 0; region < 8; region++)
+		for (int word = 0; word < 2; word++)
+			access_cycles[0][word][region] = access_cycles[1][word][region] = INTERNAL[region][word];
+
+	u16 waitcnt = buff_IO[WAITCNT_OFFSET - IO_OFFSET] | (buff_IO[WAITCNT_OFFSET - IO_OFFSET + 1] << 8);
+	for (int state = 0; state < 3; state++)
+	{
+		// the Game Pak bus is 16 bits wide: a 32-bit access is a 16-bit one followed by a sequential one
+		u8 n = 1 + WAIT_N[(waitcnt >> (2 + state * 3)) & 3];
+		u8 s = 1 + WAIT_S[state][(waitcnt >> (4 + state * 3)) & 1];
+		for (int region = 0x8 + state * 2; region < 0xA + state * 2; region++)
+		{
+			access_cycles[0][0][region] = n;
+			access_cycles[1][0][region] = s;
+			access_cycles[0][1][region] = n + s;
+			access_cycles[1][1][region] = s + s;
+		}
+	}
+
+	// SRAM has an 8-bit bus and no sequential access
+	u8 sram = 1 + WAIT_N[waitcnt & 3];
+	for (int region = 0xE; region < 0x10; region++)
+		for (int sequential = 0; sequential < 2; sequential++)
+			access_cycles[sequential][0][region] = access_cycles[sequential][1][region] = sram;
+
+	prefetch_enabled = (waitcnt >> 14) & 1;
+}
+
+void Memory::update_wait_states()
+{
+	build_wait_states();
+	if (block_cache) block_cache->clear();
+}
+
+void Memory::build_rom_pages()
+{
+	for (u32 page = 0; page < ROM_PAGES; page++)
+		rom_pages[page] = rom_image ? rom_image->page(page) : RomImage::padding_page();
+	bios_page = bios_image ? bios_image->page(0) : RomImage::padding_page();
+}
+
+void Memory::map_ROM(std::shared_ptr<const RomImage> image)
+{
+	if (image->get_size() > ROM_SIZE)
+		throw InvalidMemoryAccess("ROM size must not be greater than 32MB");
+
+	rom_image = std::move(image);
+	u32 rom_length = (u32)rom_image->get_size();
+	u8* data = (u8*)rom_image->get_data();
+	u32 upper_length = rom_length > ROM_SIZE / 2 ? rom_length - ROM_SIZE / 2 : 0;
+	for (u32 zone_index = 0x8; zone_index <= 0xD; zone_index += 2)
+	{
+		mem_map[zone_index].size = rom_length;
+		mem_map[zone_index].buffer = data;
+		mem_map[zone_index + 1].size = upper_length;
+		mem_map[zone_index + 1].buffer = data + ROM_SIZE / 2;
+	}
+
+	build_rom_pages();
+	build_page_tables();
+	if (block_cache) block_cache->clear();
+}
+
+void Memory::map_BIOS(std::shared_ptr<const RomImage> image)
+{
+	if (image->get_size() > BIOS_SIZE)
+		throw InvalidMemoryAccess("BIOS size must not be greater than 16KB");
+
+	bios_image = std::move(image);
+	mem_map[0].size = (u32)bios_image->get_size();
+	mem_map[0].buffer = (u8*)bios_image->get_data();
+
+	build_rom_pages();
+	build_page_tables();
+	if (block_cache) block_cache->clear();
+}
+
+void Memory::build_page_tables()
+{
+	for (u32 page = 0; page < PAGE_COUNT; page++)
+	{
+		u32 offset = page << PAGE_SHIFT;
+		u32 zone_index = offset >> 24;
+		read_pages[page] = 0;
+
+		// regions smaller than a page are resolved by the slow path
+		if (mem_map[zone_index].buffer == nullptr || mem_map[zone_index].size < PAGE_SIZE)
+			continue;
+
+		u8* host = nullptr;
+		if (access_mode == AccessMode::Strict)
+		{
+			u32 relative_offset = offset - mem_map[zone_index].zone;
+			if (relative_offset < mem_map[zone_index].size)
+				host = is_read_only(offset) ? mirror_pointer(offset) : mem_map[zone_index].buffer + relative_offset;
+		}
+		else
+		{
+			host = mirror_pointer(offset);
+		}
+
+		if (host != nullptr)
+			read_pages[page] = (uintptr_t)host - offset;
+	}
+
+	for (u32 page = 0; page < PAGE_COUNT; page++)
+	{
+		write_pages[page] = is_read_only(page << PAGE_SHIFT) ? 0 : read_pages[page];
+	}
+}
+
+void Memory::set_page_writable(u32 offset, bool writable)
+{
+	if (offset >= BUS_SIZE || read_pages[offset >> PAGE_SHIFT] == 0)
+		return;
+
+	// every mirror of the page within the zone shares the same host memory
+	u32 target_page = offset >> PAGE_SHIFT;
+	uintptr_t host = read_pages[target_page] + (target_page << PAGE_SHIFT);
+	u32 first_page = (offset & 0x0F000000) >> PAGE_SHIFT;
+	u32 last_page = first_page + (0x01000000 >> PAGE_SHIFT);
+	for (u32 page = first_page; page < last_page; page++)
+	{
+		if (read_pages[page] + (page << PAGE_SHIFT) == host)
+			write_pages[page] = writable ? read_pages[page] : 0;
+	}
+}
+
+void Memory::protect_code_page(u32 offset)
+{
+	set_page_writable(offset, false);
+}
+
+void Memory::set_access_mode(AccessMode mode)
+{
+	access_mode = mode;
+	build_page_tables();
+}
+
+u8* Memory::mirror_pointer(u32 offset) const
+{
+	if (offset >= BUS_SIZE)
+		return nullptr;
+
+	u32 zone_index = offset >> 24;
+	u32 relative_offset = offset & 0x00FFFFFF;
+	switch (zone_index)
+	{
+	case 0x0: return relative_offset < BIOS_SIZE ? (u8*)bios_page + relative_offset : nullptr;
+	case 0x1: return nullptr;
+	case 0x2: return buff_EWRAM + (relative_offset & (EWRAM_SIZE - 1));
+	case 0x3: return buff_IWRAM + (relative_offset & (IWRAM_SIZE - 1));
+	case 0x4: return relative_offset < IO_SIZE ? buff_IO + relative_offset : nullptr;
+	case 0x5: return buff_PAL + (relative_offset & (PAL_SIZE - 1));
+	case 0x6:
+		// 128KB mirrors, the upper 32KB repeating the OBJ tiles at 0x10000
+		relative_offset &= 0x1FFFF;
+		if (relative_offset >= VRAM_SIZE) relative_offset -= 0x8000;
+		return buff_VRAM + relative_offset;
+	case 0x7: return buff_OAM + (relative_offset & (OAM_SIZE - 1));
+	case 0xE:
+	case 0xF: return buff_SRAM + (relative_offset & (SRAM_SIZE - 1));
+	default:
+		// Game Pak ROM wait states 0-2
+		relative_offset = (offset - ROM0_OFFSET) & (ROM_SIZE - 1);
+		return (u8*)rom_pages[relative_offset >> PAGE_SHIFT] + (relative_offset & (PAGE_SIZE - 1));
+	}
+}
+
+void Memory::record_fault(u32 offset, u8 width, bool write) const
+{
+	fault_count++;
+	if (fault_log != nullptr)
+	{
+		fault_log[fault_log_next++ % fault_log_capacity] = { offset, width, write };
+	}
+}
+
+void Memory::set_fault_log_capacity(u32 capacity)
+{
+	delete[] fault_log;
+	fault_log = capacity > 0 ? new MemoryFault[capacity] : nullptr;
+	fault_log_capacity = capacity;
+	fault_log_next = 0;
+}
+
+u32 Memory::get_fault_log_size() const
+{
+	return fault_log_next < fault_log_capacity ? fault_log_next : fault_log_capacity;
+}
+
+const MemoryFault& Memory::get_fault(u32 index) const
+{
+	u32 first = fault_log_next - get_fault_log_size();
+	return fault_log[(first + index) % fault_log_capacity];
+}
+
 u8* Memory::validate_offset(u32 offset) const
 {
 	if (offset & 0xF0000000)
@@ -18,89 +241,354 @@ u8* Memory::validate_offset(u32 offset) const
 	return mem_map[zone_index].buffer + relative_offset;
 }
 
-u8* Memory::validate_range(u32 offset1, u32 offset2) const
+u8* Memory::resolve_range(u32 offset1, u32 offset2, const char*& error) const
 {
 	if (offset1 >= offset2)
 	{
-		throw InvalidMemoryAccess("Reversed interval");
+		error = "Reversed interval";
+		return nullptr;
 	}
 	if ((offset1 | offset2) & 0xF0000000)
 	{
-		throw InvalidMemoryAccess("Upper 4bits of address bus unused");
+		error = "Upper 4bits of address bus unused";
+		return nullptr;
 	}
 	u32 zone_index = (offset1 & 0x0F000000) >> 24;	
 	u32 zone_index2 = (offset2 & 0x0F000000) >> 24;	
 	if (zone_index != zone_index2 && (zone_index >= 8 && zone_index2 < 14 && zone_index % 2 == 0 && zone_index2 - zone_index != 1))
 	{
-		throw InvalidMemoryAccess("Range in different memmory zones");
+		error = "Range in different memmory zones";
+		return nullptr;
 	}
 	u32 relative_offset1 = offset1 - mem_map[zone_index].zone;
 	if (relative_offset1 >= mem_map[zone_index].size)
 	{
-		throw InvalidMemoryAccess("Offset out of zone");
+		error = "Offset out of zone";
+		return nullptr;
 	}
 	u32 relative_offset2 = offset2 - mem_map[zone_index].zone;
 	if (relative_offset2 >= mem_map[zone_index].size)
 	{
-		throw InvalidMemoryAccess("Offset out of zone");
+		error = "Offset out of zone";
+		return nullptr;
 	}
 	return mem_map[zone_index].buffer + relative_offset1;
 }
 
-u16 Memory::get16(u32 offset) const
+u8* Memory::validate_range(u32 offset1, u32 offset2) const
+{
+	const char* error = nullptr;
+	u8* result = resolve_range(offset1, offset2, error);
+	if (result == nullptr)
+	{
+		throw InvalidMemoryAccess(error);
+	}
+	return result;
+}
+
+u8 Memory::slow_get8(u32 offset) const
+{
+	if (access_mode == AccessMode::Strict)
+		return *validate_offset(offset);
+
+	if (u8* ptr = mirror_pointer(offset))
+		return *ptr;
+	record_fault(offset, 1, false);
+	return (u8)(open_bus >> ((offset & 3) << 3));
+}
+
+u16 Memory::slow_get16(u32 offset) const
+{
+	if (access_mode == AccessMode::Strict)
+		return *((u16*)validate_offset(offset));
+
+	if (u8* ptr = mirror_pointer(offset))
+		return *((u16*)ptr);
+	record_fault(offset, 2, false);
+	return (u16)(open_bus >> ((offset & 2) << 3));
+}
+
+u32 Memory::slow_get32(u32 offset) const
+{
+	if (access_mode == AccessMode::Strict)
+		return *((u32*)validate_offset(offset));
+
+	if (u8* ptr = mirror_pointer(offset))
+		return *((u32*)ptr);
+	record_fault(offset, 4, false);
+	return open_bus;
+}
+
+void Memory::write_byte(u32 offset, u8 byte)
+{
+	if (is_read_only(offset))
+	{
+		if (access_mode == AccessMode::Strict)
+			throw InvalidMemoryAccess("ROM is read-only", offset);
+		record_fault(offset, 1, true);
+		return;
+	}
+
+	u8* ptr = access_mode == AccessMode::Strict ? validate_offset(offset) : mirror_pointer(offset);
+	if (ptr == nullptr)
+	{
+		record_fault(offset, 1, true);
+		return;
+	}
+
+	*ptr = byte;
+	if ((offset & ~1) == WAITCNT_OFFSET)
+		wait_states_written = true;
+	else if (offset == HALTCNT_OFFSET)
+		halt_requested = true;
+	else if (dma && offset - Dma::REGISTERS_OFFSET < Dma::REGISTERS_SIZE)
+		dma->register_written(offset);
+	invalidate_code(offset, offset + 1);
+}
+
+void Memory::slow_set8(u32 offset, u8 byte)
+{
+	write_byte(offset, byte);
+	end_store();
+}
+
+void Memory::slow_set16(u32 offset, u16 value)
+{
+	if (access_mode == AccessMode::Lenient && (is_read_only(offset) || mirror_pointer(offset) == nullptr))
+	{
+		record_fault(offset, 2, true);
+		return;
+	}
+	write_byte(offset, (u8)value);
+	write_byte(offset + 1, (u8)(value >> 8));
+	end_store();
+}
+
+void Memory::slow_set32(u32 offset, u32 value)
+{
+	if (access_mode == AccessMode::Lenient && (is_read_only(offset) || mirror_pointer(offset) == nullptr))
+	{
+		record_fault(offset, 4, true);
+		return;
+	}
+	for (u32 i = 0; i < 4; i++)
+		write_byte(offset + i, (u8)(value >> (i << 3)));
+	end_store();
+}
+
+// Bytes per zone that map to one contiguous piece of host memory: the mirror size,
+// the 32KB halves of the VRAM mirror, the ROM pages
+static const u32 HOST_SPAN[16] =
 {
-	return *((u16*)validate_offset(offset));
+	Memory::BIOS_SIZE, 0x01000000, Memory::EWRAM_SIZE, Memory::IWRAM_SIZE,
+	Memory::IO_SIZE, Memory::PAL_SIZE, 0x8000, Memory::OAM_SIZE,
+	Memory::PAGE_SIZE, Memory::PAGE_SIZE, Memory::PAGE_SIZE, Memory::PAGE_SIZE,
+	Memory::PAGE_SIZE, Memory::PAGE_SIZE, Memory::SRAM_SIZE, Memory::SRAM_SIZE,
+};
+
+u32 Memory::host_span(u32 offset, u32 size, bool write, u8*& host) const
+{
+	if (offset >= BUS_SIZE)
+	{
+		host = nullptr;
+		return size;
+	}
+
+	u32 zone_index = offset >> 24;
+	u32 span = HOST_SPAN[zone_index];
+	u32 length = span - (offset & (span - 1));
+	if (length > size) length = size;
+
+	if (write && (is_read_only(offset) || zone_index == 0x4))
+	{
+		// ROM drops the writes, IO registers have side effects: both take the slow path
+		host = nullptr;
+	}
+	else if (access_mode == AccessMode::Strict)
+	{
+		u32 relative_offset = offset - mem_map[zone_index].zone;
+		bool inside = relative_offset < mem_map[zone_index].size && length <= mem_map[zone_index].size - relative_offset;
+		host = inside ? mem_map[zone_index].buffer + relative_offset : nullptr;
+	}
+	else
+	{
+		host = mirror_pointer(offset);
+	}
+	return length;
 }
 
-u32 Memory::get32(u32 offset) const
+void Memory::invalidate_code(u32 offset1, u32 offset2)
 {
-	return *((u32*)validate_offset(offset));
+	if (block_cache == nullptr)
+		return;
+	block_cache->invalidate(offset1, offset2);
+	// lift the protection of the pages that hold no decoded code anymore
+	for (u64 page_offset = offset1 & ~(PAGE_SIZE - 1); page_offset < offset2; page_offset += PAGE_SIZE)
+	{
+		if (!block_cache->has_code((u32)page_offset, (u32)page_offset + PAGE_SIZE))
+			set_page_writable((u32)page_offset, true);
+	}
 }
 
-u8 Memory::operator[](u32 offset) const
+// Stores the 32-bit pattern over size bytes, 16 bytes a store where the host has SSE2
+static void fill_host(u8* dest, u32 size, u32 pattern)
 {
-	return *validate_offset(offset);
+#ifdef MEMORY_SSE2
+	__m128i wide = _mm_set1_epi32((int)pattern);
+	for (; size >= 64; size -= 64, dest += 64)
+	{
+		_mm_storeu_si128((__m128i*)dest, wide);
+		_mm_storeu_si128((__m128i*)(dest + 16), wide);
+		_mm_storeu_si128((__m128i*)(dest + 32), wide);
+		_mm_storeu_si128((__m128i*)(dest + 48), wide);
+	}
+	for (; size >= 16; size -= 16, dest += 16)
+		_mm_storeu_si128((__m128i*)dest, wide);
+#endif
+	for (; size >= 4; size -= 4, dest += 4)
+		memcpy(dest, &pattern, 4);
+	for (; size > 0; size--, pattern >>= 8)
+		*(dest++) = (u8)pattern;
 }
 
-void Memory::set_at(u32 offset, u8 byte)
+void Memory::read(u32 offset, void* data, u32 size) const
 {
-	*validate_offset(offset) = byte;
+	u8* dest = (u8*)data;
+	while (size > 0)
+	{
+		u8* source;
+		u32 length = host_span(offset, size, false, source);
+		if (source != nullptr)
+			memcpy(dest, source, length);
+		else
+		{
+			for (u32 i = 0; i < length; i++)
+				dest[i] = (*this)[offset + i];
+		}
+		offset += length;
+		dest += length;
+		size -= length;
+	}
 }
 
 void Memory::write(u32 offset, const void* data, u32 size)
 {
-	u8* dest = validate_range(offset, offset + size - 1);
-	memcpy(dest, data, size);
+	const u8* source = (const u8*)data;
+	while (size > 0)
+	{
+		u8* dest;
+		u32 length = host_span(offset, size, true, dest);
+		if (dest != nullptr)
+		{
+			memcpy(dest, source, length);
+			invalidate_code(offset, offset + length);
+		}
+		else
+		{
+			for (u32 i = 0; i < length; i++)
+				write_byte(offset + i, source[i]);
+		}
+		offset += length;
+		source += length;
+		size -= length;
+	}
+	end_store();
 }
 
 void Memory::fill(u32 offset1, u32 offset2, u32 value)
 {
-	u32* dest = (u32*)validate_range(offset1, offset2-1);
-	int n_dwords = (offset2 - offset1)/4;
-	if (n_dwords > 0)
+	u32 offset = offset1;
+	while (offset < offset2)
+	{
+		// the pattern stays lined up with offset1 across the spans
+		u32 shift = ((offset - offset1) & 3) << 3;
+		u32 pattern = shift ? (value >> shift) | (value << (32 - shift)) : value;
+		u8* dest;
+		u32 length = host_span(offset, offset2 - offset, true, dest);
+		if (dest != nullptr)
+		{
+			fill_host(dest, length, pattern);
+			invalidate_code(offset, offset + length);
+		}
+		else
+		{
+			for (u32 i = 0; i < length; i++)
+				write_byte(offset + i, (u8)(pattern >> ((i & 3) << 3)));
+		}
+		offset += length;
+	}
+	end_store();
+}
+
+void Memory::copy(u32 source, u32 dest, u32 size)
+{
+	while (size > 0)
 	{
-		for (; n_dwords--; *(dest++) = value);
+		u8* from;
+		u8* to;
+		u32 length = host_span(source, size, false, from);
+		length = host_span(dest, length, true, to);
+		if (from != nullptr && to != nullptr)
+		{
+			memmove(to, from, length);
+			invalidate_code(dest, dest + length);
+		}
+		else
+		{
+			for (u32 i = 0; i < length; i++)
+				write_byte(dest + i, (*this)[source + i]);
+		}
+		source += length;
+		dest += length;
+		size -= length;
 	}
-	int n_bytes = (offset2 - offset1) & 3;
-	if (n_bytes == 0) return;
-	for (u8* dest8=(u8*)dest; n_bytes--;)
+	end_store();
+}
+
+bool Memory::overlaps_forward(u32 source, u32 dest, u32 size) const
+{
+	for (u32 source_index = 0; source_index < size;)
 	{
-		*(dest8++) = value & 0xFF;
-		value >>= 8;
+		u8* from;
+		u32 source_length = host_span(source + source_index, size - source_index, false, from);
+		for (u32 dest_index = 0; from != nullptr && dest_index < size;)
+		{
+			u8* to;
+			u32 dest_length = host_span(dest + dest_index, size - dest_index, true, to);
+			// where the two spans share host bytes, the byte read at source index j is the one written at
+			// dest index i, j - i being the same all over: it only gets overwritten first when j > i
+			if (to != nullptr && to < from + source_length && from < to + dest_length
+				&& (intptr_t)source_index - (intptr_t)dest_index > from - to)
+				return true;
+			dest_index += dest_length;
+		}
+		source_index += source_length;
 	}
+	return false;
+}
+
+void Memory::snapshot(void* dest) const
+{
+	memcpy(dest, arena.get_data(), ARENA_SIZE);
+}
+
+void Memory::restore(const void* source)
+{
+	memcpy(arena.get_data(), source, ARENA_SIZE);
+	// the restored code is unknown to the block cache, and so are the pages it protected
+	if (block_cache) block_cache->clear();
+	build_page_tables();
+	build_wait_states();
+}
+
+bool Memory::same_contents(const Memory& other) const
+{
+	return memcmp(arena.get_data(), other.arena.get_data(), ARENA_SIZE) == 0;
 }
 
 Memory::~Memory()
 {
-	delete[] buff_BIOS;
-	delete[] buff_IWRAM;
-	delete[] buff_EWRAM;
-	delete[] buff_IO;
-	delete[] buff_PAL;
-	delete[] buff_VRAM;
-	delete[] buff_OAM;
-	delete[] buff_ROM;
-	delete[] buff_SRAM;
+	delete[] fault_log;
 }
 
 
@@ -1,8 +1,11 @@
 #pragma once
 
 #include <exception>
+#include <cstdint>
 #include "Types.h"
+#include "GuestArena.h"
 #include <string>
+#include <memory>
 
 /*  http://problemkaputt.de/gbatek-gba-memory-map.htm
 	General Internal Memory
@@ -36,26 +39,53 @@
 	these areas are called Wait State 0-2.
 */
 
+class BlockCache;
+class Dma;
+class RomImage;
+
+enum class AccessMode
+{
+	/// <summary>
+	/// Unmapped accesses read open bus and drop writes, like the hardware does
+	/// </summary>
+	Lenient,
+	/// <summary>
+	/// Unmapped or mirrored accesses throw InvalidMemoryAccess (debugging aid)
+	/// </summary>
+	Strict
+};
+
+struct MemoryFault
+{
+	u32 offset;
+	u8 width;
+	bool write;
+};
+
 class Memory
 {
 	friend class MemoryDump;
+	friend class Dma;
 private:
-	u8* buff_BIOS = new u8[BIOS_SIZE]; 
-	u8* buff_EWRAM = new u8[EWRAM_SIZE];
-	u8* buff_IWRAM = new u8[IWRAM_SIZE];
-	u8* buff_IO = new u8[IO_SIZE];
-	u8* buff_PAL = new u8[PAL_SIZE];
-	u8* buff_VRAM = new u8[VRAM_SIZE];
-	u8* buff_OAM = new u8[OAM_SIZE];
-	u8* buff_ROM = new u8[ROM_SIZE];
-	u8* buff_SRAM = new u8[SRAM_SIZE];
+	/// <summary>
+	/// Every writable region, at the fixed *_ARENA_OFFSET positions
+	/// </summary>
+	GuestArena arena;
+
+	u8* buff_EWRAM = arena.get_data() + EWRAM_ARENA_OFFSET;
+	u8* buff_IWRAM = arena.get_data() + IWRAM_ARENA_OFFSET;
+	u8* buff_IO = arena.get_data() + IO_ARENA_OFFSET;
+	u8* buff_PAL = arena.get_data() + PAL_ARENA_OFFSET;
+	u8* buff_VRAM = arena.get_data() + VRAM_ARENA_OFFSET;
+	u8* buff_OAM = arena.get_data() + OAM_ARENA_OFFSET;
+	u8* buff_SRAM = arena.get_data() + SRAM_ARENA_OFFSET;
 
 	struct
 	{
 		u32 zone; u32 size; u8* buffer;
 	} mem_map[16] =
 	{
-		{(u32)0x00000000, BIOS_SIZE    , buff_BIOS},
+		{(u32)0x00000000, 0            , nullptr},
 		{(u32)0x01000000, 0            , nullptr},
 		{(u32)0x02000000, EWRAM_SIZE   , buff_EWRAM},
 		{(u32)0x03000000, IWRAM_SIZE   , buff_IWRAM},
@@ -63,30 +93,301 @@ private:
 		{(u32)0x05000000, PAL_SIZE     , buff_PAL},
 		{(u32)0x06000000, VRAM_SIZE    , buff_VRAM},
 		{(u32)0x07000000, OAM_SIZE     , buff_OAM},
-		{(u32)0x08000000, ROM_SIZE     , buff_ROM},
-		{(u32)0x09000000, ROM_SIZE / 2 , buff_ROM + ROM_SIZE / 2},
-		{(u32)0x0A000000, ROM_SIZE     , buff_ROM},
-		{(u32)0x0B000000, ROM_SIZE / 2 , buff_ROM + ROM_SIZE / 2},
-		{(u32)0x0C000000, ROM_SIZE     , buff_ROM},
-		{(u32)0x0D000000, ROM_SIZE / 2 , buff_ROM + ROM_SIZE / 2},
+		{(u32)0x08000000, 0            , nullptr},
+		{(u32)0x09000000, 0            , nullptr},
+		{(u32)0x0A000000, 0            , nullptr},
+		{(u32)0x0B000000, 0            , nullptr},
+		{(u32)0x0C000000, 0            , nullptr},
+		{(u32)0x0D000000, 0            , nullptr},
 		{(u32)0x0E000000, SRAM_SIZE    , buff_SRAM},
 		{(u32)0x0F000000, 0            , nullptr},
 	};
+
+	/// <summary>
+	/// Notified of writes to code-bearing memory (EWRAM/IWRAM)
+	/// </summary>
+	BlockCache* block_cache = nullptr;
+
+	/// <summary>
+	/// Notified of writes to the DMA registers
+	/// </summary>
+	Dma* dma = nullptr;
+
+public:
+	static const u32 PAGE_SHIFT = 14;
+	static const u32 PAGE_SIZE = 1 << PAGE_SHIFT;
+	static const u32 BUS_SIZE = (u32)0x10000000;
+	static const u32 PAGE_COUNT = BUS_SIZE >> PAGE_SHIFT;
+
+private:
+	/// <summary>
+	/// Per 16KB page: host address of the page minus its guest address, so that
+	/// host pointer = entry + offset. 0 sends the access to the slow path
+	/// (IO, palette, OAM, unmapped areas, code-bearing pages for writes).
+	/// </summary>
+	uintptr_t read_pages[PAGE_COUNT];
+	uintptr_t write_pages[PAGE_COUNT];
+
+	AccessMode access_mode = AccessMode::Lenient;
+
+	/// <summary>
+	/// Last value seen on the bus, returned by reads of unmapped memory
+	/// </summary>
+	u32 open_bus = 0;
+
+	mutable u64 fault_count = 0;
+	MemoryFault* fault_log = nullptr;
+	u32 fault_log_capacity = 0;
+	mutable u32 fault_log_next = 0;
+
+	void build_page_tables();
+	void set_page_writable(u32 offset, bool writable);
+
+	/// <summary>
+	/// Cycles of one access, by [sequential][32-bit][region (offset bits 24-27)]; 8 and 16-bit accesses cost the same
+	/// </summary>
+	u8 access_cycles[2][2][16];
+	bool prefetch_enabled = false;
+
+	/// <summary>
+	/// Set by a guest write to HALTCNT until the CPU takes it
+	/// </summary>
+	bool halt_requested = false;
+
+	/// <summary>
+	/// Set when a byte of WAITCNT was written; the new wait states apply once the whole store is done
+	/// </summary>
+	bool wait_states_written = false;
+
+	/// <summary>
+	/// Rebuilds access_cycles from WAITCNT
+	/// </summary>
+	void build_wait_states();
+
+	/// <summary>
+	/// Applies a new WAITCNT; decoded blocks carry fetch costs, so they are dropped
+	/// </summary>
+	void update_wait_states();
+
+	/// <summary>
+	/// Ends a store through write_byte: applies WAITCNT if it changed
+	/// </summary>
+	inline void end_store()
+	{
+		if (wait_states_written)
+		{
+			wait_states_written = false;
+			update_wait_states();
+		}
+	}
+
+	/// <summary>
+	/// Resolves offset the way the hardware mirrors it, nullptr for open bus
+	/// </summary>
+	u8* mirror_pointer(u32 offset) const;
+	u8* resolve_range(u32 offset1, u32 offset2, const char*& error) const;
+
+	/// <summary>
+	/// Splits off the start of [offset, offset + size) that maps to contiguous host memory, up to the next
+	/// mirror or page boundary, and returns its length. host points to it, or is nullptr when the bytes take
+	/// the slow path: unmapped, mirrored in Strict mode, or ROM and IO registers for writes.
+	/// </summary>
+	u32 host_span(u32 offset, u32 size, bool write, u8*& host) const;
+
+	/// <summary>
+	/// Drops the blocks decoded from [offset1, offset2) and unprotects the pages left without code
+	/// </summary>
+	void invalidate_code(u32 offset1, u32 offset2);
+
+	void record_fault(u32 offset, u8 width, bool write) const;
+
+	inline static u8* page_pointer(const uintptr_t* pages, u32 offset)
+	{
+		if (offset >= BUS_SIZE) return nullptr;
+		uintptr_t page = pages[offset >> PAGE_SHIFT];
+		return page ? (u8*)(page + offset) : nullptr;
+	}
+
+	u8 slow_get8(u32 offset) const;
+	u16 slow_get16(u32 offset) const;
+	u32 slow_get32(u32 offset) const;
+
+	/// <summary>
+	/// Writes one byte with its side effects, except the WAITCNT update that waits for end_store
+	/// </summary>
+	void write_byte(u32 offset, u8 value);
+	void slow_set8(u32 offset, u8 value);
+	void slow_set16(u32 offset, u16 value);
+	void slow_set32(u32 offset, u32 value);
 	
 public:
+	/// <summary>
+	/// huge_pages asks the host for huge pages behind the guest arena
+	/// </summary>
+	Memory(bool huge_pages = false);
+
 	u8* validate_offset(u32 offset) const;
 	u8* validate_range(u32 offset1, u32 offset2) const;
 
-	u8 operator[](u32) const;	
+	inline u8 operator[](u32 offset) const
+	{
+		if (u8* ptr = page_pointer(read_pages, offset)) return *ptr;
+		return slow_get8(offset);
+	}
+
+	inline u16 get16(u32 offset) const
+	{
+		if (u8* ptr = page_pointer(read_pages, offset)) return *(u16*)ptr;
+		return slow_get16(offset);
+	}
+
+	inline u32 get32(u32 offset) const
+	{
+		if (u8* ptr = page_pointer(read_pages, offset)) return *(u32*)ptr;
+		return slow_get32(offset);
+	}
+
+	inline void set_at(u32 offset, u8 value)
+	{
+		if (u8* ptr = page_pointer(write_pages, offset)) *ptr = value;
+		else slow_set8(offset, value);
+	}
+
+	inline void set16(u32 offset, u16 value)
+	{
+		if (u8* ptr = page_pointer(write_pages, offset)) *(u16*)ptr = value;
+		else slow_set16(offset, value);
+	}
+
+	inline void set32(u32 offset, u32 value)
+	{
+		if (u8* ptr = page_pointer(write_pages, offset)) *(u32*)ptr = value;
+		else slow_set32(offset, value);
+	}
+
+	/// <summary>
+	/// Page table entry (host address minus guest address) covering all of [offset1, offset2],
+	/// or 0 if the span leaves its page or the page takes the slow path
+	/// </summary>
+	inline uintptr_t page_entry(u32 offset1, u32 offset2, bool write) const
+	{
+		if (offset2 >= BUS_SIZE || offset1 > offset2 || (offset1 >> PAGE_SHIFT) != (offset2 >> PAGE_SHIFT)) return 0;
+		return (write ? write_pages : read_pages)[offset1 >> PAGE_SHIFT];
+	}
+
+	/// <summary>
+	/// Cycles taken by an access at offset, non-sequential (N) or sequential (S)
+	/// </summary>
+	inline u32 access_time(u32 offset, bool word, bool sequential) const
+	{
+		return access_cycles[sequential][word][(offset >> 24) & 0xF];
+	}
+
+	/// <summary>
+	/// WAITCNT bit 14: the Game Pak prefetch buffer fetches ahead while the CPU is busy elsewhere
+	/// </summary>
+	bool is_prefetch_enabled() const { return prefetch_enabled; }
 
-	u16 get16(u32 offset) const;
-	u32 get32(u32 offset) const;
+	/// <summary>
+	/// Tells whether HALTCNT was written since the last call
+	/// </summary>
+	inline bool take_halt_request()
+	{
+		bool requested = halt_requested;
+		halt_requested = false;
+		return requested;
+	}
 
-	void set_at(u32 offset, u8 value);
+	/// <summary>
+	/// Sends writes to the page holding offset through the slow path, so that the block cache sees them
+	/// </summary>
+	void protect_code_page(u32 offset);
 
+	/// <summary>
+	/// Bulk transfers. They split at region and mirror boundaries and move each span that maps to host memory
+	/// in one go; IO registers, ROM and unmapped bytes go one at a time through the regular accessors.
+	/// Writes drop the decoded blocks they cover.
+	/// </summary>
+	void read(u32 offset, void* data, u32 size) const;
 	void write(u32 offset, const void* data, u32 size);
+
+	/// <summary>
+	/// Repeats the 32-bit value over [offset1, offset2), its low byte at offset1
+	/// </summary>
 	void fill(u32 offset1, u32 offset2, u32 value);
 
+	/// <summary>
+	/// Copies size bytes between guest addresses, for DMA and the BIOS copy calls. Overlapping spans copy
+	/// like memmove; callers that need the forward unit-by-unit result step those themselves.
+	/// </summary>
+	void copy(u32 source, u32 dest, u32 size);
+
+	/// <summary>
+	/// Tells whether copying forward from source to dest would write over source bytes before reading them.
+	/// Compares the host memory behind both ranges, so mirrors of the same RAM count as overlapping.
+	/// </summary>
+	bool overlaps_forward(u32 source, u32 dest, u32 size) const;
+
+	/// <summary>
+	/// Serves the Game Pak ROM from a shared read-only image.
+	/// Reads past the end of the image return 0xFF, writes to ROM are dropped.
+	/// </summary>
+	void map_ROM(std::shared_ptr<const RomImage> image);
+
+	/// <summary>
+	/// Serves the BIOS from a shared read-only image, padded with 0xFF up to 16KB
+	/// </summary>
+	void map_BIOS(std::shared_ptr<const RomImage> image);
+
+	std::shared_ptr<const RomImage> get_ROM() const { return rom_image; }
+	std::shared_ptr<const RomImage> get_BIOS() const { return bios_image; }
+
+	/// <summary>
+	/// Copies every writable region (ARENA_SIZE bytes) to dest
+	/// </summary>
+	void snapshot(void* dest) const;
+
+	/// <summary>
+	/// Restores the writable regions from a buffer filled by snapshot
+	/// </summary>
+	void restore(const void* source);
+
+	/// <summary>
+	/// Tells whether the writable regions of both hold the same bytes
+	/// </summary>
+	bool same_contents(const Memory& other) const;
+
+	bool has_huge_pages() const { return arena.has_huge_pages(); }
+
+	void set_block_cache(BlockCache* cache) { block_cache = cache; }
+	void set_dma(Dma* controller) { dma = controller; }
+	BlockCache* get_block_cache() const { return block_cache; }
+
+	void set_access_mode(AccessMode mode);
+	AccessMode get_access_mode() const { return access_mode; }
+
+	void set_open_bus(u32 value) { open_bus = value; }
+
+	/// <summary>
+	/// Number of accesses that hit unmapped memory since construction
+	/// </summary>
+	u64 get_fault_count() const { return fault_count; }
+
+	/// <summary>
+	/// Keeps the last capacity faults in a ring buffer; 0 disables the log
+	/// </summary>
+	void set_fault_log_capacity(u32 capacity);
+
+	/// <summary>
+	/// Number of faults currently held by the log
+	/// </summary>
+	u32 get_fault_log_size() const;
+
+	/// <summary>
+	/// index 0 is the oldest logged fault
+	/// </summary>
+	const MemoryFault& get_fault(u32 index) const;
+
 	~Memory();
 
 	
@@ -94,7 +395,7 @@ public:
 	static const u32 BIOS_SIZE = (u32)0x4000;
 	static const u32 EWRAM_SIZE = (u32)0x40000;
 	static const u32 IWRAM_SIZE = (u32)0x8000;
-	static const u32 IO_SIZE = (u32)0x3FF; // (u32)0x400?
+	static const u32 IO_SIZE = (u32)0x400;
 	static const u32 PAL_SIZE = (u32)0x400;
 	static const u32 VRAM_SIZE = (u32)0x18000;
 	static const u32 OAM_SIZE = (u32)0x400;
@@ -112,6 +413,54 @@ public:
 	static const u32 ROM1_OFFSET  = (u32)0x0A000000;
 	static const u32 ROM2_OFFSET  = (u32)0x0C000000;
 	static const u32 SRAM_OFFSET  = (u32)0x0E000000;
+
+	/// <summary>
+	/// Game Pak Waitstate Control register
+	/// </summary>
+	static const u32 WAITCNT_OFFSET = (u32)0x04000204;
+
+	/// <summary>
+	/// Power-down control: any write halts the CPU (bit 7 clear) or stops it (bit 7 set)
+	/// </summary>
+	static const u32 HALTCNT_OFFSET = (u32)0x04000301;
+
+	/// <summary>
+	/// Layout of the guest arena; the large regions come first and every region starts on a 4KB boundary
+	/// </summary>
+	static const u32 EWRAM_ARENA_OFFSET = (u32)0x00000;
+	static const u32 VRAM_ARENA_OFFSET  = (u32)0x40000;
+	static const u32 SRAM_ARENA_OFFSET  = (u32)0x58000;
+	static const u32 IWRAM_ARENA_OFFSET = (u32)0x68000;
+	static const u32 IO_ARENA_OFFSET    = (u32)0x70000;
+	static const u32 PAL_ARENA_OFFSET   = (u32)0x71000;
+	static const u32 OAM_ARENA_OFFSET   = (u32)0x72000;
+	static const u32 ARENA_SIZE         = (u32)0x73000;
+
+private:
+	static const u32 ROM_PAGES = ROM_SIZE >> PAGE_SHIFT;
+
+	/// <summary>
+	/// Host pointer of every 16KB Game Pak ROM page
+	/// </summary>
+	const u8* rom_pages[ROM_PAGES];
+	const u8* bios_page;
+
+	/// <summary>
+	/// Read-only contents shared with every other Memory using the same file
+	/// </summary>
+	std::shared_ptr<const RomImage> rom_image;
+	std::shared_ptr<const RomImage> bios_image;
+
+	void build_rom_pages();
+public:
+	/// <summary>
+	/// BIOS and Game Pak ROM; their contents only change through map_BIOS/map_ROM, which clear the block cache
+	/// </summary>
+	inline static bool is_read_only(u32 offset)
+	{
+		u32 zone_index = offset >> 24;
+		return zone_index == 0x0 || (zone_index >= 0x8 && zone_index <= 0xD);
+	}
 };
 
 class MemoryDump
@@ -0,0 +1,87 @@
+#include "RomImage.h"
+
+#include <string.h>
+#include <fstream>
+
+RomImage::RomImage(const void* source, u64 len) : size(len)
+{
+	buffer.reset(new u8[len > 0 ? (size_t)len : 1]);
+	memcpy(buffer.get(), source, (size_t)len);
+	data = buffer.get();
+	build_tail_page();
+}
+
+RomImage::RomImage(std::unique_ptr<MappedFile> file) : file(std::move(file))
+{
+	data = this->file->get_data();
+	size = this->file->get_size();
+	build_tail_page();
+}
+
+void RomImage::build_tail_page()
+{
+	u32 tail_length = (u32)size & (PAGE_SIZE - 1);
+	if (tail_length > 0)
+	{
+		tail_page.reset(new u8[PAGE_SIZE]);
+		memset(tail_page.get(), 0xFF, PAGE_SIZE);
+		memcpy(tail_page.get(), data + (size - tail_length), tail_length);
+	}
+}
+
+const u8* RomImage::page(u32 index) const
+{
+	u64 full_pages = size >> PAGE_SHIFT;
+	if (index < full_pages) return data + (index << PAGE_SHIFT);
+	if (index == full_pages && tail_page) return tail_page.get();
+	return padding_page();
+}
+
+const u8* RomImage::padding_page()
+{
+	static const u8* padding = []
+	{
+		static u8 page[PAGE_SIZE];
+		memset(page, 0xFF, PAGE_SIZE);
+		return page;
+	}();
+	return padding;
+}
+
+std::mutex ImageStore::mutex;
+std::map<std::string, std::weak_ptr<const RomImage>> ImageStore::images;
+
+std::shared_ptr<const RomImage> ImageStore::acquire(const std::string& filename)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto it = images.find(filename);
+	if (it != images.end())
+	{
+		if (auto image = it->second.lock())
+			return image;
+	}
+
+	std::shared_ptr<const RomImage> image;
+	std::unique_ptr<MappedFile> file(new MappedFile(filename));
+	if (file->is_open())
+	{
+		image = std::make_shared<const RomImage>(std::move(file));
+	}
+	else
+	{
+		// mapping unavailable (e.g. empty file): fall back to a heap copy
+		std::ifstream stream(filename, std::ios::ios_base::binary);
+		if (!stream)
+			return nullptr;
+		stream.seekg(0, std::ios::end);
+		u64 len = stream.tellg();
+		stream.seekg(0);
+		std::unique_ptr<u8[]> data(new u8[len > 0 ? (size_t)len : 1]);
+		stream.read((char*)data.get(), (std::streamsize)len);
+		image = std::make_shared<const RomImage>(data.get(), len);
+	}
+
+	images[filename] = image;
+	return image;
+}
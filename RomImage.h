@@ -0,0 +1,63 @@
+#pragma once
+#include "Types.h"
+#include "MappedFile.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/// <summary>
+/// Immutable ROM or BIOS contents, shared read-only by any number of Memory instances.
+/// The image is served in 16KB pages; bytes past its end read as 0xFF.
+/// </summary>
+class RomImage
+{
+public:
+	static const u32 PAGE_SHIFT = 14;
+	static const u32 PAGE_SIZE = 1 << PAGE_SHIFT;
+private:
+	const u8* data = nullptr;
+	/// <summary>
+	/// Full file size, kept 64-bit so the ROM / BIOS size checks see oversized files as they are
+	/// </summary>
+	u64 size = 0;
+
+	std::unique_ptr<MappedFile> file;
+	std::unique_ptr<u8[]> buffer;
+
+	/// <summary>
+	/// Copy of the last, partially filled page, padded with 0xFF
+	/// </summary>
+	std::unique_ptr<u8[]> tail_page;
+
+	void build_tail_page();
+public:
+	RomImage(const void* source, u64 len);
+	RomImage(std::unique_ptr<MappedFile> file);
+
+	RomImage(const RomImage&) = delete;
+	RomImage& operator=(const RomImage&) = delete;
+
+	const u8* get_data() const { return data; }
+	u64 get_size() const { return size; }
+
+	const u8* page(u32 index) const;
+
+	static const u8* padding_page();
+};
+
+/// <summary>
+/// Hands out one RomImage per file for as long as some Memory holds it
+/// </summary>
+class ImageStore
+{
+private:
+	static std::mutex mutex;
+	static std::map<std::string, std::weak_ptr<const RomImage>> images;
+public:
+	/// <summary>
+	/// Returns the shared image of filename, mapping the file on first use (nullptr on failure)
+	/// </summary>
+	static std::shared_ptr<const RomImage> acquire(const std::string& filename);
+};
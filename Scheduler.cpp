@@ -0,0 +1,104 @@
+#include "Scheduler.h"
+
+Scheduler::Scheduler()
+{
+	for (Slot& slot : slots)
+		slot.position = NOT_PENDING;
+}
+
+void Scheduler::place(u8 position, u8 event)
+{
+	heap[position] = event;
+	slots[event].position = position;
+}
+
+void Scheduler::sift_up(u8 position)
+{
+	u8 event = heap[position];
+	u64 deadline = slots[event].deadline;
+	while (position > 0)
+	{
+		u8 parent = (position - 1) / 2;
+		if (deadline_at(parent) <= deadline)
+			break;
+		place(position, heap[parent]);
+		position = parent;
+	}
+	place(position, event);
+}
+
+void Scheduler::sift_down(u8 position)
+{
+	u8 event = heap[position];
+	u64 deadline = slots[event].deadline;
+	for (;;)
+	{
+		u8 child = position * 2 + 1;
+		if (child >= heap_size)
+			break;
+		if (child + 1 < heap_size && deadline_at(child + 1) < deadline_at(child))
+			child++;
+		if (deadline <= deadline_at(child))
+			break;
+		place(position, heap[child]);
+		position = child;
+	}
+	place(position, event);
+}
+
+void Scheduler::remove_at(u8 position)
+{
+	u8 event = heap[position];
+	slots[event].position = NOT_PENDING;
+	slots[event].deadline = NEVER;
+
+	if (--heap_size == position)
+		return;
+	// the last event fills the hole; it may belong above or below it
+	u8 moved = heap[heap_size];
+	place(position, moved);
+	sift_down(position);
+	sift_up(slots[moved].position);
+}
+
+void Scheduler::set_handler(Event event, Handler handler, void* context)
+{
+	slots[(int)event].handler = handler;
+	slots[(int)event].context = context;
+}
+
+void Scheduler::schedule_at(Event event, u64 when)
+{
+	Slot& slot = slots[(int)event];
+	if (slot.position == NOT_PENDING)
+	{
+		slot.deadline = when;
+		place(heap_size, (u8)event);
+		sift_up(heap_size++);
+		return;
+	}
+
+	u64 previous = slot.deadline;
+	slot.deadline = when;
+	if (when < previous) sift_up(slot.position);
+	else sift_down(slot.position);
+}
+
+void Scheduler::cancel(Event event)
+{
+	u8 position = slots[(int)event].position;
+	if (position != NOT_PENDING)
+		remove_at(position);
+}
+
+void Scheduler::dispatch()
+{
+	while (heap_size > 0 && deadline_at(0) <= cycles)
+	{
+		u8 event = heap[0];
+		u64 late = cycles - slots[event].deadline;
+		remove_at(0);
+		if (slots[event].handler)
+			slots[event].handler(slots[event].context, late);
+	}
+}
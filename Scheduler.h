@@ -0,0 +1,91 @@
+#pragma once
+#include "Types.h"
+
+/// <summary>
+/// Discrete-event scheduler on the 64-bit master cycle counter. Every device keeps at most one pending
+/// deadline per event; the CPU runs freely up to the earliest one, so the per-instruction cost does not
+/// depend on how many devices are active. Pending events sit in a binary min-heap indexed by event.
+/// </summary>
+class Scheduler
+{
+public:
+	enum class Event : u8
+	{
+		HBlank,
+		VBlank,
+		Timer0,
+		Timer1,
+		Timer2,
+		Timer3,
+		DMA,
+		Serial,
+		Count
+	};
+
+	static const u32 EVENT_COUNT = (u32)Event::Count;
+	static const u64 NEVER = ~0ull;
+
+	/// <summary>
+	/// Called once the deadline passed; late is how many cycles past it the call happens,
+	/// since the CPU only stops between blocks. Periodic events reschedule from now() - late.
+	/// </summary>
+	typedef void (*Handler)(void* context, u64 late);
+
+private:
+	u64 cycles = 0;
+
+	struct Slot
+	{
+		u64 deadline = NEVER;
+		Handler handler = nullptr;
+		void* context = nullptr;
+		/// <summary>
+		/// Index in heap, NOT_PENDING when not scheduled
+		/// </summary>
+		u8 position;
+	};
+	static const u8 NOT_PENDING = 0xFF;
+
+	Slot slots[EVENT_COUNT];
+	u8 heap[EVENT_COUNT];
+	u8 heap_size = 0;
+
+	inline u64 deadline_at(u8 position) const { return slots[heap[position]].deadline; }
+
+	void place(u8 position, u8 event);
+	void sift_up(u8 position);
+	void sift_down(u8 position);
+	void remove_at(u8 position);
+
+public:
+	Scheduler();
+
+	u64 now() const { return cycles; }
+
+	/// <summary>
+	/// Moves time forward; due events wait for dispatch()
+	/// </summary>
+	inline void advance(u64 count) { cycles += count; }
+
+	/// <summary>
+	/// Earliest pending deadline, NEVER when nothing is scheduled
+	/// </summary>
+	inline u64 next_deadline() const { return heap_size ? deadline_at(0) : NEVER; }
+
+	void set_handler(Event event, Handler handler, void* context);
+
+	/// <summary>
+	/// Sets the deadline of event to the absolute cycle when, replacing a pending one
+	/// </summary>
+	void schedule_at(Event event, u64 when);
+	void schedule(Event event, u64 delay) { schedule_at(event, cycles + delay); }
+	void cancel(Event event);
+
+	bool is_scheduled(Event event) const { return slots[(int)event].position != NOT_PENDING; }
+	u64 get_deadline(Event event) const { return slots[(int)event].deadline; }
+
+	/// <summary>
+	/// Runs the handlers of every event due by now(), earliest first; handlers may schedule again
+	/// </summary>
+	void dispatch();
+};
@@ -1,4 +1,5 @@
 #include "StorageTransactions.h"
+#include "RomImage.h"
 
 #include <fstream>
 
@@ -8,31 +9,21 @@ void StorageTransactions::load_BIOS(Memory* memory, const void* source, u32 len)
 	{
 		throw ROMLoadingException("BIOS size must not be greater than 16KB");
 	}
-	memory->fill(Memory::BIOS_OFFSET, Memory::BIOS_OFFSET + Memory::BIOS_SIZE, 0xFFFFFFFF);
-	memory->write(Memory::BIOS_OFFSET, source, len);
+	memory->map_BIOS(std::make_shared<const RomImage>(source, len));
 }
 
 void StorageTransactions::load_BIOS(Memory* memory, const std::string& filename)
 {
-	std::ifstream file(filename, std::ios::ios_base::binary);
-
-	file.seekg(0, std::ios::end);
-	u64 len = file.tellg();
-	file.seekg(0);
-
-	if (len > Memory::BIOS_SIZE)
+	std::shared_ptr<const RomImage> image = ImageStore::acquire(filename);
+	if (image == nullptr)
+	{
+		throw ROMLoadingException("Failed to load BIOS");
+	}
+	if (image->get_size() > Memory::BIOS_SIZE)
 	{
-		file.close();
 		throw ROMLoadingException("BIOs size must not be greater than 16KB");
 	}
-
-	memory->fill(Memory::BIOS_OFFSET, Memory::BIOS_OFFSET + Memory::BIOS_SIZE, 0xFFFFFFFF);
-	u8* data = new u8[(u32)len];
-	file.read((char*)data, (u32)len);
-	load_BIOS(memory, data, (u32)len);
-	delete[] data;
-
-	file.close();
+	memory->map_BIOS(image);
 }
 
 void StorageTransactions::load_GBA(Memory* memory, const void* source, u32 len)
@@ -41,8 +32,7 @@ void StorageTransactions::load_GBA(Memory* memory, const void* source, u32 len)
 	{
 		throw ROMLoadingException("ROM size must not be greater than 32MB");
 	}
-	memory->fill(Memory::ROM0_OFFSET, Memory::ROM0_OFFSET + Memory::ROM_SIZE, 0xFFFFFFFF);
-	memory->write(Memory::ROM0_OFFSET, source, len);
+	memory->map_ROM(std::make_shared<const RomImage>(source, len));
 }
 
 void StorageTransactions::load_GBA(Memory* memory, const std::string& filename)
@@ -59,7 +49,6 @@ void StorageTransactions::load_GBA(Memory* memory, const std::string& filename)
 		throw ROMLoadingException("ROM size must not be greater than 32MB");
 	}
 
-	memory->fill(Memory::ROM0_OFFSET, Memory::ROM0_OFFSET + Memory::ROM_SIZE, 0xFFFFFFFF);
 	u8* data = new u8[(u32)len];
 	file.read((char*)data, (u32)len);
 
@@ -69,4 +58,18 @@ void StorageTransactions::load_GBA(Memory* memory, const std::string& filename)
 	file.close();
 }
 
+void StorageTransactions::map_GBA(Memory* memory, const std::string& filename)
+{
+	std::shared_ptr<const RomImage> image = ImageStore::acquire(filename);
+	if (image == nullptr)
+	{
+		throw ROMLoadingException("Failed to map GBA ROM");
+	}
+	if (image->get_size() > Memory::ROM_SIZE)
+	{
+		throw ROMLoadingException("ROM size must not be greater than 32MB");
+	}
+	memory->map_ROM(image);
+}
+
 ROMLoadingException::ROMLoadingException(const char* msg) : std::exception(msg) { }
\ No newline at end of file
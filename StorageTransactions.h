@@ -11,6 +11,11 @@ public:
 	static void load_BIOS(Memory* memory, const std::string& filename);
 	static void load_GBA(Memory* memory, const void* source, u32 len);
 	static void load_GBA(Memory* memory, const std::string& filename);
+
+	/// <summary>
+	/// Maps the ROM file read-only, sharing one image between all Memory instances using it
+	/// </summary>
+	static void map_GBA(Memory* memory, const std::string& filename);
 };
 
 class ROMLoadingException : public std::exception
@@ -1,7 +1,7 @@
 #include "ThumbDecoder.h"
+#include "Instruction.h"
 
 #include <sstream>
-#include <iostream>
 
 struct __IntructionTeller16
 {
@@ -13,7 +13,9 @@ struct __IntructionTeller16
 __IntructionTeller16 __InstrTeller16[];
 extern const int __InstrTeller16Count;
 
-ThumbInstruction::InstructionType tell_instruction16(u16 code)
+#define __get_bits16__(n,h,l) ((u8)(((n)>>(l))&((1<<((h)-(l)+1))-1)))
+
+static ThumbInstruction::InstructionType scan_instruction16(u16 code)
 {
 	for (int i = 0; i < __InstrTeller16Count; i++)
 	{
@@ -23,78 +25,331 @@ ThumbInstruction::InstructionType tell_instruction16(u16 code)
 	return ThumbInstruction::InstructionType::UNK;
 }
 
-ThumbInstruction::ThumbInstruction(u16 code)
+// The decode table is indexed by bits [15:6], which hold the format and opcode fields
+static const u16 THUMB_DECODE_INDEX_MASK = 0xFFC0;
+
+// Table entry sending the halfword through scan_instruction16
+static const u8 THUMB_DECODE_SCAN = 0xFF;
+
+/// <summary>
+/// 1024-entry decode table generated from __InstrTeller16. Each entry holds the type of the first
+/// teller whose bits agree with the index, or THUMB_DECODE_SCAN if that teller also looks at bits [5:0].
+/// </summary>
+class ThumbDecodeTable
+{
+private:
+	u8 entries[1024];
+public:
+	ThumbDecodeTable()
+	{
+		for (u32 index = 0; index < 1024; index++)
+		{
+			u16 code = (u16)(index << 6);
+			entries[index] = (u8)ThumbInstruction::InstructionType::UNK;
+			for (int i = 0; i < __InstrTeller16Count; i++)
+			{
+				const __IntructionTeller16& teller = __InstrTeller16[i];
+				if ((code ^ teller.bits) & teller.mask & THUMB_DECODE_INDEX_MASK)
+					continue;
+				entries[index] = (teller.mask & ~THUMB_DECODE_INDEX_MASK) ? THUMB_DECODE_SCAN : (u8)teller.type;
+				break;
+			}
+		}
+	}
+
+	inline u8 lookup(u16 code) const { return entries[code >> 6]; }
+};
+
+static const ThumbDecodeTable& thumb_decode_table()
+{
+	static const ThumbDecodeTable table;
+	return table;
+}
+
+ThumbInstruction::InstructionType tell_instruction16(u16 code)
+{
+	u8 type = thumb_decode_table().lookup(code);
+	if (type != THUMB_DECODE_SCAN)
+		return (ThumbInstruction::InstructionType)type;
+	return scan_instruction16(code);
+}
+
+ThumbInstruction::ThumbInstruction(u16 code) : data{}
+{
+	data.opcode = code;
+	data.thumb = 1;
+}
+
+void ThumbInstruction::decode()
+{
+	decode(data);
+}
+
+static inline u32 sign_extend16(u32 value, int bits)
 {
-	this->code = code;	
+	return (u32)((s32)(value << (32 - bits)) >> (32 - bits));
+}
+
+void ThumbInstruction::decode(DecodedInstruction& data)
+{
+	u16 code = (u16)data.opcode;
+	auto type = tell_instruction16(code);
+	// a BL prefix carrying its suffix in the upper halfword is the whole branch
+	if (type == ThumbInstruction::InstructionType::BLhi && ((data.opcode >> 16) & 0xF800) == 0xF800)
+		type = ThumbInstruction::InstructionType::BL;
+	data.type = (u8)type;
+	data.thumb = 1;
+	data.Cond = 0xE; // always
+
+	switch (type)
+	{
+	case ThumbInstruction::InstructionType::LSL:
+	case ThumbInstruction::InstructionType::LSR:
+	case ThumbInstruction::InstructionType::ASR:
+		data.Shift = __get_bits16__(code, 10, 6);
+		data.Rm = __get_bits16__(code, 5, 3);
+		data.Rd = __get_bits16__(code, 2, 0);
+		break;
+	case ThumbInstruction::InstructionType::ADDr:
+	case ThumbInstruction::InstructionType::SUBr:
+		data.Rm = __get_bits16__(code, 8, 6);
+		data.Rn = __get_bits16__(code, 5, 3);
+		data.Rd = __get_bits16__(code, 2, 0);
+		break;
+	case ThumbInstruction::InstructionType::ADDi3:
+	case ThumbInstruction::InstructionType::SUBi3:
+		data.Immediate = __get_bits16__(code, 8, 6);
+		data.Rn = __get_bits16__(code, 5, 3);
+		data.Rd = __get_bits16__(code, 2, 0);
+		break;
+	case ThumbInstruction::InstructionType::MOVi:
+	case ThumbInstruction::InstructionType::CMPi:
+	case ThumbInstruction::InstructionType::ADDi8:
+	case ThumbInstruction::InstructionType::SUBi8:
+		data.Rd = data.Rn = __get_bits16__(code, 10, 8);
+		data.Immediate = __get_bits16__(code, 7, 0);
+		break;
+	case ThumbInstruction::InstructionType::MOVr:
+		// LSL #0
+		data.Shift = 0;
+		data.Rm = __get_bits16__(code, 5, 3);
+		data.Rd = __get_bits16__(code, 2, 0);
+		break;
+	case ThumbInstruction::InstructionType::AND:
+	case ThumbInstruction::InstructionType::EOR:
+	case ThumbInstruction::InstructionType::LSLr:
+	case ThumbInstruction::InstructionType::LSRr:
+	case ThumbInstruction::InstructionType::ASRr:
+	case ThumbInstruction::InstructionType::ADC:
+	case ThumbInstruction::InstructionType::SBC:
+	case ThumbInstruction::InstructionType::ROR:
+	case ThumbInstruction::InstructionType::TST:
+	case ThumbInstruction::InstructionType::NEG:
+	case ThumbInstruction::InstructionType::CMPr:
+	case ThumbInstruction::InstructionType::CMN:
+	case ThumbInstruction::InstructionType::ORR:
+	case ThumbInstruction::InstructionType::MUL:
+	case ThumbInstruction::InstructionType::BIC:
+	case ThumbInstruction::InstructionType::MVN:
+		data.Op = __get_bits16__(code, 9, 6);
+		data.Rm = __get_bits16__(code, 5, 3);
+		data.Rd = data.Rn = __get_bits16__(code, 2, 0);
+		break;
+	case ThumbInstruction::InstructionType::ADDh:
+	case ThumbInstruction::InstructionType::CMPh:
+	case ThumbInstruction::InstructionType::MOVh:
+	case ThumbInstruction::InstructionType::BX:
+		// H1 and H2 extend Rd and Rs to R8-R15
+		data.Rm = __get_bits16__(code, 6, 3);
+		data.Rd = data.Rn = (u8)((__get_bits16__(code, 7, 7) << 3) | __get_bits16__(code, 2, 0));
+		break;
+	case ThumbInstruction::InstructionType::LDRpc:
+		data.Rn = 15;
+		data.Rd = __get_bits16__(code, 10, 8);
+		data.Immediate = (u32)__get_bits16__(code, 7, 0) << 2;
+		break;
+	case ThumbInstruction::InstructionType::STRr:
+	case ThumbInstruction::InstructionType::STRBr:
+	case ThumbInstruction::InstructionType::LDRr:
+	case ThumbInstruction::InstructionType::LDRBr:
+	case ThumbInstruction::InstructionType::STRHr:
+	case ThumbInstruction::InstructionType::LDSBr:
+	case ThumbInstruction::InstructionType::LDRHr:
+	case ThumbInstruction::InstructionType::LDSHr:
+		data.Rm = __get_bits16__(code, 8, 6);
+		data.Rn = __get_bits16__(code, 5, 3);
+		data.Rd = __get_bits16__(code, 2, 0);
+		break;
+	case ThumbInstruction::InstructionType::STRi:
+	case ThumbInstruction::InstructionType::LDRi:
+	case ThumbInstruction::InstructionType::STRBi:
+	case ThumbInstruction::InstructionType::LDRBi:
+	case ThumbInstruction::InstructionType::STRHi:
+	case ThumbInstruction::InstructionType::LDRHi:
+	{
+		// the 5-bit offset counts transfer sized units
+		u32 scale = type == ThumbInstruction::InstructionType::STRi || type == ThumbInstruction::InstructionType::LDRi ? 2
+			: type == ThumbInstruction::InstructionType::STRHi || type == ThumbInstruction::InstructionType::LDRHi ? 1 : 0;
+		data.Immediate = (u32)__get_bits16__(code, 10, 6) << scale;
+		data.Rn = __get_bits16__(code, 5, 3);
+		data.Rd = __get_bits16__(code, 2, 0);
+		break;
+	}
+	case ThumbInstruction::InstructionType::STRsp:
+	case ThumbInstruction::InstructionType::LDRsp:
+	case ThumbInstruction::InstructionType::ADDsp:
+		data.Rn = 13;
+		data.Rd = __get_bits16__(code, 10, 8);
+		data.Immediate = (u32)__get_bits16__(code, 7, 0) << 2;
+		break;
+	case ThumbInstruction::InstructionType::ADDpc:
+		data.Rn = 15;
+		data.Rd = __get_bits16__(code, 10, 8);
+		data.Immediate = (u32)__get_bits16__(code, 7, 0) << 2;
+		break;
+	case ThumbInstruction::InstructionType::ADDspi:
+	{
+		u32 offset = (u32)__get_bits16__(code, 6, 0) << 2;
+		data.Rd = data.Rn = 13;
+		data.Immediate = __get_bits16__(code, 7, 7) ? 0 - offset : offset;
+		break;
+	}
+	case ThumbInstruction::InstructionType::PUSH:
+		// R adds LR
+		data.Rn = 13;
+		data.RegList = (u16)(__get_bits16__(code, 7, 0) | (__get_bits16__(code, 8, 8) << 14));
+		break;
+	case ThumbInstruction::InstructionType::POP:
+		// R adds PC
+		data.Rn = 13;
+		data.RegList = (u16)(__get_bits16__(code, 7, 0) | (__get_bits16__(code, 8, 8) << 15));
+		break;
+	case ThumbInstruction::InstructionType::STMIA:
+	case ThumbInstruction::InstructionType::LDMIA:
+		data.Rn = __get_bits16__(code, 10, 8);
+		data.RegList = __get_bits16__(code, 7, 0);
+		break;
+	case ThumbInstruction::InstructionType::Bcond:
+		// the condition gates the branch like an ARM condition field; AL is undefined here
+		data.Cond = __get_bits16__(code, 11, 8);
+		data.Offset = sign_extend16(__get_bits16__(code, 7, 0), 8) << 1;
+		if (data.Cond == 0xE)
+		{
+			data.type = (u8)ThumbInstruction::InstructionType::UNK;
+			data.Cond = 0xE;
+		}
+		break;
+	case ThumbInstruction::InstructionType::SWI:
+		data.Immediate = __get_bits16__(code, 7, 0);
+		break;
+	case ThumbInstruction::InstructionType::B:
+		data.Offset = sign_extend16(code & 0x7FF, 11) << 1;
+		break;
+	case ThumbInstruction::InstructionType::BLhi:
+		data.Offset = sign_extend16(code & 0x7FF, 11) << 12;
+		break;
+	case ThumbInstruction::InstructionType::BLlo:
+		data.Offset = (u32)(code & 0x7FF) << 1;
+		break;
+	case ThumbInstruction::InstructionType::BL:
+		data.Offset = (sign_extend16(code & 0x7FF, 11) << 12) + ((u32)((data.opcode >> 16) & 0x7FF) << 1);
+		break;
+	default:
+		break;
+	}
+}
+
+bool ThumbInstruction::ends_block(const DecodedInstruction& data)
+{
+	switch ((ThumbInstruction::InstructionType)data.type)
+	{
+	case ThumbInstruction::InstructionType::UNK:
+	case ThumbInstruction::InstructionType::BX:
+	case ThumbInstruction::InstructionType::Bcond:
+	case ThumbInstruction::InstructionType::SWI:
+	case ThumbInstruction::InstructionType::B:
+	case ThumbInstruction::InstructionType::BLlo:
+	case ThumbInstruction::InstructionType::BL:
+		return true;
+	case ThumbInstruction::InstructionType::ADDh:
+	case ThumbInstruction::InstructionType::MOVh:
+		return data.Rd == 15;
+	case ThumbInstruction::InstructionType::POP:
+		return (data.RegList & 0x8000) != 0;
+	case ThumbInstruction::InstructionType::LDMIA:
+		// ARMv4 quirk: an empty list loads PC
+		return data.RegList == 0;
+	default:
+		return false;
+	}
 }
 
 bool ThumbInstruction::requires_word() const
 {
-	return (code & 0xE000) == 0xE000;
+	return (data.opcode & 0xF800) == 0xF000;
 }
 
 void ThumbInstruction::set_upper_halfword(u16 hw)
 {
-	std::cout << std::hex<< code << ' ';
-	code |= hw << 16;
-	std::cout << std::hex<< code << '\n';
+	data.opcode = (data.opcode & 0xFFFF) | ((u32)hw << 16);
 }
 
 bool ThumbInstruction::is_arithmetic() const
 {
-	return (u16)code < 0x2000; // 000xx...(16bit) < 0010_00..
+	return (u16)data.opcode < 0x2000; // 000xx...(16bit) < 0010_00..
 }
 
 
 
 ThumbInstruction ThumbDecoder::decode(const u16* buffer)
 {
-	return ThumbInstruction(0);
+	ThumbInstruction instruction(buffer[0]);
+	if (instruction.requires_word() && (buffer[1] & 0xF800) == 0xF800)
+		instruction.set_upper_halfword(buffer[1]);
+	instruction.decode();
+	return instruction;
 }
 
 
 std::string ThumbInstruction::to_string() const
+{
+	return to_string(data);
+}
+
+// Mnemonics indexed by InstructionType
+static const char* const THUMB_MNEMONICS[] =
+{
+	"[Unknown]",
+	"LSL", "LSR", "ASR", "ADD", "SUB", "ADD", "SUB",
+	"MOV", "CMP", "ADD", "SUB", "MOV",
+	"AND", "EOR", "LSL", "LSR", "ASR", "ADC", "SBC", "ROR",
+	"TST", "NEG", "CMP", "CMN", "ORR", "MUL", "BIC", "MVN",
+	"ADD", "CMP", "MOV", "BX",
+	"LDR",
+	"STR", "STRB", "LDR", "LDRB", "STRH", "LDSB", "LDRH", "LDSH",
+	"STR", "LDR", "STRB", "LDRB", "STRH", "LDRH", "STR", "LDR",
+	"ADD", "ADD", "ADD",
+	"PUSH", "POP", "STMIA", "LDMIA",
+	"B", "SWI", "B", "BL", "BL", "BL",
+};
+
+static_assert(sizeof(THUMB_MNEMONICS) / sizeof(THUMB_MNEMONICS[0]) == (int)ThumbInstruction::InstructionType::BL + 1,
+	"Every InstructionType needs a mnemonic");
+
+std::string ThumbInstruction::to_string(const DecodedInstruction& data)
 {
 	std::stringstream ss;
 	
 	ss << "[";
 	ss.fill('0');			
 	ss.width(8);
-	ss << std::hex << std::fixed << code;
+	ss << std::hex << std::fixed << data.opcode;
 	ss.clear();
 	ss << "] ";
 
-	auto itype = tell_instruction16(code);
-
-	switch (itype)
-	{	
-	case ThumbInstruction::InstructionType::LSL:
-		ss << "LSL";  break;
-	case ThumbInstruction::InstructionType::LSR:
-		ss << "LSR"; break;
-	case ThumbInstruction::InstructionType::ASR:
-		ss << "ASR"; break;
-	case ThumbInstruction::InstructionType::ADDr:
-		ss << "ADD"; break;
-	case ThumbInstruction::InstructionType::SUBr:
-		ss << "SUB"; break;
-	case ThumbInstruction::InstructionType::ADDi3:
-		ss << "ADD"; break;
-	case ThumbInstruction::InstructionType::SUBi3:
-		ss << "SUB"; break;
-	case ThumbInstruction::InstructionType::MOVi:
-		ss << "MOV"; break;
-	case ThumbInstruction::InstructionType::CMPi:
-		ss << "CMP"; break;
-	case ThumbInstruction::InstructionType::ADDi8:
-		ss << "ADD"; break;
-	case ThumbInstruction::InstructionType::SUBi8:
-		ss << "SUB"; break;
-	case ThumbInstruction::InstructionType::MOVr:
-		ss << "MOV"; break;
-	case ThumbInstruction::InstructionType::UNK:
-		ss << "[Unknown]"; break;
-	}
+	ss << THUMB_MNEMONICS[data.type];
+	if ((ThumbInstruction::InstructionType)data.type == ThumbInstruction::InstructionType::Bcond)
+		ss << Instruction::condition_suffix(data.Cond);
 
 	return ss.str();
 }
@@ -125,6 +380,77 @@ const u16 b_SUBi3   = b_ARITH | (u16)0b01111000000000; // Sub 3-bit immediate
 const u16 m_0011111 = m_ARITH | (u16)0b11111000000000;
 
 
+// ALU operations 010000_oooo_sss_ddd
+const u16 b_AND     = (u16)0b0100000000000000;
+const u16 b_EOR     = (u16)0b0100000001000000;
+const u16 b_LSLr    = (u16)0b0100000010000000;
+const u16 b_LSRr    = (u16)0b0100000011000000;
+const u16 b_ASRr    = (u16)0b0100000100000000;
+const u16 b_ADC     = (u16)0b0100000101000000;
+const u16 b_SBC     = (u16)0b0100000110000000;
+const u16 b_ROR     = (u16)0b0100000111000000;
+const u16 b_TST     = (u16)0b0100001000000000;
+const u16 b_NEG     = (u16)0b0100001001000000;
+const u16 b_CMPr    = (u16)0b0100001010000000;
+const u16 b_CMN     = (u16)0b0100001011000000;
+const u16 b_ORR     = (u16)0b0100001100000000;
+const u16 b_MUL     = (u16)0b0100001101000000;
+const u16 b_BIC     = (u16)0b0100001110000000;
+const u16 b_MVN     = (u16)0b0100001111000000;
+const u16 m_ALU     = (u16)0b1111111111000000;
+
+// Hi register operations / branch exchange 010001_oo_h_h_sss_ddd
+const u16 b_ADDh    = (u16)0b0100010000000000;
+const u16 b_CMPh    = (u16)0b0100010100000000;
+const u16 b_MOVh    = (u16)0b0100011000000000;
+const u16 b_BX      = (u16)0b0100011100000000;
+const u16 m_HIREG   = (u16)0b1111111100000000;
+
+// PC-relative load 01001_ddd_iiiiiiii
+const u16 b_LDRpc   = (u16)0b0100100000000000;
+const u16 m_11111xx = (u16)0b1111100000000000;
+
+// Load / store with register offset 0101_LB0 and sign-extended byte / halfword 0101_HS1
+const u16 b_STRr    = (u16)0b0101000000000000;
+const u16 b_STRHr   = (u16)0b0101001000000000;
+const u16 b_STRBr   = (u16)0b0101010000000000;
+const u16 b_LDSBr   = (u16)0b0101011000000000;
+const u16 b_LDRr    = (u16)0b0101100000000000;
+const u16 b_LDRHr   = (u16)0b0101101000000000;
+const u16 b_LDRBr   = (u16)0b0101110000000000;
+const u16 b_LDSHr   = (u16)0b0101111000000000;
+const u16 m_1111111 = (u16)0b1111111000000000;
+
+// Load / store with immediate offset 011_BL, halfword 1000_L, SP-relative 1001_L
+const u16 b_STRi    = (u16)0b0110000000000000;
+const u16 b_LDRi    = (u16)0b0110100000000000;
+const u16 b_STRBi   = (u16)0b0111000000000000;
+const u16 b_LDRBi   = (u16)0b0111100000000000;
+const u16 b_STRHi   = (u16)0b1000000000000000;
+const u16 b_LDRHi   = (u16)0b1000100000000000;
+const u16 b_STRsp   = (u16)0b1001000000000000;
+const u16 b_LDRsp   = (u16)0b1001100000000000;
+
+// Load address 1010_S, add offset to stack pointer 10110000_S
+const u16 b_ADDpc   = (u16)0b1010000000000000;
+const u16 b_ADDsp   = (u16)0b1010100000000000;
+const u16 b_ADDspi  = (u16)0b1011000000000000;
+
+// Push / pop registers 1011_L10R, multiple load / store 1100_L
+const u16 b_PUSH    = (u16)0b1011010000000000;
+const u16 b_POP     = (u16)0b1011110000000000;
+const u16 b_STMIA   = (u16)0b1100000000000000;
+const u16 b_LDMIA   = (u16)0b1100100000000000;
+
+// Branches; SWI takes the condition 1111 of the conditional branch
+const u16 b_SWI     = (u16)0b1101111100000000;
+const u16 b_Bcond   = (u16)0b1101000000000000;
+const u16 m_1111xxx = (u16)0b1111000000000000;
+const u16 b_B       = (u16)0b1110000000000000;
+const u16 b_BLhi    = (u16)0b1111000000000000;
+const u16 b_BLlo    = (u16)0b1111100000000000;
+
+
 #define __tell_instr16__(name, mask) { b_##name  , m_##mask , ThumbInstruction::InstructionType::name  }
 
 __IntructionTeller16 __InstrTeller16[] =
@@ -142,6 +468,65 @@ __IntructionTeller16 __InstrTeller16[] =
 	__tell_instr16__(CMPi  , 00111xx),
 	__tell_instr16__(ADDi8 , 00111xx),
 	__tell_instr16__(SUBi8 , 00111xx),
+
+	// ALU operations
+	__tell_instr16__(AND  , ALU),
+	__tell_instr16__(EOR  , ALU),
+	__tell_instr16__(LSLr , ALU),
+	__tell_instr16__(LSRr , ALU),
+	__tell_instr16__(ASRr , ALU),
+	__tell_instr16__(ADC  , ALU),
+	__tell_instr16__(SBC  , ALU),
+	__tell_instr16__(ROR  , ALU),
+	__tell_instr16__(TST  , ALU),
+	__tell_instr16__(NEG  , ALU),
+	__tell_instr16__(CMPr , ALU),
+	__tell_instr16__(CMN  , ALU),
+	__tell_instr16__(ORR  , ALU),
+	__tell_instr16__(MUL  , ALU),
+	__tell_instr16__(BIC  , ALU),
+	__tell_instr16__(MVN  , ALU),
+
+	// Hi register operations
+	__tell_instr16__(ADDh , HIREG),
+	__tell_instr16__(CMPh , HIREG),
+	__tell_instr16__(MOVh , HIREG),
+	__tell_instr16__(BX   , HIREG),
+
+	// Loads and stores
+	__tell_instr16__(LDRpc, 11111xx),
+	__tell_instr16__(STRr , 1111111),
+	__tell_instr16__(STRHr, 1111111),
+	__tell_instr16__(STRBr, 1111111),
+	__tell_instr16__(LDSBr, 1111111),
+	__tell_instr16__(LDRr , 1111111),
+	__tell_instr16__(LDRHr, 1111111),
+	__tell_instr16__(LDRBr, 1111111),
+	__tell_instr16__(LDSHr, 1111111),
+	__tell_instr16__(STRi , 11111xx),
+	__tell_instr16__(LDRi , 11111xx),
+	__tell_instr16__(STRBi, 11111xx),
+	__tell_instr16__(LDRBi, 11111xx),
+	__tell_instr16__(STRHi, 11111xx),
+	__tell_instr16__(LDRHi, 11111xx),
+	__tell_instr16__(STRsp, 11111xx),
+	__tell_instr16__(LDRsp, 11111xx),
+
+	// Load address, stack
+	__tell_instr16__(ADDpc , 11111xx),
+	__tell_instr16__(ADDsp , 11111xx),
+	__tell_instr16__(ADDspi, HIREG),
+	__tell_instr16__(PUSH  , 1111111),
+	__tell_instr16__(POP   , 1111111),
+	__tell_instr16__(STMIA , 11111xx),
+	__tell_instr16__(LDMIA , 11111xx),
+
+	// Branches
+	__tell_instr16__(SWI  , HIREG),
+	__tell_instr16__(Bcond, 1111xxx),
+	__tell_instr16__(B    , 11111xx),
+	__tell_instr16__(BLhi , 11111xx),
+	__tell_instr16__(BLlo , 11111xx),
 };
 
 const int __InstrTeller16Count = sizeof(__InstrTeller16) / sizeof(__IntructionTeller16);
\ No newline at end of file
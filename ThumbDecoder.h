@@ -1,26 +1,54 @@
 #pragma once
 #include "Types.h"
+#include "DecodedInstruction.h"
 #include <string>
 
 class ThumbInstruction
 {
 private:	
-	u32 code;
-	int Rd, Rn, Rm, imm5, imm8, cnst;
+	DecodedInstruction data;
 public:
 	ThumbInstruction(u16 code);
 
+	/// <summary>
+	/// Fills the register and immediate fields of the decoded form
+	/// </summary>
+	void decode();
+
+	const DecodedInstruction& decoded() const { return data; }
+
+	static void decode(DecodedInstruction& data);
+
+	/// <summary>
+	/// Tells whether the instruction may change the program flow, thus closing a decoded block
+	/// </summary>
+	static bool ends_block(const DecodedInstruction& data);
+
+	/// <summary>
+	/// Bytes the instruction takes: 4 for a fused BL pair, 2 otherwise
+	/// </summary>
+	static inline u32 size(const DecodedInstruction& data) { return data.type == (u8)InstructionType::BL ? 4 : 2; }
+
+	/// <summary>
+	/// Tells whether the halfword is the first half of a BL pair, which the decoder fuses with the next halfword
+	/// </summary>
 	bool requires_word() const;
 
+	/// <summary>
+	/// Puts the second halfword of a BL pair above the first one, so that decode sees the whole branch
+	/// </summary>
 	void set_upper_halfword(u16 hw);
 
 	bool is_arithmetic() const;
 
 	std::string to_string() const;
 
+	static std::string to_string(const DecodedInstruction& data);
+
 	enum class InstructionType
 	{
 		UNK,
+		// move shifted register, add / subtract
 		LSL,
 		LSR,
 		ASR,
@@ -28,11 +56,77 @@ public:
 		SUBr,
 		ADDi3,
 		SUBi3,
+		// move / compare / add / subtract immediate
 		MOVi,
 		CMPi,
 		ADDi8,
 		SUBi8,
-		MOVr
+		MOVr,
+		// ALU operations
+		AND,
+		EOR,
+		LSLr,
+		LSRr,
+		ASRr,
+		ADC,
+		SBC,
+		ROR,
+		TST,
+		NEG,
+		CMPr,
+		CMN,
+		ORR,
+		MUL,
+		BIC,
+		MVN,
+		// hi register operations / branch exchange
+		ADDh,
+		CMPh,
+		MOVh,
+		BX,
+		// loads and stores
+		LDRpc,
+		STRr,
+		STRBr,
+		LDRr,
+		LDRBr,
+		STRHr,
+		LDSBr,
+		LDRHr,
+		LDSHr,
+		STRi,
+		LDRi,
+		STRBi,
+		LDRBi,
+		STRHi,
+		LDRHi,
+		STRsp,
+		LDRsp,
+		// load address, add offset to stack pointer
+		ADDpc,
+		ADDsp,
+		ADDspi,
+		// multiple loads and stores
+		PUSH,
+		POP,
+		STMIA,
+		LDMIA,
+		// branches
+		Bcond,
+		SWI,
+		B,
+		/// <summary>
+		/// First half of a BL pair: LR = PC + (offset << 12)
+		/// </summary>
+		BLhi,
+		/// <summary>
+		/// Second half of a BL pair: branches to LR + (offset << 1), LR = next instruction | 1
+		/// </summary>
+		BLlo,
+		/// <summary>
+		/// Both halves of a BL pair, fused by the decoder into one 4-byte instruction
+		/// </summary>
+		BL
 	};
 };
 
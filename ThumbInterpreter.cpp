@@ -0,0 +1,560 @@
+#include "ThumbInterpreter.h"
+#include "HLEBios.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#ifndef ARM_SWITCH_DISPATCH
+#define THUMB_THREADED_DISPATCH
+#endif
+#endif
+
+// Handler of every ThumbInstruction::InstructionType, in declaration order
+#define THUMB_HANDLERS(X) \
+	X(UNK,    exec_undefined) \
+	X(LSL,    exec_shift_imm<Type::LSL>) \
+	X(LSR,    exec_shift_imm<Type::LSR>) \
+	X(ASR,    exec_shift_imm<Type::ASR>) \
+	X(ADDr,   exec_add_sub<Type::ADDr>) \
+	X(SUBr,   exec_add_sub<Type::SUBr>) \
+	X(ADDi3,  exec_add_sub<Type::ADDi3>) \
+	X(SUBi3,  exec_add_sub<Type::SUBi3>) \
+	X(MOVi,   exec_imm8<Type::MOVi>) \
+	X(CMPi,   exec_imm8<Type::CMPi>) \
+	X(ADDi8,  exec_imm8<Type::ADDi8>) \
+	X(SUBi8,  exec_imm8<Type::SUBi8>) \
+	X(MOVr,   exec_shift_imm<Type::LSL>) \
+	X(AND,    exec_alu<Type::AND>) \
+	X(EOR,    exec_alu<Type::EOR>) \
+	X(LSLr,   exec_alu<Type::LSLr>) \
+	X(LSRr,   exec_alu<Type::LSRr>) \
+	X(ASRr,   exec_alu<Type::ASRr>) \
+	X(ADC,    exec_alu<Type::ADC>) \
+	X(SBC,    exec_alu<Type::SBC>) \
+	X(ROR,    exec_alu<Type::ROR>) \
+	X(TST,    exec_alu<Type::TST>) \
+	X(NEG,    exec_alu<Type::NEG>) \
+	X(CMPr,   exec_alu<Type::CMPr>) \
+	X(CMN,    exec_alu<Type::CMN>) \
+	X(ORR,    exec_alu<Type::ORR>) \
+	X(MUL,    exec_alu<Type::MUL>) \
+	X(BIC,    exec_alu<Type::BIC>) \
+	X(MVN,    exec_alu<Type::MVN>) \
+	X(ADDh,   exec_hi_add) \
+	X(CMPh,   exec_hi_cmp) \
+	X(MOVh,   exec_hi_mov) \
+	X(BX,     exec_bx) \
+	X(LDRpc,  exec_transfer<Type::LDRpc>) \
+	X(STRr,   exec_transfer<Type::STRr>) \
+	X(STRBr,  exec_transfer<Type::STRBr>) \
+	X(LDRr,   exec_transfer<Type::LDRr>) \
+	X(LDRBr,  exec_transfer<Type::LDRBr>) \
+	X(STRHr,  exec_transfer<Type::STRHr>) \
+	X(LDSBr,  exec_transfer<Type::LDSBr>) \
+	X(LDRHr,  exec_transfer<Type::LDRHr>) \
+	X(LDSHr,  exec_transfer<Type::LDSHr>) \
+	X(STRi,   exec_transfer<Type::STRi>) \
+	X(LDRi,   exec_transfer<Type::LDRi>) \
+	X(STRBi,  exec_transfer<Type::STRBi>) \
+	X(LDRBi,  exec_transfer<Type::LDRBi>) \
+	X(STRHi,  exec_transfer<Type::STRHi>) \
+	X(LDRHi,  exec_transfer<Type::LDRHi>) \
+	X(STRsp,  exec_transfer<Type::STRsp>) \
+	X(LDRsp,  exec_transfer<Type::LDRsp>) \
+	X(ADDpc,  exec_load_address) \
+	X(ADDsp,  exec_load_address) \
+	X(ADDspi, exec_adjust_sp) \
+	X(PUSH,   exec_push) \
+	X(POP,    exec_pop) \
+	X(STMIA,  exec_stmia) \
+	X(LDMIA,  exec_ldmia) \
+	X(Bcond,  exec_branch) \
+	X(SWI,    exec_swi) \
+	X(B,      exec_branch) \
+	X(BLhi,   exec_bl_high) \
+	X(BLlo,   exec_bl_low) \
+	X(BL,     exec_bl)
+
+const ThumbInterpreter::Handler ThumbInterpreter::handlers[] =
+{
+#define __handler_entry__(type, handler) &ThumbInterpreter::handler,
+	THUMB_HANDLERS(__handler_entry__)
+#undef __handler_entry__
+};
+
+static inline u32 sign_extend(u32 value, int bits)
+{
+	return (u32)((s32)(value << (32 - bits)) >> (32 - bits));
+}
+
+static inline u32 rotate_right(u32 value, u32 amount)
+{
+	amount &= 31;
+	return amount ? (value >> amount) | (value << (32 - amount)) : value;
+}
+
+/// <summary>
+/// Misaligned word loads rotate the aligned word, like the ARM7TDMI does
+/// </summary>
+static inline u32 read_word_rotated(const Memory* memory, u32 address)
+{
+	return rotate_right(memory->get32(address & ~3), (address & 3) << 3);
+}
+
+// Multiplier steps: the array stops early once the remaining bits of the multiplier are all zeros or all ones
+static inline u32 multiplier_cycles(u32 multiplier)
+{
+	if ((s32)multiplier < 0) multiplier = ~multiplier;
+	if ((multiplier >> 8) == 0) return 1;
+	if ((multiplier >> 16) == 0) return 2;
+	if ((multiplier >> 24) == 0) return 3;
+	return 4;
+}
+
+static inline u32 popcount16(u16 value)
+{
+	u32 count = 0;
+	for (; value; value &= value - 1) count++;
+	return count;
+}
+
+typedef ThumbInstruction::InstructionType Type;
+
+static constexpr bool is_load(Type type)
+{
+	return type == Type::LDRpc || type == Type::LDRr || type == Type::LDRBr || type == Type::LDSBr
+		|| type == Type::LDRHr || type == Type::LDSHr || type == Type::LDRi || type == Type::LDRBi
+		|| type == Type::LDRHi || type == Type::LDRsp;
+}
+
+// Bytes moved by a single transfer
+static constexpr u32 transfer_size(Type type)
+{
+	switch (type)
+	{
+	case Type::STRBr: case Type::LDRBr: case Type::LDSBr: case Type::STRBi: case Type::LDRBi:
+		return 1;
+	case Type::STRHr: case Type::LDRHr: case Type::LDSHr: case Type::STRHi: case Type::LDRHi:
+		return 2;
+	default:
+		return 4;
+	}
+}
+
+static constexpr bool has_register_offset(Type type)
+{
+	return type >= Type::STRr && type <= Type::LDSHr;
+}
+
+void ThumbInterpreter::execute(Cpu* cpu, const DecodedInstruction& data)
+{
+	static_assert(sizeof(handlers) / sizeof(Handler) == (int)Type::BL + 1, "Every InstructionType needs a handler");
+	if (cpu->condition_passed(data.Cond))
+		handlers[data.type](cpu, data);
+}
+
+u32 ThumbInterpreter::execute_block(Cpu* cpu, const DecodedInstruction* instructions, u32 count)
+{
+	const DecodedInstruction* instr = instructions;
+	const DecodedInstruction* end = instructions + count;
+	// a store over the block retires it: stop before running the next slot
+	u32 generation = cpu->block_cache.get_generation();
+	cpu->branched = false;
+	u32 cycles = 0;
+
+#ifdef THUMB_THREADED_DISPATCH
+	static void* const labels[] =
+	{
+#define __label_entry__(type, handler) &&op_##type,
+		THUMB_HANDLERS(__label_entry__)
+#undef __label_entry__
+	};
+
+	// every handler ends with its own copy of the dispatch, so that each gets its own indirect branch.
+	// Only conditional branches have a condition other than AL.
+#define __dispatch__() \
+	for (;;) \
+	{ \
+		if (instr == end || cpu->branched || cpu->block_cache.get_generation() != generation) goto done; \
+		cycles += instr->cycles; \
+		cpu->PC = instr->address + 4; \
+		if (cpu->condition_passed(instr->Cond)) goto *labels[instr->type]; \
+		instr++; \
+	}
+
+	__dispatch__();
+#define __label_body__(type, handler) op_##type: handler(cpu, *instr++); __dispatch__();
+	THUMB_HANDLERS(__label_body__)
+#undef __label_body__
+#undef __dispatch__
+done:
+#else
+	for (; instr != end && !cpu->branched && cpu->block_cache.get_generation() == generation; instr++)
+	{
+		cycles += instr->cycles;
+		cpu->PC = instr->address + 4;
+		if (!cpu->condition_passed(instr->Cond))
+			continue;
+		switch ((Type)instr->type)
+		{
+#define __case_entry__(type, handler) case Type::type: handler(cpu, *instr); break;
+			THUMB_HANDLERS(__case_entry__)
+#undef __case_entry__
+		}
+	}
+#endif
+
+	// only the fused BL takes 4 bytes, and it always branches
+	u32 executed = (u32)(instr - instructions);
+	if (!cpu->branched && executed > 0)
+		cpu->PC -= 2;
+	cpu->pending_cycles += cycles;
+	return executed;
+}
+
+void ThumbInterpreter::exec_undefined(Cpu* cpu, const DecodedInstruction& data)
+{
+	cpu->enter_exception(Cpu::MODE_UND, 0x04, data.address + 2);
+}
+
+template <Type T>
+void ThumbInterpreter::exec_shift_imm(Cpu* cpu, const DecodedInstruction& data)
+{
+	u32 value = cpu->R[data.Rm];
+	u32 amount = data.Shift;
+	u32 carry = cpu->get_carry();
+	u32 result;
+	if constexpr (T == Type::LSL)
+	{
+		result = value;
+		if (amount != 0)
+		{
+			carry = (value >> (32 - amount)) & 1;
+			result = value << amount;
+		}
+	}
+	else if constexpr (T == Type::LSR)
+	{
+		// #0 encodes #32
+		carry = amount ? (value >> (amount - 1)) & 1 : value >> 31;
+		result = amount ? value >> amount : 0;
+	}
+	else
+	{
+		carry = amount ? (value >> (amount - 1)) & 1 : value >> 31;
+		result = (u32)((s32)value >> (amount ? amount : 31));
+	}
+	cpu->R[data.Rd] = result;
+	cpu->set_lazy_flags(Cpu::FlagOp::Logical, result, 0, 0, carry);
+}
+
+template <Type T>
+void ThumbInterpreter::exec_add_sub(Cpu* cpu, const DecodedInstruction& data)
+{
+	u32 a = cpu->R[data.Rn];
+	u32 b = (T == Type::ADDi3 || T == Type::SUBi3) ? data.Immediate : cpu->R[data.Rm];
+	if constexpr (T == Type::ADDr || T == Type::ADDi3)
+	{
+		cpu->R[data.Rd] = a + b;
+		cpu->set_lazy_flags(Cpu::FlagOp::Add, a + b, a, b, 0);
+	}
+	else
+	{
+		cpu->R[data.Rd] = a - b;
+		cpu->set_lazy_flags(Cpu::FlagOp::Sub, a - b, a, b, 0);
+	}
+}
+
+template <Type T>
+void ThumbInterpreter::exec_imm8(Cpu* cpu, const DecodedInstruction& data)
+{
+	u32 a = cpu->R[data.Rd];
+	u32 b = data.Immediate;
+	if constexpr (T == Type::MOVi)
+	{
+		// C and V stay: resolve them before the pending op is replaced
+		u32 carry = cpu->get_carry();
+		cpu->R[data.Rd] = b;
+		cpu->set_lazy_flags(Cpu::FlagOp::Logical, b, 0, 0, carry);
+	}
+	else if constexpr (T == Type::CMPi)
+		cpu->set_lazy_flags(Cpu::FlagOp::Sub, a - b, a, b, 0);
+	else if constexpr (T == Type::ADDi8)
+	{
+		cpu->R[data.Rd] = a + b;
+		cpu->set_lazy_flags(Cpu::FlagOp::Add, a + b, a, b, 0);
+	}
+	else
+	{
+		cpu->R[data.Rd] = a - b;
+		cpu->set_lazy_flags(Cpu::FlagOp::Sub, a - b, a, b, 0);
+	}
+}
+
+template <Type T>
+void ThumbInterpreter::exec_alu(Cpu* cpu, const DecodedInstruction& data)
+{
+	u32 a = cpu->R[data.Rd];
+	u32 b = cpu->R[data.Rm];
+	// every op but the arithmetic ones keeps V, and C unless it shifts
+	u32 carry = cpu->get_carry();
+	u32 result;
+	Cpu::FlagOp flag_op = Cpu::FlagOp::Logical;
+
+	if constexpr (T == Type::AND || T == Type::TST) result = a & b;
+	else if constexpr (T == Type::EOR) result = a ^ b;
+	else if constexpr (T == Type::ORR) result = a | b;
+	else if constexpr (T == Type::BIC) result = a & ~b;
+	else if constexpr (T == Type::MVN) result = ~b;
+	else if constexpr (T == Type::MUL)
+	{
+		// MULS Rd, Rs, Rd: the old Rd is the multiplier
+		result = a * b;
+		cpu->pending_cycles += multiplier_cycles(a);
+	}
+	else if constexpr (T == Type::LSLr || T == Type::LSRr || T == Type::ASRr || T == Type::ROR)
+	{
+		u32 amount = b & 0xFF;
+		result = a;
+		if (amount != 0)
+		{
+			if constexpr (T == Type::LSLr)
+			{
+				carry = amount < 32 ? (a >> (32 - amount)) & 1 : amount == 32 ? a & 1 : 0;
+				result = amount < 32 ? a << amount : 0;
+			}
+			else if constexpr (T == Type::LSRr)
+			{
+				carry = amount < 32 ? (a >> (amount - 1)) & 1 : amount == 32 ? a >> 31 : 0;
+				result = amount < 32 ? a >> amount : 0;
+			}
+			else if constexpr (T == Type::ASRr)
+			{
+				carry = amount < 32 ? (a >> (amount - 1)) & 1 : a >> 31;
+				result = (u32)((s32)a >> (amount < 32 ? amount : 31));
+			}
+			else
+			{
+				carry = (amount & 31) ? (a >> ((amount & 31) - 1)) & 1 : a >> 31;
+				result = rotate_right(a, amount);
+			}
+		}
+	}
+	else if constexpr (T == Type::ADC)
+	{
+		result = a + b + carry;
+		flag_op = Cpu::FlagOp::Adc;
+	}
+	else if constexpr (T == Type::SBC)
+	{
+		result = a - b - (1 - carry);
+		flag_op = Cpu::FlagOp::Sbc;
+	}
+	else if constexpr (T == Type::NEG)
+	{
+		result = 0 - b;
+		flag_op = Cpu::FlagOp::Sub;
+		a = 0;
+	}
+	else if constexpr (T == Type::CMPr)
+	{
+		result = a - b;
+		flag_op = Cpu::FlagOp::Sub;
+	}
+	else
+	{
+		// CMN
+		result = a + b;
+		flag_op = Cpu::FlagOp::Add;
+	}
+
+	if constexpr (T != Type::TST && T != Type::CMPr && T != Type::CMN)
+		cpu->R[data.Rd] = result;
+
+	if (flag_op == Cpu::FlagOp::Logical)
+		cpu->set_lazy_flags(Cpu::FlagOp::Logical, result, 0, 0, carry);
+	else
+		cpu->set_lazy_flags(flag_op, result, a, b, carry);
+}
+
+void ThumbInterpreter::exec_hi_add(Cpu* cpu, const DecodedInstruction& data)
+{
+	u32 result = cpu->R[data.Rd] + cpu->R[data.Rm];
+	if (data.Rd == 15) cpu->branch_to(result);
+	else cpu->R[data.Rd] = result;
+}
+
+void ThumbInterpreter::exec_hi_cmp(Cpu* cpu, const DecodedInstruction& data)
+{
+	u32 a = cpu->R[data.Rd], b = cpu->R[data.Rm];
+	cpu->set_lazy_flags(Cpu::FlagOp::Sub, a - b, a, b, 0);
+}
+
+void ThumbInterpreter::exec_hi_mov(Cpu* cpu, const DecodedInstruction& data)
+{
+	u32 value = cpu->R[data.Rm];
+	if (data.Rd == 15) cpu->branch_to(value);
+	else cpu->R[data.Rd] = value;
+}
+
+void ThumbInterpreter::exec_bx(Cpu* cpu, const DecodedInstruction& data)
+{
+	u32 target = cpu->R[data.Rm];
+	if (target & 1)
+	{
+		cpu->CPSR |= Cpu::FLAG_T;
+		cpu->instruction_state = Cpu::InstructionState::Thumb;
+	}
+	else
+	{
+		cpu->CPSR &= ~Cpu::FLAG_T;
+		cpu->instruction_state = Cpu::InstructionState::ARM;
+	}
+	cpu->branch_to(target);
+}
+
+template <Type T>
+void ThumbInterpreter::exec_transfer(Cpu* cpu, const DecodedInstruction& data)
+{
+	// PC-relative loads see the word aligned PC
+	u32 base = data.Rn == 15 ? cpu->PC & ~3 : cpu->R[data.Rn];
+	u32 address = base + (has_register_offset(T) ? cpu->R[data.Rm] : data.Immediate);
+	cpu->pending_cycles += cpu->memory->access_time(address, transfer_size(T) == 4, false);
+
+	if constexpr (is_load(T))
+	{
+		u32 value;
+		if constexpr (T == Type::LDRBr || T == Type::LDRBi)
+			value = (*cpu->memory)[address];
+		else if constexpr (T == Type::LDSBr)
+			value = sign_extend((*cpu->memory)[address], 8);
+		else if constexpr (T == Type::LDRHr || T == Type::LDRHi) // misaligned reads rotate
+			value = rotate_right(cpu->memory->get16(address & ~1), (address & 1) << 3);
+		else if constexpr (T == Type::LDSHr) // misaligned LDSH loads the byte
+			value = (address & 1) ? sign_extend((*cpu->memory)[address], 8) : sign_extend(cpu->memory->get16(address), 16);
+		else
+			value = read_word_rotated(cpu->memory, address);
+		cpu->R[data.Rd] = value;
+	}
+	else
+	{
+		u32 value = cpu->R[data.Rd];
+		if constexpr (transfer_size(T) == 1)
+			cpu->memory->set_at(address, (u8)value);
+		else if constexpr (transfer_size(T) == 2)
+			cpu->memory->set16(address & ~1, (u16)value);
+		else
+			cpu->memory->set32(address & ~3, value);
+		cpu->check_halt();
+	}
+}
+
+void ThumbInterpreter::exec_load_address(Cpu* cpu, const DecodedInstruction& data)
+{
+	u32 base = data.Rn == 15 ? cpu->PC & ~3 : cpu->R[data.Rn];
+	cpu->R[data.Rd] = base + data.Immediate;
+}
+
+void ThumbInterpreter::exec_adjust_sp(Cpu* cpu, const DecodedInstruction& data)
+{
+	cpu->R[13] += data.Immediate;
+}
+
+void ThumbInterpreter::exec_push(Cpu* cpu, const DecodedInstruction& data)
+{
+	transfer_multiple(cpu, data.RegList, 13, false, true);
+}
+
+void ThumbInterpreter::exec_pop(Cpu* cpu, const DecodedInstruction& data)
+{
+	transfer_multiple(cpu, data.RegList, 13, true, false);
+}
+
+void ThumbInterpreter::exec_stmia(Cpu* cpu, const DecodedInstruction& data)
+{
+	transfer_multiple(cpu, data.RegList, data.Rn, false, false);
+}
+
+void ThumbInterpreter::exec_ldmia(Cpu* cpu, const DecodedInstruction& data)
+{
+	transfer_multiple(cpu, data.RegList, data.Rn, true, false);
+}
+
+void ThumbInterpreter::transfer_multiple(Cpu* cpu, u16 list, u8 rn, bool load, bool descending)
+{
+	u32 bytes = popcount16(list) * 4;
+	if (list == 0)
+	{
+		// ARMv4 quirk: an empty list transfers R15 and moves the base by 0x40
+		list = 0x8000;
+		bytes = 0x40;
+	}
+
+	u32 base = cpu->R[rn];
+	u32 address = descending ? base - bytes : base;
+	u32 new_base = descending ? base - bytes : base + bytes;
+	// one non-sequential access, the rest sequential
+	cpu->pending_cycles += cpu->memory->access_time(address, true, false)
+		+ (popcount16(list) - 1) * cpu->memory->access_time(address, true, true);
+
+	if (load)
+	{
+		// a loaded base overwrites the written back one
+		cpu->R[rn] = new_base;
+		u32 pc_value = 0;
+		for (int r = 0; r < 16; r++)
+		{
+			if (!(list & (1 << r))) continue;
+			u32 value = cpu->memory->get32(address & ~3);
+			address += 4;
+			if (r == 15) pc_value = value;
+			else cpu->R[r] = value;
+		}
+		// ARMv4 POP {PC} stays in Thumb state
+		if (list & 0x8000)
+			cpu->branch_to(pc_value);
+		return;
+	}
+
+	// the base is written back after the first store: a base listed first is stored unchanged
+	bool first = true;
+	for (int r = 0; r < 16; r++)
+	{
+		if (!(list & (1 << r))) continue;
+		u32 value = cpu->R[r] + (r == 15 ? 2 : 0);
+		cpu->memory->set32(address & ~3, value);
+		address += 4;
+		if (first) cpu->R[rn] = new_base;
+		first = false;
+	}
+	cpu->check_halt();
+}
+
+void ThumbInterpreter::exec_branch(Cpu* cpu, const DecodedInstruction& data)
+{
+	cpu->branch_to(cpu->PC + data.Offset);
+}
+
+void ThumbInterpreter::exec_bl_high(Cpu* cpu, const DecodedInstruction& data)
+{
+	cpu->R[14] = cpu->PC + data.Offset;
+}
+
+void ThumbInterpreter::exec_bl_low(Cpu* cpu, const DecodedInstruction& data)
+{
+	u32 target = cpu->R[14] + data.Offset;
+	cpu->R[14] = (data.address + 2) | 1;
+	cpu->branch_to(target);
+}
+
+void ThumbInterpreter::exec_bl(Cpu* cpu, const DecodedInstruction& data)
+{
+	// both halves at once: LR never holds the intermediate target
+	cpu->R[14] = (data.address + 4) | 1;
+	cpu->branch_to(data.address + 4 + data.Offset);
+}
+
+void ThumbInterpreter::exec_swi(Cpu* cpu, const DecodedInstruction& data)
+{
+	if (cpu->hle_bios && HLEBios::call(cpu, (u8)data.Immediate))
+		return;
+	cpu->enter_exception(Cpu::MODE_SVC, 0x08, data.address + 2);
+}
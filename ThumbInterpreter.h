@@ -0,0 +1,87 @@
+#pragma once
+#include "Cpu.h"
+#include "DecodedInstruction.h"
+#include "ThumbDecoder.h"
+
+/// <summary>
+/// Thumb execution engine, sharing the Cpu register file with ARMInterpreter. Each ThumbInstruction::InstructionType
+/// has its own handler; blocks run with direct-threaded dispatch where the compiler supports it, with a switch otherwise.
+/// </summary>
+class ThumbInterpreter
+{
+public:
+	/// <summary>
+	/// Executes one instruction, R15 already pointing 4 bytes past it
+	/// </summary>
+	static void execute(Cpu* cpu, const DecodedInstruction& data);
+
+	/// <summary>
+	/// Executes instructions in order until one changes the program flow, the block cache drops them
+	/// or count is reached. Leaves PC on the next instruction to execute and returns the number executed.
+	/// Their fetch and internal cycles go to Cpu::pending_cycles, with the run time charges.
+	/// </summary>
+	static u32 execute_block(Cpu* cpu, const DecodedInstruction* instructions, u32 count);
+
+private:
+	typedef void (*Handler)(Cpu* cpu, const DecodedInstruction& data);
+	typedef ThumbInstruction::InstructionType Type;
+
+	/// <summary>
+	/// Handlers indexed by ThumbInstruction::InstructionType
+	/// </summary>
+	static const Handler handlers[];
+
+	static void exec_undefined(Cpu* cpu, const DecodedInstruction& data);
+
+	/// <summary>
+	/// LSL, LSR, ASR by a 5-bit immediate; MOV Rd, Rs is LSL #0
+	/// </summary>
+	template <Type T>
+	static void exec_shift_imm(Cpu* cpu, const DecodedInstruction& data);
+
+	/// <summary>
+	/// ADD / SUB with a register or a 3-bit immediate
+	/// </summary>
+	template <Type T>
+	static void exec_add_sub(Cpu* cpu, const DecodedInstruction& data);
+
+	/// <summary>
+	/// MOV / CMP / ADD / SUB with an 8-bit immediate
+	/// </summary>
+	template <Type T>
+	static void exec_imm8(Cpu* cpu, const DecodedInstruction& data);
+
+	/// <summary>
+	/// Two-register ALU operations, all of them setting the flags
+	/// </summary>
+	template <Type T>
+	static void exec_alu(Cpu* cpu, const DecodedInstruction& data);
+
+	static void exec_hi_add(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_hi_cmp(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_hi_mov(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_bx(Cpu* cpu, const DecodedInstruction& data);
+
+	/// <summary>
+	/// Single loads and stores, with a register or an immediate offset from Rn (SP, or the word aligned PC)
+	/// </summary>
+	template <Type T>
+	static void exec_transfer(Cpu* cpu, const DecodedInstruction& data);
+
+	static void exec_load_address(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_adjust_sp(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_push(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_pop(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_stmia(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_ldmia(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_branch(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_bl_high(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_bl_low(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_bl(Cpu* cpu, const DecodedInstruction& data);
+	static void exec_swi(Cpu* cpu, const DecodedInstruction& data);
+
+	/// <summary>
+	/// Ascending multiple transfer from R[rn], or from R[rn] - size when descending, writing R[rn] back
+	/// </summary>
+	static void transfer_multiple(Cpu* cpu, u16 list, u8 rn, bool load, bool descending);
+};
@@ -0,0 +1,143 @@
+#pragma once
+#include "Types.h"
+
+#include <cstring>
+
+/// <summary>
+/// Host registers, numbered the way x86-64 encodes them
+/// </summary>
+enum class X64Reg : u8
+{
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+/// <summary>
+/// Minimal x86-64 machine code writer covering what the ARM JIT emits.
+/// Register operands are 32-bit unless the method name says 64; memory operands are [RBP + disp32] or [RSP].
+/// </summary>
+class X64Emitter
+{
+private:
+	u8* cursor;
+
+	static inline u8 low(X64Reg r) { return (u8)r & 7; }
+	static inline u8 high(X64Reg r) { return ((u8)r >> 3) & 1; }
+
+	inline void rex(bool w, X64Reg reg, X64Reg rm)
+	{
+		u8 prefix = 0x40 | (w << 3) | (high(reg) << 2) | high(rm);
+		if (prefix != 0x40) byte(prefix);
+	}
+
+	inline void modrm_reg(u8 reg, X64Reg rm) { byte(0xC0 | (reg << 3) | low(rm)); }
+
+	// [rbp + disp32]
+	inline void modrm_rbp(u8 reg, s32 disp) { byte(0x85 | (reg << 3)); dword((u32)disp); }
+
+	// [rsp]
+	inline void modrm_rsp(u8 reg) { byte(0x04 | (reg << 3)); byte(0x24); }
+public:
+	// ALU opcodes, reg/reg form
+	static const u8 ADD = 0x01;
+	static const u8 OR = 0x09;
+	static const u8 AND = 0x21;
+	static const u8 SUB = 0x29;
+	static const u8 XOR = 0x31;
+	static const u8 CMP = 0x39;
+
+	// 0x81 /ext immediate forms
+	static const u8 EXT_ADD = 0;
+	static const u8 EXT_OR = 1;
+	static const u8 EXT_AND = 4;
+	static const u8 EXT_SUB = 5;
+	static const u8 EXT_XOR = 6;
+	static const u8 EXT_CMP = 7;
+
+	// 0xC1 /ext shift forms
+	static const u8 EXT_ROR = 1;
+	static const u8 EXT_SHL = 4;
+	static const u8 EXT_SHR = 5;
+	static const u8 EXT_SAR = 7;
+
+	// Jcc condition codes
+	static const u8 JE = 0x4;
+	static const u8 JNE = 0x5;
+	static const u8 JLE = 0xE;
+
+	X64Emitter(u8* code) : cursor{ code } { }
+
+	u8* get_cursor() const { return cursor; }
+
+	inline void byte(u8 value) { *cursor++ = value; }
+	inline void dword(u32 value) { memcpy(cursor, &value, 4); cursor += 4; }
+	inline void qword(u64 value) { memcpy(cursor, &value, 8); cursor += 8; }
+
+	inline void mov(X64Reg dst, X64Reg src) { rex(false, src, dst); byte(0x89); modrm_reg(low(src), dst); }
+	inline void mov(X64Reg dst, u32 imm) { rex(false, X64Reg::RAX, dst); byte(0xB8 | low(dst)); dword(imm); }
+	inline void mov64(X64Reg dst, X64Reg src) { rex(true, src, dst); byte(0x89); modrm_reg(low(src), dst); }
+	inline void mov64(X64Reg dst, u64 imm) { rex(true, X64Reg::RAX, dst); byte(0xB8 | low(dst)); qword(imm); }
+
+	/// <summary>
+	/// mov [base], src (64-bit); base must not be RSP, RBP, R12 or R13
+	/// </summary>
+	inline void mov64_store(X64Reg base, X64Reg src) { rex(true, src, base); byte(0x89); byte((low(src) << 3) | low(base)); }
+
+	inline void load_rbp(X64Reg dst, s32 disp) { rex(false, dst, X64Reg::RBP); byte(0x8B); modrm_rbp(low(dst), disp); }
+	inline void store_rbp(s32 disp, X64Reg src) { rex(false, src, X64Reg::RBP); byte(0x89); modrm_rbp(low(src), disp); }
+	inline void store_rbp(s32 disp, u32 imm) { byte(0xC7); modrm_rbp(0, disp); dword(imm); }
+	inline void store8_rbp(s32 disp, u8 imm) { byte(0xC6); modrm_rbp(0, disp); byte(imm); }
+
+	inline void load_rsp(X64Reg dst) { rex(false, dst, X64Reg::RSP); byte(0x8B); modrm_rsp(low(dst)); }
+	inline void store_rsp(X64Reg src) { rex(false, src, X64Reg::RSP); byte(0x89); modrm_rsp(low(src)); }
+	inline void sub_rsp_mem(u32 imm) { byte(0x81); modrm_rsp(EXT_SUB); dword(imm); }
+	inline void sub_rsp_mem(X64Reg src) { rex(false, src, X64Reg::RSP); byte(0x29); modrm_rsp(low(src)); }
+
+	inline void alu(u8 op, X64Reg dst, X64Reg src) { rex(false, src, dst); byte(op); modrm_reg(low(src), dst); }
+	inline void alu(u8 ext, X64Reg dst, u32 imm) { rex(false, X64Reg::RAX, dst); byte(0x81); modrm_reg(ext, dst); dword(imm); }
+	inline void shift(u8 ext, X64Reg dst, u8 amount) { rex(false, X64Reg::RAX, dst); byte(0xC1); modrm_reg(ext, dst); byte(amount); }
+	inline void not_(X64Reg dst) { rex(false, X64Reg::RAX, dst); byte(0xF7); modrm_reg(2, dst); }
+	inline void test(X64Reg a, X64Reg b) { rex(false, b, a); byte(0x85); modrm_reg(low(b), a); }
+
+	inline void push(X64Reg r) { rex(false, X64Reg::RAX, r); byte(0x50 | low(r)); }
+	inline void pop(X64Reg r) { rex(false, X64Reg::RAX, r); byte(0x58 | low(r)); }
+	inline void sub_rsp(u8 imm) { byte(0x48); byte(0x83); byte(0xEC); byte(imm); }
+	inline void add_rsp(u8 imm) { byte(0x48); byte(0x83); byte(0xC4); byte(imm); }
+	inline void call(X64Reg r) { rex(false, X64Reg::RAX, r); byte(0xFF); modrm_reg(2, r); }
+	inline void jmp(X64Reg r) { rex(false, X64Reg::RAX, r); byte(0xFF); modrm_reg(4, r); }
+	inline void ret() { byte(0xC3); }
+
+	/// <summary>
+	/// Emits jmp rel32 and returns the address of its displacement, for patch()
+	/// </summary>
+	inline u8* jmp(const u8* target)
+	{
+		byte(0xE9);
+		u8* field = cursor;
+		dword(0);
+		patch(field, target);
+		return field;
+	}
+
+	/// <summary>
+	/// Emits a conditional jump and returns the address of its displacement, for patch()
+	/// </summary>
+	inline u8* jcc(u8 cc, const u8* target)
+	{
+		byte(0x0F);
+		byte(0x80 | cc);
+		u8* field = cursor;
+		dword(0);
+		patch(field, target);
+		return field;
+	}
+
+	/// <summary>
+	/// Points the rel32 displacement at field to target
+	/// </summary>
+	static inline void patch(u8* field, const u8* target)
+	{
+		s32 rel = (s32)(target - (field + 4));
+		memcpy(field, &rel, 4);
+	}
+};
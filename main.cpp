@@ -3,6 +3,7 @@
 #include "Memory.h"
 #include "StorageTransactions.h"
 #include "Cpu.h"
+#include "HLEBios.h"
 
 int main()
 {
@@ -10,13 +11,26 @@ int main()
     {
         Memory* memory = new Memory();
 
-        StorageTransactions::load_BIOS(memory, "bios\\gba_bios.bin");
-        StorageTransactions::load_GBA(memory, "roms\\main.gba");
+        StorageTransactions::map_GBA(memory, "roms\\main.gba");
 
         Cpu cpu(memory);
 
-        for (int i = 0; i < 0x1BC / 4; i++)
-            cpu.do_cycle();
+        try
+        {
+            StorageTransactions::load_BIOS(memory, "bios\\gba_bios.bin");
+        }
+        catch (const ROMLoadingException&)
+        {
+            // no BIOS image: emulate its calls and start in the game
+            cpu.set_hle_bios(true);
+            HLEBios::boot(&cpu);
+        }
+
+        // trace the first 0x1BC / 4 instructions; with tracing on, run_until checks before each one.
+        // run counts cycles, so the budget only caps a CPU that halts: a second of guest time
+        cpu.set_trace(&std::cout);
+        u32 instructions = 0;
+        cpu.run_until([&] { return instructions++ == 0x1BC / 4; }, 1 << 24);
 
 
         MemoryDump(memory, MemoryDump::DumpType::ROM).write_to_file("rom_dump.bin");